@@ -0,0 +1,208 @@
+/* CPU sets and thread affinity are GNU extensions */
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifdef __linux__
+# include <sched.h>
+#endif
+
+#include "htm.h"
+#include "affinity.h"
+#include "utils.h"
+
+/* the cpulist of a NUMA node, or of the online nodes */
+#define NODE_PATH "/sys/devices/system/node/"
+
+int32_t
+parse_cpu_list (const char *list, int32_t *cpus, uint32_t max)
+{
+    const char *p = list;
+    char *end = NULL;
+    long first, last;
+    uint32_t n = 0;
+
+    while (*p && *p != '\n') {
+        first = last = strtol(p, &end, 10);
+        if (end == p || first < 0)
+            return -1;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first)
+                return -1;
+        }
+        for (; first<=last; first++) {
+            if (n == max)
+                return -1;
+            cpus[n++] = (int32_t)first;
+        }
+        p = end;
+        if (*p == ',')
+            p++;
+        else if (*p && *p != '\n')
+            return -1;
+    }
+
+    return (int32_t)n;
+}
+
+#ifdef __linux__
+
+/* the CPUs of the process, in order */
+static int32_t
+allowed_cpus (int32_t *cpus, uint32_t max)
+{
+    cpu_set_t set;
+    uint32_t c, n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set)) {
+        ERR("Failed to get the CPUs of the process\n");
+        return -1;
+    }
+    for (c=0; c<CPU_SETSIZE && n<max; c++)
+        if (CPU_ISSET(c, &set))
+            cpus[n++] = c;
+
+    return (int32_t)n;
+}
+
+static int32_t
+read_cpu_list (const char *path, int32_t *cpus, uint32_t max)
+{
+    char line[4096];
+    FILE *f = fopen(path, "r");
+    int32_t n = -1;
+
+    if (!f)
+        return -1;
+    if (fgets(line, sizeof(line), f))
+        n = parse_cpu_list(line, cpus, max);
+    fclose(f);
+
+    return n;
+}
+
+/* the allowed CPUs, one of every node in turn. without the
+   node topology they stay in order. */
+static int32_t
+spread_cpus (int32_t *cpus, uint32_t max)
+{
+    int32_t allowed[MAX_AFFINITY_CPUS], nodes[MAX_AFFINITY_CPUS];
+    int32_t node_cpus[MAX_AFFINITY_CPUS];
+    int32_t *node_of = NULL, *taken = NULL;
+    int32_t num_allowed, num_nodes, num_cpus, i, j, k;
+    char path[64];
+    uint32_t n = 0;
+    char found = 1;
+
+    if ((num_allowed = allowed_cpus(allowed, MAX_AFFINITY_CPUS)) < 0)
+        return -1;
+    num_nodes = read_cpu_list(NODE_PATH "online", nodes, MAX_AFFINITY_CPUS);
+    node_of = malloc(sizeof(int32_t)*num_allowed);
+    taken = calloc(num_allowed, sizeof(int32_t));
+    if (!node_of || !taken) {
+        ERR("No memory to spread the threads\n");
+        free(node_of);
+        free(taken);
+        return -1;
+    }
+
+    /* the node of every allowed CPU, as an index into nodes */
+    for (i=0; i<num_allowed; i++)
+        node_of[i] = 0;
+    for (j=0; j<num_nodes; j++) {
+        snprintf(path, sizeof(path), NODE_PATH "node%d/cpulist",
+            nodes[j]);
+        num_cpus = read_cpu_list(path, node_cpus, MAX_AFFINITY_CPUS);
+        for (k=0; k<num_cpus; k++)
+            for (i=0; i<num_allowed; i++)
+                if (allowed[i] == node_cpus[k])
+                    node_of[i] = j;
+    }
+    if (num_nodes < 1)
+        num_nodes = 1;
+
+    /* one round takes the first CPU left of every node */
+    while (found && n < max) {
+        found = 0;
+        for (j=0; j<num_nodes && n<max; j++) {
+            for (i=0; i<num_allowed; i++) {
+                if (!taken[i] && node_of[i] == j) {
+                    taken[i] = 1;
+                    cpus[n++] = allowed[i];
+                    found = 1;
+                    break;
+                }
+            }
+        }
+    }
+
+    free(node_of);
+    free(taken);
+
+    return (int32_t)n;
+}
+
+int32_t
+pin_thread_attr (pthread_attr_t *attr, int32_t cpu)
+{
+    cpu_set_t set;
+    int rc;
+
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        ERR("No CPU %d to pin a thread to\n", cpu);
+        return 1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if ((rc = pthread_attr_setaffinity_np(attr, sizeof(set), &set))) {
+        ERR("Failed to pin a thread to CPU %d: %d\n", cpu, rc);
+        return 1;
+    }
+
+    return 0;
+}
+
+#else
+
+int32_t
+pin_thread_attr (pthread_attr_t *attr, int32_t cpu)
+{
+    (void)attr;
+    (void)cpu;
+
+    return 0;
+}
+
+#endif
+
+int32_t
+affinity_cpus (const char *affinity, int32_t *cpus, uint32_t max)
+{
+    int32_t n;
+
+    if (!affinity || !strcmp(affinity, "false"))
+        return 0;
+#ifndef __linux__
+    WARN("Thread affinity is not supported here, ignored\n");
+    return 0;
+#else
+    if (!strcmp(affinity, "compact") || !strcmp(affinity, "true"))
+        n = allowed_cpus(cpus, max);
+    else if (!strcmp(affinity, "spread"))
+        n = spread_cpus(cpus, max);
+    else
+        n = parse_cpu_list(affinity, cpus, max);
+    if (n <= 0) {
+        ERR("Bad thread affinity %s\n", affinity);
+        return -1;
+    }
+
+    return n;
+#endif
+}
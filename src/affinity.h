@@ -0,0 +1,39 @@
+/* Interface for pinning the layer threads to CPUs. The affinity
+attribute of the conf picks the CPUs, in the order the threads
+take them:
+
+    false       none, the threads float (the default)
+    compact     the CPUs the process may run on, in order. true
+                is the same
+    spread      the same CPUs, taking one from every NUMA node
+                in turn, so threads reach the memory of every
+                socket
+    0-3,8,10    a list of CPUs, as in the kernel's cpulist
+
+Thread t runs on the (t mod n)th of the n CPUs. Pinning is only
+supported on Linux, elsewhere the threads float with a warning. */
+#ifndef AFFINITY_H_
+#define AFFINITY_H_ 1
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* most CPUs an affinity may name */
+#define MAX_AFFINITY_CPUS 1024
+
+/* parse a cpulist, "0-3,8". returns the number of CPUs put in
+   cpus, or -1 when the list is malformed or names more than
+   max. */
+int32_t
+parse_cpu_list (const char *list, int32_t *cpus, uint32_t max);
+
+/* the CPUs of an affinity, as above. returns their number, 0
+   for none, or -1 on a bad affinity. */
+int32_t
+affinity_cpus (const char *affinity, int32_t *cpus, uint32_t max);
+
+/* make threads created with attr run on cpu alone */
+int32_t
+pin_thread_attr (pthread_attr_t *attr, int32_t cpu);
+
+#endif
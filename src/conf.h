@@ -25,6 +25,23 @@ struct layer4_conf
         float column_complexity;
         char high_tier;
         uint32_t activity_cycle_window;
+        /* largest fraction of input bits that may change
+           between steps for overlaps to be updated from the
+           difference. 0 always recomputes. */
+        float delta_overlap_max;
+        /* build the input bit to synapse index even without
+           delta updates, so sparse inputs are walked by their
+           active bits */
+        char input_index;
+        /* fraction of the receptive field each minicolumn has
+           synapses on, sampled at random. 0 takes all of it. */
+        float potential_pct;
+        /* run the plain scalar kernels every faster one is
+           tested against, with overlaps counted in full */
+        char reference;
+        /* seeds the sampling, and the initial permanences of
+           sampled synapses. unsigned long, as parsed. */
+        unsigned long seed;
     } colconf;
 
 };
@@ -34,6 +51,24 @@ struct htm_conf
 {
     char *target;
     char allow_boosting;
+    /* run the codec on a producer thread, one pattern ahead
+       of the spatial pooler */
+    char pipelined;
+    /* map restored synapses read-only and shared with every
+       other process restoring the same checkpoint. learning is
+       off in this mode. */
+    char shared_model;
+    /* publish a snapshot of layer 4 after every step, for
+       htm_read_snapshot */
+    char snapshots;
+    /* a kernel plugin generated for layer 4 by kernelgen, loaded
+       when it matches the layer. a path with no slash is searched
+       in the library path. see plugin.h. */
+    char *kernels;
+    /* the threads layer 4 runs on, one when unset, and the
+       CPUs they are pinned to. see affinity.h. */
+    unsigned long threads;
+    char *affinity;
     struct layer6_conf layer6conf;
     struct layer4_conf layer4conf;
 };
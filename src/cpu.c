@@ -0,0 +1,98 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "htm.h"
+#include "cpu.h"
+#include "utils.h"
+
+static const char *level_names[CPU_NUM_LEVELS] =
+{
+    "sse2",
+    "popcnt",
+    "avx2",
+    "avx512"
+};
+
+static pthread_once_t dispatch_once = PTHREAD_ONCE_INIT;
+static enum cpu_level bound = CPU_SSE2;
+
+enum cpu_level
+cpu_detect (void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") &&
+        __builtin_cpu_supports("avx512bw") &&
+        __builtin_cpu_supports("avx512vpopcntdq"))
+        return CPU_AVX512;
+    /* every AVX2 part has popcnt, but it is its own bit */
+    if (__builtin_cpu_supports("avx2") &&
+        __builtin_cpu_supports("popcnt"))
+        return CPU_AVX2;
+    if (__builtin_cpu_supports("popcnt"))
+        return CPU_POPCNT;
+#endif
+
+    return CPU_SSE2;
+}
+
+const char*
+cpu_level_name (enum cpu_level level)
+{
+    return level < CPU_NUM_LEVELS ? level_names[level] : "unknown";
+}
+
+enum cpu_level
+cpu_bind (enum cpu_level level)
+{
+    enum cpu_level max = cpu_detect();
+
+    if (level > max)
+        level = max;
+    bind_sdr_kernels(level);
+    bind_mc_kernels(level);
+    bound = level;
+
+    return level;
+}
+
+enum cpu_level
+cpu_bound (void)
+{
+    return bound;
+}
+
+static void
+dispatch (void)
+{
+    enum cpu_level level = cpu_detect();
+    const char *cap = getenv("HTM_CPU");
+    uint32_t l;
+
+    if (cap) {
+        for (l=0; l<CPU_NUM_LEVELS; l++)
+            if (!strcmp(cap, level_names[l]))
+                break;
+        if (l == CPU_NUM_LEVELS)
+            WARN("Unknown HTM_CPU %s, ignored\n", cap);
+        else if (l < level)
+            level = l;
+    }
+
+    INFO("Using the %s kernels\n", level_names[cpu_bind(level)]);
+}
+
+void
+cpu_dispatch (void)
+{
+    pthread_once(&dispatch_once, dispatch);
+}
+
+const char*
+htm_cpu_level (void)
+{
+    cpu_dispatch();
+
+    return level_names[bound];
+}
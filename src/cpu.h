@@ -0,0 +1,51 @@
+/* Interface for picking the hot kernels by what the CPU running
+the library supports. The library is built for the SSE2 baseline,
+and the faster kernels are compiled for their instruction sets
+alone, so one build runs everywhere and uses what it finds.
+
+HTM_CPU in the environment caps the level, by name. */
+#ifndef CPU_H_
+#define CPU_H_ 1
+
+/* every level includes the ones below it */
+enum cpu_level
+{
+    CPU_SSE2,
+    /* the popcnt instruction */
+    CPU_POPCNT,
+    /* AVX2, with popcnt */
+    CPU_AVX2,
+    /* AVX-512 F, BW and VPOPCNTDQ, with AVX2 */
+    CPU_AVX512,
+    CPU_NUM_LEVELS
+};
+
+/* the highest level this CPU supports */
+enum cpu_level
+cpu_detect (void);
+
+/* bind the kernels for the detected level, or HTM_CPU's if it
+   is lower. only the first call does anything, so it is called
+   wherever kernels may be about to run. */
+void
+cpu_dispatch (void);
+
+/* bind the kernels of level, at most the detected one. not
+   safe while layers are stepping. */
+enum cpu_level
+cpu_bind (enum cpu_level level);
+
+/* the level bound */
+enum cpu_level
+cpu_bound (void);
+
+const char*
+cpu_level_name (enum cpu_level level);
+
+/* the binding done by each module with kernels of its own */
+void
+bind_sdr_kernels (enum cpu_level level);
+void
+bind_mc_kernels (enum cpu_level level);
+
+#endif
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 /* import interface for input pattern representations from encoders*/
 #include "repr.h"
@@ -11,63 +12,204 @@
 #include "parse_conf.h"
 #include "layer.h"
 #include "htm.h"
+#include "pipeline.h"
+#include "cpu.h"
+#include "plugin.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
 /* the parsed htm config structure */
 extern struct htm_conf htmconf;
-/* callback function pointer from an encoder that returns
-new input patterns */
-codec_cb codec_callback;
-/* the structure that stores various input patterns returned
-by the encoder */
-input_patterns *ip_container;
-/* pointers to layer objects */
-struct layer *layer4, *layer6;
+/* the parser fills the global above, so contexts created
+concurrently take turns at it */
+static pthread_mutex_t conf_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static int32_t get_codec_input (void);
+/* everything one htm instance owns. nothing in the library
+outlives it or is shared with another context. */
+struct htm_ctx
+{
+    /* the config the context was created with */
+    struct htm_conf conf;
+    /* callback function pointer from an encoder that returns
+    new input patterns */
+    codec_cb codec_callback;
+    /* the structure that stores various input patterns returned
+    by the encoder */
+    input_patterns *ip_container;
+    /* pointers to layer objects */
+    struct layer *layer4, *layer6;
+    /* patterns the codec produced ahead, when pipelined */
+    struct input_ring ring;
+    /* steps run so far, and the frames they are published
+       through when snapshots are on */
+    uint64_t step;
+    struct snapshot_buf snaps;
+    /* steps and codec waits, the layer threads keep the rest */
+    htm_stats_t stats;
+    /* timeline being recorded, if any */
+    struct tracer *tracer;
+};
+
+static int32_t get_codec_input (struct htm_ctx *ctx);
+static int32_t start_pipelined_input (struct htm_ctx *ctx);
+static int32_t start_htm (struct htm_ctx *ctx, const char *ckpt);
+
+struct htm_ctx*
+init_htm (codec_cb cb)
+{
+    struct htm_ctx *ctx = NULL;
+
+    if (!(ctx = calloc(1, sizeof(struct htm_ctx)))) {
+        ERR("No memory for the htm context\n");
+        return NULL;
+    }
+    ctx->codec_callback = cb;
+
+    if (start_htm(ctx, NULL)) {
+        free_htm(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
+
+struct htm_ctx*
+restore_htm (codec_cb cb, const char *path)
+{
+    struct htm_ctx *ctx = NULL;
+
+    if (!path) {
+        ERR("checkpoint path is null\n");
+        return NULL;
+    }
+
+    if (!(ctx = calloc(1, sizeof(struct htm_ctx)))) {
+        ERR("No memory for the htm context\n");
+        return NULL;
+    }
+    ctx->codec_callback = cb;
+
+    if (start_htm(ctx, path)) {
+        free_htm(ctx);
+        return NULL;
+    }
+
+    return ctx;
+}
 
-/* parse htm configuration parameters. get first input
-pattern set from codec. then initialize the htm layers */
 int32_t
-init_htm (codec_cb cb)
+checkpoint_htm (struct htm_ctx *ctx, const char *path)
+{
+    if (!ctx || !ctx->layer4 || !ctx->ip_container) {
+        ERR("You must init the htm first.\n");
+        return 1;
+    }
+
+    return save_l4_delta(ctx->layer4, path);
+}
+
+int32_t
+sync_checkpoint_htm (struct htm_ctx *ctx)
+{
+    if (!ctx || !ctx->layer4) {
+        ERR("You must init the htm first.\n");
+        return 1;
+    }
+
+    return sync_l4_ckpt(ctx->layer4);
+}
+
+/* parse htm configuration parameters. get first input
+pattern set from codec. then initialize the htm layers,
+or map them from the checkpoint at ckpt */
+static int32_t
+start_htm (struct htm_ctx *ctx, const char *ckpt)
 {
+    int32_t rc;
+
     INFO("Initializing HTM...\n");
+    cpu_dispatch();
 
-    if (!cb) {
+    if (!ctx->codec_callback) {
         ERR("codec callback is null\n");
         return 1;
     }
 
-    if (parse_htm_conf())
+    pthread_mutex_lock(&conf_lock);
+    rc = parse_htm_conf();
+    ctx->conf = htmconf;
+    pthread_mutex_unlock(&conf_lock);
+    if (rc)
         return 1;
 
-    codec_callback = cb;
-
     /* initialize each htm layer */
     /*
-    if (!alloc_layer6(htmconf.layer6conf)) {
+    if (!(ctx->layer6 = alloc_layer6(ctx->conf.layer6conf))) {
         ERR("Failed layer6 allocation\n");
         return 1;
     }
     */
-    if (!alloc_layer4(htmconf.layer4conf)) {
+    if (!ckpt &&
+        !(ctx->layer4 = alloc_layer4(ctx->conf.layer4conf))) {
         ERR("Failed layer4 allocation\n");
         return 1;
     }
+    /* before init_l4, so every thread places its own rows */
+    if (!ckpt && layer4_set_threads(ctx->layer4,
+            ctx->conf.threads, ctx->conf.affinity)) {
+        ERR("Failed to set up the layer4 threads\n");
+        return 1;
+    }
 
     DEBUG("Getting first codec input pattern.\n");
-    if (get_codec_input()) {
+    if (get_codec_input(ctx)) {
         ERR("Call to codec failed\n");
         return 1;
     }
 
-    /* L4 is the second layer in the feedforward circuit */
-    DEBUG("Initializing layer 4...\n");
-    if (init_l4(
-            ip_container->sensory_pattern,
-            htmconf.layer4conf.colconf.rec_field_sz)>0
-    ) {
-        ERR("Failed layer4 initialization\n");
+    /* from here on the codec runs one pattern ahead on its
+       own thread */
+    if (ctx->conf.pipelined && start_pipelined_input(ctx)) {
+        ERR("Failed to start the input pipeline\n");
+        return 1;
+    }
+
+    if (ckpt) {
+        DEBUG("Restoring layer 4...\n");
+        if (!(ctx->layer4 = map_l4(ckpt,
+                ctx->ip_container->sensory_pattern,
+                ctx->conf.shared_model))) {
+            ERR("Failed layer4 restore\n");
+            return 1;
+        }
+        if (layer4_set_threads(ctx->layer4,
+                ctx->conf.threads, ctx->conf.affinity)) {
+            ERR("Failed to set up the layer4 threads\n");
+            return 1;
+        }
+    } else {
+        /* L4 is the second layer in the feedforward circuit */
+        DEBUG("Initializing layer 4...\n");
+        if (init_l4(ctx->layer4,
+                ctx->ip_container->sensory_pattern,
+                ctx->conf.layer4conf.colconf.rec_field_sz)>0
+        ) {
+            ERR("Failed layer4 initialization\n");
+            return 1;
+        }
+    }
+
+    if (ctx->conf.kernels &&
+        layer4_load_kernels(ctx->layer4, ctx->conf.kernels)) {
+        ERR("Failed to load the layer4 kernels\n");
+        return 1;
+    }
+
+    if (ctx->conf.snapshots &&
+        alloc_snapshots(&ctx->snaps, ctx->layer4)) {
+        ERR("No memory for layer4 snapshots\n");
         return 1;
     }
 
@@ -165,22 +307,27 @@ free_ip (input_patterns *patts)
 */
 
 static int32_t
-get_codec_input (void)
+get_codec_input (struct htm_ctx *ctx)
 {
     input_patterns *cb_ip = NULL;
     uint32_t d;
 
+    /* the first pattern is always fetched synchronously */
+    if (ctx->conf.pipelined && ctx->ip_container)
+        return next_pipelined_input(&ctx->ring,
+            ctx->ip_container->sensory_pattern);
+
 /*
     cb_ip = codec_callback();
 */
-    free(ip_container); /* nullptr is fine */
-    ip_container = codec_callback();
+    free(ctx->ip_container); /* nullptr is fine */
+    ctx->ip_container = ctx->codec_callback();
 
-    if (!ip_container) {
+    if (!ctx->ip_container) {
         ERR("Codec returned null container.\n");
         return 1;
     }
-    if (!ip_container->sensory_pattern) {
+    if (!ctx->ip_container->sensory_pattern) {
         ERR("Codec returned null sensory pattern.\n");
         return 1;
     }
@@ -198,35 +345,266 @@ get_codec_input (void)
     return 0;
 }
 
+/* the producer thread writes into the codec's patterns
+behind our back, so the layer is initialized over a library
+owned copy of the first pattern instead. the location pattern
+is not carried through the ring. */
+static int32_t
+start_pipelined_input (struct htm_ctx *ctx)
+{
+    input_patterns *ip_container = ctx->ip_container;
+    repr_t *cb_rep = ip_container->sensory_pattern;
+    repr_t *live = NULL;
+
+    live = new_repr(cb_rep->rows, cb_rep->cols);
+    if (!live)
+        return 1;
+    if (copy_repr(live, cb_rep)) {
+        free_repr(live);
+        return 1;
+    }
+
+    ip_container->sensory_pattern = live;
+    ip_container->location_pattern = NULL;
+
+    if (start_input_pipeline(&ctx->ring, ctx->codec_callback, live)) {
+        ip_container->sensory_pattern = cb_rep;
+        free_repr(live);
+        return 1;
+    }
+
+    return 0;
+}
+
 int32_t
-run_cortical_algorithm (void)
+run_cortical_algorithm (struct htm_ctx *ctx)
 {
-    if (!layer4 || !ip_container) {
+    struct trace_buf *tb = NULL;
+
+    if (!ctx || !ctx->layer4 || !ctx->ip_container) {
         ERR("You must init the htm first.\n");
         return 1;
     }
+    tb = ctx->tracer ? &ctx->tracer->bufs[0] : NULL;
 
-    if (layer4_feedforward()>0)
+    TRACE_BEGIN(tb, t_step);
+    if (layer4_feedforward(ctx->layer4)>0)
         return 1;
+    TRACE_END(tb, TRACE_STEP, t_step);
+    ctx->step++;
+    STATS_ADD(&ctx->stats, steps, 1);
+    if (ctx->conf.snapshots)
+        publish_l4_snapshot(&ctx->snaps, ctx->layer4, ctx->step);
 
     /* get next input pattern from codec */
-    if (get_codec_input()) {
+    STATS_TIME(t);
+    TRACE_BEGIN(tb, t_codec);
+    if (get_codec_input(ctx)) {
         ERR("Failed to get next pattern from codec\n");
         return 1;
     }
+    STATS_PHASE(&ctx->stats, HTM_PHASE_CODEC_WAIT, t);
+    TRACE_END(tb, TRACE_CODEC_WAIT, t_codec);
+
+    return 0;
+}
+
+int32_t
+htm_score_batch (
+    struct htm_ctx *ctx,
+    repr_t **inputs,
+    repr_t **outputs,
+    uint32_t n
+) {
+    if (!ctx || !ctx->layer4) {
+        ERR("You must init the htm first.\n");
+        return 1;
+    }
+
+    return layer4_score_batch(ctx->layer4, inputs, outputs, n);
+}
+
+active_columns_t*
+htm_replay_batch (struct htm_ctx *ctx, repr_t **inputs, uint32_t n)
+{
+    if (!ctx || !ctx->layer4) {
+        ERR("You must init the htm first.\n");
+        return NULL;
+    }
+
+    return layer4_replay(ctx->layer4, inputs, n);
+}
+
+void
+free_active_columns (active_columns_t *ac)
+{
+    if (!ac)
+        return;
+
+    free(ac->offsets);
+    free(ac->columns);
+    free(ac);
+}
+
+uint32_t
+htm_get_active_columns (struct htm_ctx *ctx, uint32_t *out, uint32_t cap)
+{
+    if (!ctx || !ctx->layer4) {
+        ERR("You must init the htm first.\n");
+        return 0;
+    }
+
+    return layer4_active_columns(ctx->layer4, out, cap);
+}
+
+const repr_t*
+htm_get_active_bitset (struct htm_ctx *ctx)
+{
+    if (!ctx || !ctx->layer4) {
+        ERR("You must init the htm first.\n");
+        return NULL;
+    }
+
+    return ctx->layer4->state->active;
+}
+
+int32_t
+htm_get_state_view (struct htm_ctx *ctx, state_view_t *view)
+{
+    if (!ctx || !ctx->layer4) {
+        ERR("You must init the htm first.\n");
+        return 1;
+    }
+
+    return layer4_state_view(ctx->layer4, view);
+}
+
+const snapshot_t*
+htm_read_snapshot (struct htm_ctx *ctx)
+{
+    if (!ctx || !ctx->conf.snapshots || !ctx->snaps.frames[0].active)
+        return NULL;
+
+    return read_snapshot(&ctx->snaps);
+}
+
+int32_t
+htm_get_thread_stats (struct htm_ctx *ctx, uint32_t t, htm_stats_t *stats)
+{
+    if (!ctx || !ctx->layer4) {
+        ERR("You must init the htm first.\n");
+        return 1;
+    }
+    if (t >= ctx->layer4->state->num_threads) {
+        ERR("No layer thread %u of %u\n", t, ctx->layer4->state->num_threads);
+        return 1;
+    }
+
+    memset(stats, 0, sizeof(htm_stats_t));
+    stats->steps = ctx->stats.steps;
+    stats->threads = ctx->layer4->state->num_threads;
+    add_stats(stats, &ctx->layer4->state->td[t].stats);
+    /* the stepping thread's own share */
+    if (!t)
+        add_stats(stats, &ctx->stats);
+
+    return 0;
+}
+
+int32_t
+htm_get_stats (struct htm_ctx *ctx, htm_stats_t *stats)
+{
+    htm_stats_t ts;
+    uint32_t t;
+
+    if (htm_get_thread_stats(ctx, 0, stats))
+        return 1;
+    for (t=1; t<ctx->layer4->state->num_threads; t++) {
+        htm_get_thread_stats(ctx, t, &ts);
+        add_stats(stats, &ts);
+    }
+
+    return 0;
+}
+
+void
+htm_reset_stats (struct htm_ctx *ctx)
+{
+    uint32_t t;
+
+    if (!ctx || !ctx->layer4)
+        return;
+
+    memset(&ctx->stats, 0, sizeof(htm_stats_t));
+    for (t=0; t<ctx->layer4->state->num_threads; t++)
+        memset(&ctx->layer4->state->td[t].stats, 0, sizeof(htm_stats_t));
+}
+
+int32_t
+htm_start_trace (struct htm_ctx *ctx, uint32_t max_spans)
+{
+    if (!ctx || !ctx->layer4) {
+        ERR("You must init the htm first.\n");
+        return 1;
+    }
+
+    /* a trace that was not written yet is thrown away */
+    trace_layer4(ctx->layer4, NULL);
+    free_tracer(ctx->tracer);
+    if (!(ctx->tracer = alloc_tracer(ctx->layer4->state->num_threads, max_spans))) {
+        ERR("No memory for the trace buffers\n");
+        return 1;
+    }
+    trace_layer4(ctx->layer4, ctx->tracer);
 
     return 0;
 }
 
+int32_t
+htm_dump_trace (struct htm_ctx *ctx, const char *path)
+{
+    int32_t rc;
+
+    if (!ctx || !ctx->tracer) {
+        ERR("No trace was started\n");
+        return 1;
+    }
+
+    trace_layer4(ctx->layer4, NULL);
+    rc = write_trace(ctx->tracer, path);
+    free_tracer(ctx->tracer);
+    ctx->tracer = NULL;
+
+    return rc;
+}
+
 struct layer*
-get_layer4 (void)
+get_layer4 (struct htm_ctx *ctx)
 {
-    return layer4;
+    return ctx->layer4;
 }
 
 input_patterns*
-get_htm_input_patterns (void)
+get_htm_input_patterns (struct htm_ctx *ctx)
 {
-    return ip_container;
+    return ctx->ip_container;
 }
 
+void
+free_htm (struct htm_ctx *ctx)
+{
+    if (!ctx)
+        return;
+
+    /* the pattern is the layer's input, the layer goes first */
+    free_l4(ctx->layer4);
+    if (ctx->conf.pipelined && ctx->ip_container &&
+        ctx->ring.running) {
+        stop_input_pipeline(&ctx->ring);
+        free_repr(ctx->ip_container->sensory_pattern);
+    }
+    free(ctx->ip_container); /* nullptr is fine */
+    free_snapshots(&ctx->snaps);
+    free_tracer(ctx->tracer);
+    free(ctx);
+}
@@ -9,6 +9,8 @@ in ISO 1999 Standard C (C99). */
 /* C99 fixed-width data types for increased type
 portability */
 #include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
 
 /* Renaming trick to make sure users include the htm
 interface. This will cause linker errors if they don't. The
@@ -21,6 +23,31 @@ times by some amount due to the extra token replacements. */
 #define get_layer4 INT_get_layer4
 #define get_htm_input_patterns INT_get_htm_input_patterns
 #define mc_active_at INT_mc_active_at
+#define free_htm INT_free_htm
+#define checkpoint_htm INT_checkpoint_htm
+#define restore_htm INT_restore_htm
+#define sync_checkpoint_htm INT_sync_checkpoint_htm
+#define htm_score_batch INT_htm_score_batch
+#define htm_replay_batch INT_htm_replay_batch
+#define free_active_columns INT_free_active_columns
+#define htm_get_active_columns INT_htm_get_active_columns
+#define htm_get_active_bitset INT_htm_get_active_bitset
+#define htm_get_state_view INT_htm_get_state_view
+#define htm_read_snapshot INT_htm_read_snapshot
+#define htm_start_async_log INT_htm_start_async_log
+#define htm_stop_async_log INT_htm_stop_async_log
+#define htm_get_stats INT_htm_get_stats
+#define htm_get_thread_stats INT_htm_get_thread_stats
+#define htm_reset_stats INT_htm_reset_stats
+#define htm_start_trace INT_htm_start_trace
+#define htm_dump_trace INT_htm_dump_trace
+#define htm_start_recording INT_htm_start_recording
+#define htm_recording_codec INT_htm_recording_codec
+#define htm_stop_recording INT_htm_stop_recording
+#define htm_start_playback INT_htm_start_playback
+#define htm_playback_codec INT_htm_playback_codec
+#define htm_stop_playback INT_htm_stop_playback
+#define htm_cpu_level INT_htm_cpu_level
 
 /* inform C++ callers that this is C code */
 #ifdef __cplusplus
@@ -28,28 +55,270 @@ extern "C" {
 #endif
 
 #include "repr.h"
+#include "sdr.h"
 
-/* initialize the htmc library: parses the XML configuration
-file, and sets the encoder callback. */
-extern int32_t
+/* the rows of the bit array of a repr_t are padded to 64 bits
+since REPR_LAYOUT 2. a codec built against the flat layout of
+layout 1 that fills the bit array itself must be rebuilt, and
+either set bits with the repr.h macros, hand over indices with
+set_active_repr, or convert its bitstream with repr_from_flat.
+a codec can check REPR_LAYOUT to tell which build it is in. */
+
+/* the active minicolumns of a run of steps. the sorted linear
+indices (y*width+x) of step k are columns[offsets[k]] up to but
+not including columns[offsets[k+1]]. */
+typedef struct
+{
+    uint32_t steps;
+    uint64_t *offsets;
+    uint32_t *columns;
+} active_columns_t;
+
+/* one field of every minicolumn, read in place. the field of
+minicolumn (y, x) is at base + (y*width+x)*stride bytes. */
+typedef struct
+{
+    const void *base;
+    size_t stride;
+    uint32_t height, width;
+} grid_view_t;
+
+/* read-only views of the live state of layer 4. the memory
+stays where it is for the life of the htm, so a view is fetched
+once and read every frame. a read while a step runs may see a
+mix of two steps. */
+typedef struct
+{
+    /* uint32_t boosted overlaps and raw overlaps */
+    grid_view_t overlaps, raw_overlaps;
+    /* float boosts */
+    grid_view_t boosts;
+    /* winners of the last step */
+    const repr_t *active;
+    /* float permanence of every proximal synapse, perm_stride
+    bytes apart. the block of minicolumn i is synapses
+    syn_offsets[i] up to but not including syn_offsets[i+1]. */
+    const void *perms;
+    size_t perm_stride;
+    const uint64_t *syn_offsets;
+    uint64_t num_synapses;
+} state_view_t;
+
+/* a copy of layer 4 after one step, published for a reader on
+another thread. step counts from 1. */
+typedef struct
+{
+    uint64_t step;
+    uint32_t height, width;
+    /* boosted overlap of minicolumn y*width+x */
+    uint32_t *overlaps;
+    repr_t *active;
+} snapshot_t;
+
+/* the phases of a step, as indices into htm_stats_t.cycles */
+enum htm_phase
+{
+    HTM_PHASE_INHIB_RADIUS,
+    HTM_PHASE_OVERLAP,
+    HTM_PHASE_INHIBITION,
+    HTM_PHASE_LEARNING,
+    HTM_PHASE_NEIGHBORS,
+    /* waiting for the codec's next pattern */
+    HTM_PHASE_CODEC_WAIT,
+    /* temporal memory, not run yet */
+    HTM_PHASE_TM,
+    HTM_NUM_PHASES
+};
+
+/* where the steps went since the htm started or its stats were
+last reset. cycles are time stamp counter ticks on x86, and
+clock() ticks elsewhere. all zero in a library built with
+HTM_STATS=0. */
+typedef struct
+{
+    uint64_t steps;
+    /* layer threads the totals are summed over */
+    uint32_t threads;
+    uint64_t cycles[HTM_NUM_PHASES];
+    /* proximal synapses read or adapted */
+    uint64_t synapses_visited;
+    uint64_t columns_active;
+    /* active minicolumns that adapted their permanences */
+    uint64_t columns_learned;
+    /* neighbor lists updated for a new inhibition radius */
+    uint64_t neighbors_rebuilt;
+} htm_stats_t;
+
+/* one htm instance: its config, layers, codec and input
+patterns. opaque to callers. every call below works on the
+context it is given only, so separate contexts may be driven
+from separate threads. */
+struct htm_ctx;
+
+/* initialize an htm: parses the XML configuration file, and
+sets the encoder callback. returns NULL on failure. */
+extern struct htm_ctx*
 init_htm (codec_cb cb);
 
+/* like init_htm, but layer 4 is mapped from a checkpoint
+written by checkpoint_htm rather than grown from scratch. the
+layer configuration stored in the checkpoint is used. */
+extern struct htm_ctx*
+restore_htm (codec_cb cb, const char *path);
+
+/* write the learned state of the htm to path. the first
+checkpoint to a path writes everything, later ones append the
+minicolumns that learned since to path.log, which is compacted
+back into path once it outgrows it. appends are copied and
+written by a background thread, and may not be on disk yet when
+this returns. */
+extern int32_t
+checkpoint_htm (struct htm_ctx *ctx, const char *path);
+
+/* wait until every checkpoint written so far is on disk. returns
+1 if an append failed, the next checkpoint then writes everything
+again. free_htm waits for them too. */
+extern int32_t
+sync_checkpoint_htm (struct htm_ctx *ctx);
+
 /* calls the HTM learning and inference algorithms on
 the encoded input patterns. */
 extern int32_t
-run_cortical_algorithm (void);
+run_cortical_algorithm (struct htm_ctx *ctx);
+
+/* score n independent input streams against the current model
+at once, without learning or touching the htm's own step. each
+output gets the active minicolumns of its input, and must have
+the dimensions of layer 4. run_cortical_algorithm must have run
+at least once. */
+extern int32_t
+htm_score_batch (
+    struct htm_ctx *ctx,
+    repr_t **inputs,
+    repr_t **outputs,
+    uint32_t n
+);
+
+/* like htm_score_batch, for offline replay of recorded inputs.
+the steps are spread over every core, and their winners are
+returned as index lists, to be released with
+free_active_columns. returns NULL on failure. */
+extern active_columns_t*
+htm_replay_batch (struct htm_ctx *ctx, repr_t **inputs, uint32_t n);
+
+extern void
+free_active_columns (active_columns_t *ac);
+
+/* the sorted linear indices (y*width+x) of the minicolumns
+active after the last step, at most cap of them, into out.
+returns how many are active, which may exceed cap. */
+extern uint32_t
+htm_get_active_columns (struct htm_ctx *ctx, uint32_t *out, uint32_t cap);
+
+/* the same minicolumns as a bitset of layer 4's dimensions.
+owned by the htm and valid until the next step. */
+extern const repr_t*
+htm_get_active_bitset (struct htm_ctx *ctx);
+
+/* fill view with the state of layer 4 */
+extern int32_t
+htm_get_state_view (struct htm_ctx *ctx, state_view_t *view);
+
+/* the newest snapshot, or NULL before the first step or when
+snapshots are off in the configuration. safe to call from one
+thread while another runs steps, and never makes the step wait.
+the frame stays intact until the next call. */
+extern const snapshot_t*
+htm_read_snapshot (struct htm_ctx *ctx);
+
+/* from now on, log messages are queued on a ring of the thread
+that logs them, and a background thread prints them to out, or
+to stdout when out is NULL. a full ring drops messages rather
+than stall the step. the log is shared by every context. */
+extern int32_t
+htm_start_async_log (FILE *out);
+
+/* print what is still queued and go back to printing messages
+as they are logged. messages logged while this runs may be held
+back until the next start. */
+extern void
+htm_stop_async_log (void);
+
+/* the stats of every layer thread added up, codec wait
+included. read them between steps. */
+extern int32_t
+htm_get_stats (struct htm_ctx *ctx, htm_stats_t *stats);
+
+/* the stats of layer thread t alone, to spot imbalance. work
+the stepping thread does between phases counts to thread 0. */
+extern int32_t
+htm_get_thread_stats (struct htm_ctx *ctx, uint32_t t, htm_stats_t *stats);
+
+extern void
+htm_reset_stats (struct htm_ctx *ctx);
+
+/* record a timeline of the following steps: the span of every
+phase on every layer thread, the phases as the stepping thread
+waits them out, and codec waits. at most max_spans spans are
+kept per thread. */
+extern int32_t
+htm_start_trace (struct htm_ctx *ctx, uint32_t max_spans);
+
+/* stop recording and write the timeline to path as Chrome
+trace-event JSON, for chrome://tracing or ui.perfetto.dev */
+extern int32_t
+htm_dump_trace (struct htm_ctx *ctx, const char *path);
+
+/* record every input cb returns to path. pass htm_recording_codec
+to init_htm in place of cb. there is one recording per process. */
+extern int32_t
+htm_start_recording (codec_cb cb, const char *path);
+
+extern input_patterns*
+htm_recording_codec (void);
+
+/* close the recording. call it after free_htm. */
+extern int32_t
+htm_stop_recording (void);
+
+/* play the recording at path back through htm_playback_codec,
+as fast as the htm takes it. the codec returns NULL at the end
+of the recording, or starts over if loop is set. there is one
+playback per process. */
+extern int32_t
+htm_start_playback (const char *path, char loop);
+
+extern input_patterns*
+htm_playback_codec (void);
+
+/* call it after free_htm, the patterns go with the playback */
+extern void
+htm_stop_playback (void);
+
+/* the instruction set the hot kernels were picked for on this
+CPU: "sse2", "popcnt", "avx2" or "avx512". HTM_CPU in the
+environment, set to one of these, caps it. */
+extern const char*
+htm_cpu_level (void);
 
 extern struct layer*
-get_layer4 (void);
+get_layer4 (struct htm_ctx *ctx);
 
 extern input_patterns*
-get_htm_input_patterns (void);
+get_htm_input_patterns (struct htm_ctx *ctx);
+
+/* stop the codec producer thread, if pipelined, and release
+the context with the layers and input patterns it holds. */
+extern void
+free_htm (struct htm_ctx *ctx);
 
 /* HTM "layer" functions & data structures */
 struct layer
 {
     struct minicolumn ***minicolumns;
     uint32_t height, width, inhibition_radius;
+    /* private to the library */
+    struct layer_state *state;
 };
 
 
@@ -57,6 +326,9 @@ struct layer
 struct minicolumn
 {
     uint32_t overlap;
+    /* connected synapses on active input bits, before the
+       complexity threshold and boosting */
+    uint32_t raw_overlap;
     /* 1 byte mask: LSB represents activity at current timestep t,
        LSB+1 t-1, etc. */
     unsigned char active_mask;
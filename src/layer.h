@@ -4,14 +4,155 @@
 /* import interface for input pattern representations from encoders*/
 #include "repr.h"
 
+#include <stddef.h>
+#include <pthread.h>
+
 #include "htm.h"
 #include "conf.h"
 #include "parse_conf.h"
 
-#define NUM_THREADS 1
+/* most threads a layer runs on. each takes at least one row of
+   minicolumns. */
+#define MAX_THREADS 64
+
+#include "threads.h"
+
+struct mc_kernels;
+
+/* reference to a synapse sampling an input bit */
+struct synapse_ref
+{
+    struct minicolumn *mc;
+    struct synapse *syn;
+};
+
+/* reverse map from every input bit to the synapses sampling
+   it, used to update overlaps from the input bits that changed
+   since the previous step. */
+struct input_index
+{
+    repr_t *input;
+    /* synapses of bit b are refs[offsets[b]] up to but not
+       including refs[offsets[b+1]] */
+    uint32_t *offsets;
+    struct synapse_ref *refs;
+    /* input bits at the previous step */
+    uint32_t *prev;
+    uint32_t words;
+    /* most changed bits that are still applied as a delta */
+    uint32_t max_changed;
+    /* prev and the raw overlaps agree */
+    char valid;
+};
+
+/* file mapping backing a layer restored from a checkpoint. addr
+   is NULL when the layer was allocated instead. */
+struct layer_map
+{
+    void *addr;
+    size_t size;
+};
+
+/* an allocated layer 4 keeps its minicolumns, and all of their
+   proximal synapses, in one block each */
+struct layer_arena
+{
+    struct minicolumn *mcs;
+    struct synapse *syns;
+    uint64_t num_synapses;
+};
+
+/* minicolumns per checkpoint tile. a tile is a run of
+   minicolumns within one row, so the rows of a thread never
+   share one. the synapses of a single minicolumn dwarf the
+   bookkeeping for a tile, so tiles are kept small to write
+   little more than the winners. */
+#define L4_TILE_W 4
 
-/* export global layer structs */
-extern struct layer *layer4, *layer6;
+/* tiles whose permanences changed since the last checkpoint */
+struct dirty_map
+{
+    uint32_t *bits;
+    uint32_t tiles, tiles_per_row;
+};
+
+#define L4_TILE(dm, y, x) \
+    ((y)*(dm)->tiles_per_row + (x)/L4_TILE_W)
+/* tiles of different threads may share a word of the map */
+#define MARK_L4_TILE_DIRTY(dm, y, x) \
+    __atomic_fetch_or(&(dm)->bits[L4_TILE(dm, y, x)/32], \
+        1u << L4_TILE(dm, y, x)%32, __ATOMIC_RELAXED)
+
+/* streams scored together on one pass over the synapses */
+#define L4_BATCH 8
+
+/* one block of streams being scored. per minicolumn, the
+   values of the block's streams are adjacent. outputs may be
+   NULL when only the activity is wanted. */
+struct l4_batch
+{
+    repr_t **inputs, **outputs;
+    uint32_t n;
+    uint32_t *overlaps;
+    unsigned char *active;
+};
+
+struct ckpt_writer;
+
+/* the checkpoint a layer was last written to or restored
+   from, and how far its delta log goes once the writer has
+   appended what it was handed */
+struct ckpt_state
+{
+    char *path;
+    uint64_t generation;
+    uint32_t seq;
+    uint64_t base_size, log_size;
+    struct ckpt_writer *writer;
+};
+
+/* everything a layer 4 owns besides its minicolumns. nothing
+   in here is shared between layers, so independent layers can
+   run side by side. */
+struct layer_state
+{
+    /* configuration the layer was built with */
+    struct layer4_conf conf;
+    /* the threads the rows are split between, each with the
+       attributes that pin it */
+    uint32_t num_threads;
+    struct thread_data td[MAX_THREADS];
+    pthread_t threads[MAX_THREADS];
+    pthread_attr_t threadattr[MAX_THREADS];
+    float local_mc_activity;
+    float delta_overlap_max;
+    char build_input_index;
+    /* the minicolumn kernels run. with the reference ones the
+       overlaps are also counted in full every step, rather
+       than from the input delta or active bits. */
+    const struct mc_kernels *kern;
+    /* a loaded kernel plugin, its handle and the kernels of the
+       layer with its own in place */
+    void *plugin;
+    struct mc_kernels *plugin_kern;
+    /* whether the spatial pooler adapts permanences */
+    char learning;
+    /* the pattern the layer samples from */
+    repr_t *input;
+    /* the minicolumns in row major order, allocated or mapped */
+    struct minicolumn *mcs;
+    /* winners of the last step, set during inhibition */
+    repr_t *active;
+    /* first synapse of every minicolumn, for state views */
+    uint64_t *syn_offsets;
+    struct input_index index;
+    struct layer_arena arena;
+    struct layer_map map;
+    struct dirty_map dirty;
+    struct ckpt_state ckpt;
+    /* spans of the stepping thread, NULL when not tracing */
+    struct trace_buf *trace;
+};
 
 struct layer*
 alloc_layer4 (struct layer4_conf conf);
@@ -19,15 +160,98 @@ struct layer*
 alloc_layer6 (struct layer6_conf conf);
 
 int32_t
-free_l4( void );
+free_l4 (struct layer *layer);
 
 int32_t
 init_l4 (
+    struct layer *layer,
     repr_t *input,
     float rec_fld_perc
 );
 int32_t
-layer4_feedforward ( void );
+attach_l4_input (struct layer *layer, repr_t *input);
+int32_t
+configure_layer4 (struct layer *layer, struct layer4_conf conf);
+/* split the rows between threads, pinned as affinity.h says.
+   called before init_l4, every thread also first touches the
+   minicolumns and synapses of its rows, so they are placed in
+   its NUMA node. */
+int32_t
+layer4_set_threads (
+    struct layer *layer,
+    uint32_t threads,
+    const char *affinity
+);
+/* run a phase on every thread's rows and wait for all of them */
+int32_t
+run_l4_phase (struct layer_state *st, void *(*phase)(void *));
+int32_t
+layer4_feedforward (struct layer *layer);
+/* switch the layer to the reference kernels, or back to the
+   default ones or those of its plugin, from the next step on */
+void
+layer4_use_reference (struct layer *layer, char on);
+int32_t
+rebuild_l4_neighbors (struct layer *layer);
+/* score n inputs against the layer without learning, into
+   outputs of the layer's dimensions. the layer must have run a
+   step, so its neighborhoods exist. */
+int32_t
+layer4_score_batch (
+    struct layer *layer,
+    repr_t **inputs,
+    repr_t **outputs,
+    uint32_t n
+);
+/* views of the minicolumn fields and synapses in place */
+int32_t
+layer4_state_view (struct layer *layer, state_view_t *view);
+/* the sorted indices of the last step's winners, at most cap
+   of them, into out. returns how many won. */
+uint32_t
+layer4_active_columns (struct layer *layer, uint32_t *out, uint32_t cap);
+int32_t
+l4_batch_inputs (struct layer *layer, repr_t **inputs, uint32_t n);
+/* the two halves of scoring a block, over the rows of td and
+   on the calling thread */
+void
+l4_block_overlaps (struct thread_data *td);
+void
+l4_block_inhibition (struct thread_data *td);
+/* score n inputs like layer4_score_batch, with the steps spread
+   over every core instead of the rows. returns the winners of
+   every step. */
+active_columns_t*
+layer4_replay (struct layer *layer, repr_t **inputs, uint32_t n);
 
-#endif
+/* write layer 4 to a checkpoint file */
+int32_t
+save_l4 (struct layer *layer, const char *path);
+/* append the tiles changed since the last checkpoint of path to
+   its delta log, path.log. the tiles are copied and the append
+   and fsync left to a writer thread, so this returns before they
+   are on disk. writes the whole layer instead, and waits for it,
+   when path is not the layer's checkpoint yet, when the log grew
+   past the checkpoint itself or when an earlier append failed. */
+int32_t
+save_l4_delta (struct layer *layer, const char *path);
+/* wait until the appends handed to the writer are on disk.
+   returns 1 if one of them failed, the next checkpoint then
+   writes the whole layer. */
+int32_t
+sync_l4_ckpt (struct layer *layer);
+int32_t
+alloc_l4_dirty (struct layer *layer);
+void
+free_l4_dirty (struct layer *layer);
+/* a new layer 4 from a checkpoint file, mapped copy-on-write,
+   with its delta log replayed. input must have the dimensions
+   it was saved with. when shared, the synapses are mapped
+   read-only and shared between processes instead, and learning
+   is off. */
+struct layer*
+map_l4 (const char *path, repr_t *input, char shared);
+void
+unmap_l4 (struct layer *layer);
 
+#endif
@@ -1,35 +1,32 @@
+#include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <pthread.h>
 
 #include "htm.h"
 #include "layer.h"
+#include "sdr.h"
 #include "minicolumn.h"
 #include "synapse.h"
 #include "threads.h"
+#include "stats.h"
+#include "trace.h"
 #include "utils.h"
 
-/* TODO: get number of cpu cores */
-pthread_t threads[NUM_THREADS];
-/* argument structure passed to the threads */
-extern struct thread_data td[NUM_THREADS];
-
-extern pthread_attr_t threadattr;
-
-extern uint32_t layer4_width;
-extern uint32_t layer4_height;
-extern float local_mc_activity;
-
 static void*
 compute_layer_inhib_rad (void *thread_data);
 static void*
 compute_activations (void *thread_data);
+static void
+minicolumn_inhibition (struct thread_data *td);
+static void*
+learn_minicolumns (void *thread_data);
 static void*
-minicolumn_inhibition (void *thread_data);
+batch_overlaps (void *thread_data);
 static thread_status_t
 update_minicolumn_neighbors(
+    struct layer *layer,
     struct minicolumn ***neighbors,
-    struct minicolumn ***mc,
     uint32_t old_ir,
     uint32_t new_ir,
     uint32_t x,
@@ -60,11 +57,47 @@ struct rect_of_rects
 
 static int32_t
 spatial_pooler (struct layer *layer);
+static char
+apply_input_delta (struct input_index *idx, htm_stats_t *stats);
+static char
+list_sparse_input (repr_t *in, char listed);
+static void
+overlap_from_active (
+    struct layer *layer,
+    struct input_index *idx,
+    htm_stats_t *stats
+);
 static void
 free_rects (struct rect_of_rects rr);
 
+/* build every neighbor list from scratch for the layer's
+   current inhibition radius, for a layer that was restored
+   without them */
+int32_t
+rebuild_l4_neighbors (struct layer *layer)
+{
+    uint32_t x, y;
+
+    /* a layer that never ran has no neighbors yet, the first
+       step builds them */
+    if (!layer->inhibition_radius)
+        return 0;
+
+    for (y=0; y<layer->height; y++) {
+        for (x=0; x<layer->width; x++) {
+            if (update_minicolumn_neighbors(layer,
+                &(*(*(layer->minicolumns+y)+x))->neighbors,
+                0, layer->inhibition_radius,
+                x, y) == THREAD_FAIL)
+                return 1;
+        }
+    }
+
+    return 0;
+}
+
 int32_t
-layer4_feedforward (void)
+layer4_feedforward (struct layer *layer)
 {
     /* spatial pooling procedure. compute the inference
        (aka overlap score) for each minicolumn. This is a
@@ -75,7 +108,7 @@ layer4_feedforward (void)
        radius from becoming active. The minicolumns learn
        to map spatially similar input patterns to the
        same or a similar set of active minicolumns. */
-    spatial_pooler(layer4);
+    spatial_pooler(layer);
     /* temporal memory procedure.
      1a. Depolarized cells within active minicolumns after
         spatial pooling are activated, representing a
@@ -92,42 +125,177 @@ layer4_feedforward (void)
     return 0;
 }
 
-static int32_t
-spatial_pooler (struct layer *layer)
+/* the model is only read, so scoring a block of streams walks
+   the synapses once for all of them rather than once each.
+   inhibition then runs per stream, over scratch overlaps and
+   activity instead of the minicolumns themselves. */
+int32_t
+layer4_score_batch (
+    struct layer *layer,
+    repr_t **inputs,
+    repr_t **outputs,
+    uint32_t n
+) {
+    struct layer_state *st = layer->state;
+    struct l4_batch bt;
+    uint32_t b, t;
+    size_t num_mcs = (size_t)layer->height*layer->width;
+
+    if (l4_batch_inputs(layer, inputs, n))
+        return 1;
+    for (b=0; b<n; b++) {
+        if (outputs[b]->rows != layer->height ||
+            outputs[b]->cols != layer->width) {
+            ERR("Batch output %u has the wrong dimensions\n", b);
+            return 1;
+        }
+        memset(outputs[b]->repr, 0,
+            sizeof(uint32_t)*REPR_WORDS(outputs[b]));
+        outputs[b]->sparse = 0;
+    }
+
+    bt.overlaps = malloc(sizeof(uint32_t)*num_mcs*L4_BATCH);
+    bt.active = malloc(num_mcs*L4_BATCH);
+    if (!bt.overlaps || !bt.active) {
+        ERR("No memory to score a batch\n");
+        goto fail_ret;
+    }
+    for (t=0; t<st->num_threads; t++)
+        st->td[t].batch = &bt;
+
+    for (b=0; b<n; b+=L4_BATCH) {
+        bt.inputs = inputs + b;
+        bt.outputs = outputs + b;
+        bt.n = n-b < L4_BATCH ? n-b : L4_BATCH;
+        memset(bt.active, 0, num_mcs*L4_BATCH);
+        if (run_l4_phase(st, batch_overlaps))
+            goto fail_ret;
+        /* a winner depends on the neighbors that won before it,
+           so the tiles are inhibited in order */
+        for (t=0; t<st->num_threads; t++)
+            l4_block_inhibition(&st->td[t]);
+    }
+
+    free(bt.overlaps);
+    free(bt.active);
+
+    return 0;
+
+    fail_ret:
+        free(bt.overlaps);
+        free(bt.active);
+        return 1;
+}
+
+uint32_t
+layer4_active_columns (struct layer *layer, uint32_t *out, uint32_t cap)
 {
-    uint32_t t, rc;
+    repr_t *active = layer->state->active;
 
-    /* compute the inhibition radius used by each minicolumn.
-       this is derived from the average connected receptive
-       field radius. */
-    for (t=0; t<NUM_THREADS; t++) {
-        td[t].old_avg_inhib_rad = *td[t].avg_inhib_rad;
+    /* listed in order by the inhibition */
+    if (cap)
+        memcpy(out, active->active,
+            sizeof(uint32_t)*(active->num_active < cap ?
+                active->num_active : cap));
+
+    return active->num_active;
+}
+
+/* check that the layer can score inputs, and bring their bit
+   arrays up to date */
+int32_t
+l4_batch_inputs (struct layer *layer, repr_t **inputs, uint32_t n)
+{
+    struct layer_state *st = layer->state;
+    uint32_t b;
+
+    if (!st->input || !(*(*layer->minicolumns))->neighbors) {
+        ERR("Layer 4 must run a step before scoring\n");
+        return 1;
+    }
+    for (b=0; b<n; b++) {
+        if (inputs[b]->rows != st->input->rows ||
+            inputs[b]->cols != st->input->cols) {
+            ERR("Batch input %u has the wrong dimensions\n", b);
+            return 1;
+        }
+        pack_repr(inputs[b]);
+    }
+
+    return 0;
+}
+
+/* run a phase on every thread's rows and wait for all of them */
+int32_t
+run_l4_phase (struct layer_state *st, void *(*phase)(void *))
+{
+    uint32_t t;
+    int rc;
+
+    for (t=0; t<st->num_threads; t++) {
+        st->td[t].exit_status = THREAD_SUCCESS;
         rc = pthread_create(
-            &threads[t],
-            &threadattr,
-            compute_layer_inhib_rad,
-            (void *)&td[t]);
+            &st->threads[t],
+            &st->threadattr[t],
+            phase,
+            (void *)&st->td[t]);
         if (rc != 0) {
             ERR("Thread %d creation failed: %d\n",
                 t, rc);
             return 1;
         }
     }
-    for (t=0; t<NUM_THREADS; t++) {
-        rc = pthread_join(threads[t], NULL);
+    for (t=0; t<st->num_threads; t++) {
+        rc = pthread_join(st->threads[t], NULL);
         if (rc != 0) {
-            ERR("Thread %d join failed during inhibition "
-                "radius computation: %d\n",
-                t, rc);
+            ERR("Thread %d join failed: %d\n", t, rc);
             return 1;
         }
     }
+    for (t=0; t<st->num_threads; t++)
+        if (st->td[t].exit_status != THREAD_SUCCESS)
+            return 1;
+
+    return 0;
+}
+
+static int32_t
+spatial_pooler (struct layer *layer)
+{
+    struct layer_state *st = layer->state;
+    struct thread_data *td = st->td;
+    struct input_index *idx = &st->index;
+    uint64_t rad_sum = 0;
+    uint32_t t;
+    char delta = 0, sparse = 0, listed = st->input->sparse;
+    char reference = st->kern == &mc_reference_kernels;
+
+    /* the encoder may have handed over either form of the
+       input. the kernels below test bits, the index list is
+       made further down only if it is walked. */
+    pack_repr(st->input);
+
+    /* compute the inhibition radius used by each minicolumn.
+       this is derived from the average connected receptive
+       field radius. */
+    TRACE_BEGIN(st->trace, t_rad);
+    for (t=0; t<st->num_threads; t++) {
+        td[t].input = st->input;
+        td[t].learn = st->learning;
+        td[t].old_avg_inhib_rad = *td[t].avg_inhib_rad;
+    }
+    if (run_l4_phase(st, compute_layer_inhib_rad)) {
+        ERR("Failed to compute the inhibition radius\n");
+        return 1;
+    }
+    TRACE_END(st->trace, TRACE_INHIB_RADIUS, t_rad);
 
-    for (t=0; t<NUM_THREADS; t++)
-        layer->inhibition_radius += td[t].inhibition_radius;
-    layer->inhibition_radius /= NUM_THREADS;
+    /* the average over the whole layer, whatever the tiles */
+    for (t=0; t<st->num_threads; t++)
+        rad_sum += td[t].inhib_rad_sum;
+    layer->inhibition_radius += rad_sum/((uint64_t)layer->height*layer->width);
 
-    INFO("Overall inhibition radius: %u\n", layer->inhibition_radius);
+    DEBUG("Overall inhibition radius: %u\n", layer->inhibition_radius);
 
     /* Compute the overlap score of each minicolumn. Minicolumn activations
        are "boosted" when they do not become active often enough and fall
@@ -140,58 +308,52 @@ spatial_pooler (struct layer *layer)
        to adjust their receptive fields. More importantly, it guarantees that
        "poor, starved" minicolumns will get to represent at least some
        patterns so that "greedy" minicolumns cannot represent too many. */
-    for (t=0; t<NUM_THREADS; t++) {
-        rc = pthread_create(
-            &threads[t],
-            &threadattr,
-            compute_activations,
-            (void *)&td[t]);
-        if (rc != 0) {
-            ERR("Thread %d creation failed: %d\n",
-                t, rc);
-            return 1;
+    if (idx->refs && !reference) {
+        TRACE_BEGIN(st->trace, t_delta);
+        /* the stepping thread's share goes to thread 0 */
+        STATS_TIME(t0);
+        delta = apply_input_delta(idx, &td[0].stats);
+        /* otherwise count a sparse enough input from its
+           active bits rather than from every synapse */
+        if (!delta && list_sparse_input(st->input, listed)) {
+            overlap_from_active(layer, idx, &td[0].stats);
+            sparse = 1;
         }
+        STATS_PHASE(&td[0].stats, HTM_PHASE_OVERLAP, t0);
+        TRACE_END(st->trace, TRACE_INPUT_DELTA, t_delta);
     }
-    for (t=0; t<NUM_THREADS; t++) {
-        rc = pthread_join(threads[t], NULL);
-        if (rc != 0) {
-            ERR("Thread %d join failed during overlap "
-                "computation: %d\n",
-                t, rc);
-            return 1;
-        }
+    TRACE_BEGIN(st->trace, t_ov);
+    for (t=0; t<st->num_threads; t++)
+        td[t].full_overlap = !delta && !sparse;
+    if (run_l4_phase(st, compute_activations)) {
+        ERR("Failed to compute the overlaps\n");
+        return 1;
+    }
+    TRACE_END(st->trace, TRACE_OVERLAP, t_ov);
+    /* learning keeps the raw overlaps in step with this input
+       from here on */
+    if (idx->refs) {
+        memcpy(idx->prev, idx->input->repr,
+            sizeof(uint32_t)*idx->words);
+        idx->valid = 1;
     }
 
     /* Inhibit the neighbors of the minicolumns which received
-       the highest level of feedforward activation. */
-    for (t=0; t<NUM_THREADS; t++) {
-        rc = pthread_create(
-            &threads[t],
-            &threadattr,
-            minicolumn_inhibition,
-            (void *)&td[t]);
-        if (rc != 0) {
-            ERR("Thread %d creation failed: %d\n",
-                t, rc);
-            return 1;
-        }
-    }
-    for (t=0; t<NUM_THREADS; t++) {
-        rc = pthread_join(threads[t], NULL);
-        if (rc != 0) {
-            ERR("Thread %d join failed during nneighbor "
-                "activation: %d\n", t, rc);
-            return 1;
-        }
-    }
-    for (t=0; t<NUM_THREADS; t++) {
-        if (td[t].exit_status != THREAD_SUCCESS) {
-            ERR("Thread %d returned an error during "
-                "neighbors activations: %d\n",
-                t, td[t].exit_status);
-            return 1;
-        }
+       the highest level of feedforward activation. a minicolumn
+       wins against the neighbors that won before it, so the
+       tiles go in order on this thread and the winners are the
+       same for any number of threads. learning only touches the
+       winners themselves, and runs on the threads after. the
+       tiles going in order also lists the winners sorted. */
+    TRACE_BEGIN(st->trace, t_inh);
+    st->active->num_active = 0;
+    for (t=0; t<st->num_threads; t++)
+        minicolumn_inhibition(&td[t]);
+    if (st->learning && run_l4_phase(st, learn_minicolumns)) {
+        ERR("Failed to adapt the active minicolumns\n");
+        return 1;
     }
+    TRACE_END(st->trace, TRACE_INHIBITION, t_inh);
 
     /* Update boosting parameters if htm is learning. */
 
@@ -204,8 +366,11 @@ compute_layer_inhib_rad (void *thread_data)
     uint32_t x, y;
 
     struct thread_data *td = (struct thread_data *)thread_data;
-
-    td->inhibition_radius = 0;
+    const struct mc_kernels *kern = td->layer->state->kern;
+    uint64_t rad_sum = 0;
+    STATS_LOCAL(stats);
+    STATS_TIME(t0);
+    TRACE_BEGIN(td->trace, tr);
 
     for (y=td->row_start; y<td->row_start+td->row_num; y++) {
         for (x=0; x<td->row_width; x++) {
@@ -215,65 +380,63 @@ compute_layer_inhib_rad (void *thread_data)
             been activated in the next step. */
             RST_MC_SP_INDICATOR(
                 *(*(td->minicolumns+y)+x));
-            td->inhibition_radius += compute_minicolumn_inhib_rad(
+            rad_sum += kern->inhib_rad(
                 *(*(td->minicolumns+y)+x)
             );
+            STATS_ADD(&stats, synapses_visited,
+                (*(*(td->minicolumns+y)+x))->num_synapses);
         }
     }
-    td->inhibition_radius /=
-        (td->row_num*td->row_width);
+    /* the thread_data of the threads share cache lines, so
+       they are written once the loop is done */
+    td->inhib_rad_sum = rad_sum;
+    STATS_PHASE(&stats, HTM_PHASE_INHIB_RADIUS, t0);
+    STATS_MERGE(&td->stats, stats);
+    TRACE_END(td->trace, TRACE_INHIB_RADIUS, tr);
+
+    pthread_exit(NULL);
 }
 
 static void*
 compute_activations (void *thread_data)
 {
-    uint32_t x, y, s;
-    struct synapse *synptr = NULL;
+    uint32_t x, y;
     uint32_t num_syns;
 
     struct thread_data *td = (struct thread_data *)thread_data;
+    const struct mc_kernels *kern = td->layer->state->kern;
+    STATS_LOCAL(stats);
+    STATS_TIME(t0);
+    TRACE_BEGIN(td->trace, tr);
 
     for (y=td->row_start; y<td->row_start+td->row_num; y++) {
         for (x=0; x<td->row_width; x++) {
-            /* compute the raw overlap score */
             num_syns = (*(*(td->minicolumns+y)+x))->num_synapses;
-            synptr = (*(*(td->minicolumns+y)+x))->proximal_dendrite_segment;
-            for (s=0; s<num_syns; s++) {
-                if (synptr->perm >= CONNECTED_PERM &&
-                    TEST_REPR_BIT_FAST(synptr->source, synptr->srcy, synptr->srcx))
-                    (*(*(td->minicolumns+y)+x))->overlap++;
-                synptr++;
+            /* compute the raw overlap score, unless it was already
+               updated from the input delta */
+            if (td->full_overlap) {
+                STATS_ADD(&stats, synapses_visited, num_syns);
+                (*(*(td->minicolumns+y)+x))->raw_overlap = kern->overlap(
+                    *(*(td->minicolumns+y)+x), td->input);
             }
             DEBUG("num_syns %u raw overlap %u ",
-                num_syns, (*(*(td->minicolumns+y)+x))->overlap);
+                num_syns, (*(*(td->minicolumns+y)+x))->raw_overlap);
             /* reset to zero if it doesn't reach the minimum complexity
                requirement, otherwise multiply by boost */
-            (*(*(td->minicolumns+y)+x))->overlap *=
-                (*(*(td->minicolumns+y)+x))->overlap >=
+            (*(*(td->minicolumns+y)+x))->overlap =
+                (*(*(td->minicolumns+y)+x))->raw_overlap *
+                ((*(*(td->minicolumns+y)+x))->raw_overlap >=
                 td->column_complexity * num_syns ?
-                (*(*(td->minicolumns+y)+x))->boost : 0;
+                (*(*(td->minicolumns+y)+x))->boost : 0);
             /*INFO("min compl %u boosted/zeroed overlap %u\n",
                (uint32_t)(td->column_complexity * num_syns),
                 (*(*(td->minicolumns+y)+x))->overlap);*/
-        }
-    }
-}
-
-static void*
-minicolumn_inhibition (void *thread_data)
-{
-    uint32_t x, y;
-    struct thread_data *td = (struct thread_data *)thread_data;
-    struct minicolumn **n = NULL;
-
-
-    for (y=td->row_start; y<td->row_start+td->row_num; y++) {
-        for (x=0; x<td->row_width; x++) {
-            /* update neighbors if necessary */
+            /* update neighbors if necessary, ahead of the
+               inhibition that reads them */
             if (td->old_avg_inhib_rad != *td->avg_inhib_rad) {
-                if (update_minicolumn_neighbors(
+                STATS_SWITCH(&stats, HTM_PHASE_OVERLAP, t0);
+                if (update_minicolumn_neighbors(td->layer,
                     &(*(*(td->minicolumns+y)+x))->neighbors,
-                    td->minicolumns,
                     td->old_avg_inhib_rad,
                     *td->avg_inhib_rad,
                     x, y
@@ -283,29 +446,273 @@ minicolumn_inhibition (void *thread_data)
                     td->exit_status = 1;
                     pthread_exit(NULL);
                 }
-            } else
-                DEBUG("Inhihition radius unchanged.\n");
+                STATS_SWITCH(&stats, HTM_PHASE_NEIGHBORS, t0);
+                STATS_ADD(&stats, neighbors_rebuilt, 1);
+            }
+        }
+    }
+    STATS_PHASE(&stats, HTM_PHASE_OVERLAP, t0);
+    STATS_MERGE(&td->stats, stats);
+    TRACE_END(td->trace, TRACE_OVERLAP, tr);
+
+    pthread_exit(NULL);
+}
+
+/* walk the input bits that changed since the previous step
+   and move the raw overlap of every minicolumn with a connected
+   synapse on them. returns 0 when the overlaps must be computed
+   in full instead. this runs on the calling thread, since the
+   changed bits scatter over every thread's rows. */
+static char
+apply_input_delta (struct input_index *idx, htm_stats_t *stats)
+{
+    uint32_t *in = idx->input->repr;
+    uint32_t w, b, diff, changed;
+    int32_t step;
+    struct synapse_ref *ref = NULL, *end = NULL;
+
+    if (!idx->valid)
+        return 0;
+
+    changed = xor_popcount_words(in, idx->prev, idx->words);
+    if (changed > idx->max_changed)
+        return 0;
+
+    for (w=0; w<idx->words; w++) {
+        diff = in[w] ^ idx->prev[w];
+        while (diff) {
+            b = __builtin_ctz(diff);
+            diff &= diff - 1;
+            /* +1 when the bit turned on, -1 when it turned off */
+            step = ((in[w] >> b) & 1) ? 1 : -1;
+            ref = idx->refs + idx->offsets[w*SZ+b];
+            end = idx->refs + idx->offsets[w*SZ+b+1];
+            STATS_ADD(stats, synapses_visited, end-ref);
+            for (; ref<end; ref++)
+                if (ref->syn->perm >= CONNECTED_PERM)
+                    ref->mc->raw_overlap += step;
+        }
+    }
+
+    return 1;
+}
+
+/* whether the index list of the input is current and shorter
+   than its bit array. a dense input is counted first, and only
+   listed when it is sparse enough. */
+static char
+list_sparse_input (repr_t *in, char listed)
+{
+    if (!listed && ((uint64_t)popcount_repr(in)*SZ >=
+        (uint64_t)in->rows*in->cols || unpack_repr(in)))
+        return 0;
+
+    return REPR_SPARSE_CHEAPER(in);
+}
+
+/* count the raw overlaps of every minicolumn from the active
+   bits of the input alone. also on the calling thread. */
+static void
+overlap_from_active (
+    struct layer *layer,
+    struct input_index *idx,
+    htm_stats_t *stats
+) {
+    uint32_t x, y, a, r, b;
+    struct synapse_ref *ref = NULL, *end = NULL;
+    repr_t *in = idx->input;
+
+    for (y=0; y<layer->height; y++)
+        for (x=0; x<layer->width; x++)
+            (*(*(layer->minicolumns+y)+x))->raw_overlap = 0;
+
+    for (a=0; a<in->num_active; a++) {
+        r = in->active[a] / in->cols;
+        b = BIT_OFFSET(in, r, in->active[a] - r*in->cols);
+        ref = idx->refs + idx->offsets[b];
+        end = idx->refs + idx->offsets[b+1];
+        STATS_ADD(stats, synapses_visited, end-ref);
+        for (; ref<end; ref++)
+            if (ref->syn->perm >= CONNECTED_PERM)
+                ref->mc->raw_overlap++;
+    }
+}
+
+/* activate the winners of a thread's rows. this runs on the
+   stepping thread, one tile after the other, and its time goes
+   to thread 0. */
+static void
+minicolumn_inhibition (struct thread_data *td)
+{
+    uint32_t x, y;
+    struct layer_state *st = td->layer->state;
+    struct minicolumn *mc = NULL;
+    const struct mc_kernels *kern = st->kern;
+    htm_stats_t *stats = &st->td[0].stats;
+    STATS_TIME(t);
+
+    /* rows never share a word of the bitset */
+    memset(st->active->repr + BIT_IDX(st->active, td->row_start, 0), 0,
+        sizeof(uint32_t)*td->row_num*st->active->stride);
+
+    for (y=td->row_start; y<td->row_start+td->row_num; y++) {
+        for (x=0; x<td->row_width; x++) {
+            mc = *(*(td->minicolumns+y)+x);
             /* set the minicolumn active flag based on its
-               overlap compared to its neighbors. */
-            check_minicolumn_activation(
-                *(*(td->minicolumns+y)+x), local_mc_activity);
+               overlap compared to its neighbors. the winners
+               are kept for callers who only want those, as
+               bits and as a list. */
+            if (kern->activation(mc, st->local_mc_activity)) {
+                SET_REPR_BIT_FAST(st->active, y, x);
+                st->active->active[st->active->num_active++] =
+                    y*st->active->cols + x;
+                STATS_ADD(stats, columns_active, 1);
+            }
+
+            DEBUG("(%u,%u) activity: %u\n", y, x,  MC_ACTIVE_AT(mc, 0));
+        }
+    }
+    STATS_PHASE(stats, HTM_PHASE_INHIBITION, t);
+}
+
+/* adapt the winners of a thread's rows to the input. a
+   minicolumn that learned goes into the next checkpoint. */
+static void*
+learn_minicolumns (void *thread_data)
+{
+    uint32_t x, y;
+    struct thread_data *td = (struct thread_data *)thread_data;
+    struct layer_state *st = td->layer->state;
+    struct minicolumn *mc = NULL;
+    const struct mc_kernels *kern = st->kern;
+    STATS_LOCAL(stats);
+    STATS_TIME(t);
+    TRACE_BEGIN(td->trace, tr);
 
-            DEBUG("(%u,%u) activity: %u\n", y, x,  MC_ACTIVE_AT(*(*(td->minicolumns+y)+x), 0));
+    for (y=td->row_start; y<td->row_start+td->row_num; y++) {
+        for (x=0; x<td->row_width; x++) {
+            if (!TEST_REPR_BIT_FAST(st->active, y, x))
+                continue;
+            mc = *(*(td->minicolumns+y)+x);
+            kern->learn(mc, td->input);
+            MARK_L4_TILE_DIRTY(&st->dirty, y, x);
+            STATS_ADD(&stats, columns_learned, 1);
+            STATS_ADD(&stats, synapses_visited, mc->num_synapses);
         }
     }
+    STATS_PHASE(&stats, HTM_PHASE_LEARNING, t);
+    STATS_MERGE(&td->stats, stats);
+    TRACE_END(td->trace, TRACE_LEARNING, tr);
+
+    pthread_exit(NULL);
+}
+
+static void*
+batch_overlaps (void *thread_data)
+{
+    l4_block_overlaps((struct thread_data *)thread_data);
 
     pthread_exit(NULL);
 }
 
+/* the raw overlaps of a block of streams in one walk over the
+   synapses. the streams have the dimensions of the layer's
+   input, so a synapse is the same bit of every one of them. */
+void
+l4_block_overlaps (struct thread_data *td)
+{
+    struct l4_batch *bt = td->batch;
+    struct minicolumn *mc = NULL;
+    struct synapse *synptr = NULL, *end = NULL;
+    const uint32_t *bits[L4_BATCH];
+    uint32_t raw[L4_BATCH];
+    uint32_t *ov = NULL;
+    uint32_t x, y, b, w, bit;
+
+    for (b=0; b<bt->n; b++)
+        bits[b] = bt->inputs[b]->repr;
+
+    for (y=td->row_start; y<td->row_start+td->row_num; y++) {
+        for (x=0; x<td->row_width; x++) {
+            mc = *(*(td->minicolumns+y)+x);
+            memset(raw, 0, sizeof(raw));
+            synptr = mc->proximal_dendrite_segment;
+            end = synptr + mc->num_synapses;
+            for (; synptr<end; synptr++) {
+                if (!(synptr->perm >= CONNECTED_PERM))
+                    continue;
+                w = BIT_IDX(bt->inputs[0], synptr->srcy, synptr->srcx);
+                bit = 1u << BIT_POS(bt->inputs[0],
+                    synptr->srcy, synptr->srcx);
+                for (b=0; b<bt->n; b++)
+                    raw[b] += (bits[b][w] & bit) != 0;
+            }
+            /* the same complexity threshold and boost as a step */
+            ov = bt->overlaps + ((size_t)y*td->row_width+x)*L4_BATCH;
+            for (b=0; b<bt->n; b++)
+                ov[b] = raw[b] *
+                    (raw[b] >= td->column_complexity * mc->num_synapses ?
+                    mc->boost : 0);
+        }
+    }
+}
+
+/* check_minicolumn_activation for every stream of the block.
+   a neighbor counts as active once it won earlier in the same
+   stream, like the minicolumns of a step. */
+void
+l4_block_inhibition (struct thread_data *td)
+{
+    struct layer_state *st = td->layer->state;
+    struct l4_batch *bt = td->batch;
+    struct minicolumn *mc = NULL, **nptr = NULL;
+    unsigned int num_higher[L4_BATCH], num_active[L4_BATCH];
+    unsigned int max_active;
+    uint32_t *ov = NULL, *nov = NULL;
+    unsigned char *act = NULL, *nact = NULL;
+    uint32_t x, y, b;
+    size_t i, j;
+
+    for (y=td->row_start; y<td->row_start+td->row_num; y++) {
+        for (x=0; x<td->row_width; x++) {
+            mc = *(*(td->minicolumns+y)+x);
+            i = ((size_t)y*td->row_width+x)*L4_BATCH;
+            ov = bt->overlaps + i;
+            act = bt->active + i;
+            memset(num_higher, 0, sizeof(num_higher));
+            memset(num_active, 0, sizeof(num_active));
+            for (nptr=mc->neighbors; *nptr; nptr++) {
+                j = (size_t)(*nptr - st->mcs)*L4_BATCH;
+                nov = bt->overlaps + j;
+                nact = bt->active + j;
+                for (b=0; b<bt->n; b++) {
+                    num_higher[b] += nov[b] > ov[b];
+                    num_active[b] += nact[b];
+                }
+            }
+            max_active = mc_max_active(
+                nptr - mc->neighbors + 1, st->local_mc_activity);
+            for (b=0; b<bt->n; b++) {
+                act[b] = ov[b] > 0 &&
+                    num_active[b] < max_active &&
+                    num_higher[b] < max_active;
+                if (act[b] && bt->outputs)
+                    SET_REPR_BIT_FAST(bt->outputs[b], y, x);
+            }
+        }
+    }
+}
+
 static thread_status_t
 update_minicolumn_neighbors(
+    struct layer *layer,
     struct minicolumn ***neighbors,
-    struct minicolumn ***mc,
     uint32_t old_ir,
     uint32_t new_ir,
     uint32_t x,
     uint32_t y)
 {
+    struct minicolumn ***mc = layer->minicolumns;
     struct minicolumn **nptr = NULL;
     uint32_t oldleft, oldright, oldtop, oldbottom;
     uint32_t newleft, newright, newtop, newbottom;
@@ -318,11 +725,11 @@ update_minicolumn_neighbors(
        inhibition radius. stay within the boundaries,
        0 - dimension-1 */
     oldleft = x < old_ir ? 0 : x - old_ir;
-    oldright = x + old_ir >= layer4_width ?
-        layer4_width - 1 : x + old_ir;
+    oldright = x + old_ir >= layer->width ?
+        layer->width - 1 : x + old_ir;
     oldtop = y < old_ir ? 0 : y - old_ir;
-    oldbottom = y + old_ir >= layer4_height ?
-        layer4_height - 1 : y + old_ir;
+    oldbottom = y + old_ir >= layer->height ?
+        layer->height - 1 : y + old_ir;
 
     /* adding one to make the search inclusive of the edge */
     old_area = (oldright - oldleft + (old_ir>0?1:0)) *
@@ -331,11 +738,11 @@ update_minicolumn_neighbors(
     /* compute the new surface area given the current
        inhibition radius. */
     newleft = x < new_ir ? 0 : x - new_ir;
-    newright = x + new_ir >= layer4_width ?
-        layer4_width - 1 : x + new_ir;
+    newright = x + new_ir >= layer->width ?
+        layer->width - 1 : x + new_ir;
     newtop = y < new_ir ? 0 : y - new_ir;
-    newbottom = y + new_ir >= layer4_height ?
-        layer4_height - 1 : y + new_ir;
+    newbottom = y + new_ir >= layer->height ?
+        layer->height - 1 : y + new_ir;
 
     new_area = (newright - newleft + (new_ir>0?1:0)) *
                (newbottom - newtop + (new_ir>0?1:0));
@@ -553,7 +960,7 @@ update_minicolumn_neighbors(
             /*DEBUG("\tright rect %u\n", z);*/
         }
     } else {
-        INFO("Freeing %u neighbors\n", old_area);
+        DEBUG("Freeing %u neighbors\n", old_area);
 
         /* this is not ideal, since even pre-existing neighbor
            pointers are freed and will have to be recomputed */
@@ -561,7 +968,7 @@ update_minicolumn_neighbors(
         *neighbors = NULL;
 
         return update_minicolumn_neighbors(
-            neighbors, mc, 0, old_ir, x, y);
+            layer, neighbors, 0, old_ir, x, y);
     }
 
     free_rects(neighbor_rects);
@@ -0,0 +1,1025 @@
+
+/* mmap, fsync and friends are POSIX, not C99 */
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "layer.h"
+#include "synapse.h"
+#include "utils.h"
+
+/* On disk a checkpoint is a header, the minicolumn records in
+   row major order and then every proximal synapse, in the same
+   order. Both arrays start on a page boundary, so the file is
+   mapped and used in place, and restoring costs one pass to
+   turn the stored synapse indices back into pointers. The
+   records are raw structs, so a checkpoint only loads on the
+   build that wrote it, which the header checks.
+
+   Between full checkpoints, the tiles that learned are appended
+   to a delta log beside the checkpoint. Every entry is a header,
+   the ids of the dirty tiles, the state of every minicolumn,
+   which changes each step, the synapses of the dirty tiles and
+   a trailer with a checksum of all of it. Entries carry the
+   generation of the checkpoint they extend, so a log left over
+   from an older checkpoint is never applied to a newer one. */
+#define CKPT_MAGIC 0x434d5448 /* "HTMC" */
+#define CKPT_VERSION 2
+#define DELTA_MAGIC 0x544c4448 /* "HDLT" */
+#define CKPT_ALIGN 4096
+#define CKPT_ALIGN_UP(n) \
+    (((n)+CKPT_ALIGN-1)/CKPT_ALIGN*CKPT_ALIGN)
+
+struct ckpt_header
+{
+    uint32_t magic;
+    uint32_t version;
+    /* record sizes of the build that wrote it */
+    uint32_t mc_size, syn_size;
+    uint32_t height, width;
+    uint32_t input_rows, input_cols;
+    uint32_t inhibition_radius;
+    struct layer4_conf conf;
+    /* tells the delta logs of different checkpoints apart */
+    uint64_t generation;
+    uint64_t num_synapses;
+    /* file offsets of the two arrays */
+    uint64_t mc_off, syn_off;
+    uint64_t file_size;
+};
+
+struct delta_header
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t generation;
+    uint32_t inhibition_radius;
+    uint32_t num_tiles;
+    /* bytes between the header and the trailer */
+    uint64_t size;
+};
+
+struct delta_trailer
+{
+    uint32_t sum;
+    uint32_t magic;
+};
+
+/* the part of a minicolumn record that changes every step */
+struct mc_state
+{
+    uint32_t overlap, raw_overlap;
+    float boost;
+    uint32_t active_mask;
+};
+
+static char zeros[CKPT_ALIGN];
+
+#define FNV_BASIS 2166136261u
+#define FNV_PRIME 16777619u
+
+static uint32_t
+fnv1a (uint32_t h, const void *buf, size_t n)
+{
+    const unsigned char *p = buf, *end = p + n;
+
+    for (; p<end; p++)
+        h = (h ^ *p) * FNV_PRIME;
+
+    return h;
+}
+
+static char*
+suffix_path (const char *path, const char *suffix)
+{
+    char *p = malloc(strlen(path)+strlen(suffix)+1);
+
+    if (p)
+        sprintf(p, "%s%s", path, suffix);
+
+    return p;
+}
+
+/* the minicolumns of tile t are x0 up to but not including x1
+   of row y */
+static void
+tile_bounds (
+    struct layer *layer,
+    uint32_t t,
+    uint32_t *y,
+    uint32_t *x0,
+    uint32_t *x1
+) {
+    struct dirty_map *dm = &layer->state->dirty;
+
+    *y = t / dm->tiles_per_row;
+    *x0 = t % dm->tiles_per_row * L4_TILE_W;
+    *x1 = *x0 + L4_TILE_W > layer->width ?
+        layer->width : *x0 + L4_TILE_W;
+}
+
+int32_t
+alloc_l4_dirty (struct layer *layer)
+{
+    struct dirty_map *dm = &layer->state->dirty;
+
+    free(dm->bits);
+    dm->tiles_per_row = (layer->width + L4_TILE_W-1) / L4_TILE_W;
+    dm->tiles = layer->height * dm->tiles_per_row;
+    dm->bits = calloc((dm->tiles+31)/32, sizeof(uint32_t));
+
+    return !dm->bits;
+}
+
+static void
+stop_ckpt_writer (struct ckpt_state *ckpt);
+
+/* the dirty map only means something relative to the last
+   checkpoint, so that is forgotten along with it */
+void
+free_l4_dirty (struct layer *layer)
+{
+    struct layer_state *st = layer->state;
+
+    stop_ckpt_writer(&st->ckpt);
+    free(st->dirty.bits);
+    memset(&st->dirty, 0, sizeof(struct dirty_map));
+    free(st->ckpt.path);
+    memset(&st->ckpt, 0, sizeof(struct ckpt_state));
+}
+
+static void
+clear_l4_dirty (struct layer *layer)
+{
+    struct dirty_map *dm = &layer->state->dirty;
+
+    memset(dm->bits, 0, sizeof(uint32_t)*((dm->tiles+31)/32));
+}
+
+/* the layer in memory now equals the checkpoint at path */
+static int32_t
+set_ckpt_base (
+    struct layer *layer,
+    const char *path,
+    uint64_t generation,
+    uint64_t size
+) {
+    struct ckpt_state *ckpt = &layer->state->ckpt;
+
+    free(ckpt->path);
+    ckpt->path = malloc(strlen(path)+1);
+    if (!ckpt->path)
+        return 1;
+    strcpy(ckpt->path, path);
+    ckpt->generation = generation;
+    ckpt->base_size = size;
+    ckpt->seq = 0;
+    ckpt->log_size = 0;
+    clear_l4_dirty(layer);
+
+    return 0;
+}
+
+static int32_t
+pad_ckpt (FILE *f, uint64_t off)
+{
+    long at = ftell(f);
+
+    if (at < 0 || (uint64_t)at > off)
+        return 1;
+
+    return (off - at) &&
+        fwrite(zeros, off - at, 1, f) != 1;
+}
+
+int32_t
+save_l4 (struct layer *layer, const char *path)
+{
+    struct layer_state *st = NULL;
+    struct ckpt_header hdr;
+    struct minicolumn rec, *mc = NULL;
+    uint64_t s = 0;
+    uint32_t x, y;
+    char *tmp = NULL, *log = NULL;
+    FILE *f = NULL;
+
+    if (!layer || !layer->state->input) {
+        ERR("Layer 4 is not initialized\n");
+        return 1;
+    }
+    st = layer->state;
+
+    /* the log is replaced below, let the writer finish it. a
+       failed append does not matter to a full checkpoint. */
+    sync_l4_ckpt(layer);
+
+    /* header padding is written too, keep it deterministic */
+    memset(&hdr, 0, sizeof(struct ckpt_header));
+    hdr.magic = CKPT_MAGIC;
+    hdr.version = CKPT_VERSION;
+    hdr.mc_size = sizeof(struct minicolumn);
+    hdr.syn_size = sizeof(struct synapse);
+    hdr.height = layer->height;
+    hdr.width = layer->width;
+    hdr.input_rows = st->input->rows;
+    hdr.input_cols = st->input->cols;
+    hdr.inhibition_radius = layer->inhibition_radius;
+    hdr.conf = st->conf;
+    hdr.generation = (uint64_t)time(NULL) << 32 | (uint32_t)getpid();
+    if (hdr.generation <= st->ckpt.generation)
+        hdr.generation = st->ckpt.generation + 1;
+    for (y=0; y<layer->height; y++)
+        for (x=0; x<layer->width; x++)
+            hdr.num_synapses +=
+                (*(*(layer->minicolumns+y)+x))->num_synapses;
+    hdr.mc_off = CKPT_ALIGN_UP(sizeof(struct ckpt_header));
+    hdr.syn_off = CKPT_ALIGN_UP(hdr.mc_off +
+        (uint64_t)hdr.height*hdr.width*sizeof(struct minicolumn));
+    hdr.file_size = hdr.syn_off +
+        hdr.num_synapses*sizeof(struct synapse);
+
+    /* written beside the target and renamed over it, so a
+       crash never leaves a torn checkpoint behind */
+    tmp = suffix_path(path, ".tmp");
+    if (!tmp)
+        return 1;
+
+    f = fopen(tmp, "wb");
+    if (!f) {
+        ERR("Failed to open %s\n", tmp);
+        free(tmp);
+        return 1;
+    }
+
+    if (fwrite(&hdr, sizeof(struct ckpt_header), 1, f) != 1 ||
+        pad_ckpt(f, hdr.mc_off))
+        goto fail_ret;
+
+    /* the dendrite pointer is stored as the index of the first
+       synapse, the neighbor lists are rebuilt on restore */
+    for (y=0; y<layer->height; y++) {
+        for (x=0; x<layer->width; x++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            rec = *mc;
+            rec.proximal_dendrite_segment =
+                (struct synapse *)(uintptr_t)s;
+            rec.neighbors = NULL;
+            rec.cells = NULL;
+            if (fwrite(&rec, sizeof(struct minicolumn), 1, f) != 1)
+                goto fail_ret;
+            s += mc->num_synapses;
+        }
+    }
+
+    if (pad_ckpt(f, hdr.syn_off))
+        goto fail_ret;
+    for (y=0; y<layer->height; y++) {
+        for (x=0; x<layer->width; x++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            if (mc->num_synapses &&
+                fwrite(mc->proximal_dendrite_segment,
+                    sizeof(struct synapse), mc->num_synapses, f)
+                        != mc->num_synapses)
+                goto fail_ret;
+        }
+    }
+
+    if (fflush(f) || fsync(fileno(f)))
+        goto fail_ret;
+    if (fclose(f)) {
+        f = NULL;
+        goto fail_ret;
+    }
+    f = NULL;
+
+    if (rename(tmp, path)) {
+        ERR("Failed to rename %s to %s\n", tmp, path);
+        goto fail_ret;
+    }
+    free(tmp);
+
+    /* the old log extends the checkpoint just replaced. should
+       this not happen, its generation keeps it from being
+       replayed. */
+    log = suffix_path(path, ".log");
+    if (log)
+        remove(log);
+    free(log);
+
+    INFO("Layer 4 checkpoint written to %s\n", path);
+
+    return set_ckpt_base(layer, path, hdr.generation, hdr.file_size);
+
+    fail_ret:
+        ERR("Failed writing checkpoint %s\n", path);
+        if (f)
+            fclose(f);
+        remove(tmp);
+        free(tmp);
+        return 1;
+}
+
+/* a delta log entry, snapshot on the stepping thread and
+   appended by the writer */
+struct delta_entry
+{
+    struct delta_entry *next;
+    char *log;
+    /* the log size it is appended at */
+    uint64_t off;
+    uint64_t size;
+    uint32_t num_tiles;
+    char data[];
+};
+
+/* appends and syncs the entries in the order they were queued,
+   so the stepping thread never waits on the disk */
+struct ckpt_writer
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t queued, written;
+    struct delta_entry *head, *tail;
+    uint32_t pending;
+    char stop, failed;
+};
+
+/* entries waiting for the writer before the stepping thread
+   waits on it */
+#define DELTA_MAX_PENDING 4
+
+static int32_t
+append_delta (struct delta_entry *e)
+{
+    FILE *f = fopen(e->log, "ab");
+
+    if (!f) {
+        ERR("Failed to open %s\n", e->log);
+        return 1;
+    }
+    if (fwrite(e->data, e->size, 1, f) != 1 ||
+        fflush(f) || fsync(fileno(f))) {
+        fclose(f);
+        goto fail_ret;
+    }
+    if (fclose(f))
+        goto fail_ret;
+
+    DEBUG("Appended %u dirty tiles to %s\n", e->num_tiles, e->log);
+
+    return 0;
+
+    fail_ret:
+        ERR("Failed appending to %s\n", e->log);
+        /* cut a partial entry */
+        if (truncate(e->log, e->off))
+            ERR("Failed to truncate %s\n", e->log);
+        return 1;
+}
+
+static void*
+ckpt_writer_main (void *arg)
+{
+    struct ckpt_writer *w = arg;
+    struct delta_entry *e = NULL;
+    int32_t rc;
+    char failed;
+
+    pthread_mutex_lock(&w->lock);
+    for (;;) {
+        while (!w->head && !w->stop)
+            pthread_cond_wait(&w->queued, &w->lock);
+        /* stopping still writes out what was queued */
+        if (!w->head)
+            break;
+        e = w->head;
+        failed = w->failed;
+        pthread_mutex_unlock(&w->lock);
+
+        /* the entries behind a failed one would not follow on
+           from the log, they are dropped with it */
+        rc = failed || append_delta(e);
+
+        pthread_mutex_lock(&w->lock);
+        w->head = e->next;
+        if (!w->head)
+            w->tail = NULL;
+        w->pending--;
+        w->failed |= rc;
+        pthread_cond_broadcast(&w->written);
+        free(e->log);
+        free(e);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+static struct ckpt_writer*
+start_ckpt_writer (void)
+{
+    struct ckpt_writer *w = malloc(sizeof(struct ckpt_writer));
+
+    if (!w)
+        return NULL;
+    memset(w, 0, sizeof(struct ckpt_writer));
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->queued, NULL);
+    pthread_cond_init(&w->written, NULL);
+    if (pthread_create(&w->thread, NULL, ckpt_writer_main, w)) {
+        ERR("Failed to start the checkpoint writer\n");
+        pthread_mutex_destroy(&w->lock);
+        pthread_cond_destroy(&w->queued);
+        pthread_cond_destroy(&w->written);
+        free(w);
+        return NULL;
+    }
+
+    return w;
+}
+
+static void
+stop_ckpt_writer (struct ckpt_state *ckpt)
+{
+    struct ckpt_writer *w = ckpt->writer;
+
+    if (!w)
+        return;
+    pthread_mutex_lock(&w->lock);
+    w->stop = 1;
+    pthread_cond_signal(&w->queued);
+    pthread_mutex_unlock(&w->lock);
+    pthread_join(w->thread, NULL);
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->queued);
+    pthread_cond_destroy(&w->written);
+    free(w);
+    ckpt->writer = NULL;
+}
+
+int32_t
+sync_l4_ckpt (struct layer *layer)
+{
+    struct ckpt_state *ckpt = &layer->state->ckpt;
+    struct ckpt_writer *w = ckpt->writer;
+    char failed;
+
+    if (!w)
+        return 0;
+    pthread_mutex_lock(&w->lock);
+    while (w->pending)
+        pthread_cond_wait(&w->written, &w->lock);
+    failed = w->failed;
+    w->failed = 0;
+    pthread_mutex_unlock(&w->lock);
+
+    /* the log stops short of the layer, so it is forgotten
+       and the next checkpoint is a full one */
+    if (failed) {
+        ERR("The delta log of %s fell behind layer 4\n", ckpt->path);
+        free(ckpt->path);
+        ckpt->path = NULL;
+    }
+
+    return failed;
+}
+
+static char
+ckpt_writer_failed (struct ckpt_writer *w)
+{
+    char failed;
+
+    if (!w)
+        return 0;
+    pthread_mutex_lock(&w->lock);
+    failed = w->failed;
+    pthread_mutex_unlock(&w->lock);
+
+    return failed;
+}
+
+static void
+copy_sum (char **at, const void *buf, size_t n, uint32_t *sum)
+{
+    *sum = fnv1a(*sum, buf, n);
+    memcpy(*at, buf, n);
+    *at += n;
+}
+
+int32_t
+save_l4_delta (struct layer *layer, const char *path)
+{
+    struct ckpt_state *ckpt = NULL;
+    struct ckpt_writer *w = NULL;
+    struct dirty_map *dm = NULL;
+    struct delta_entry *e = NULL;
+    struct delta_header dh;
+    struct delta_trailer dt;
+    struct mc_state ms;
+    struct minicolumn *mc = NULL;
+    uint32_t *tiles = NULL;
+    uint32_t t, n = 0, x, y, x0, x1;
+    uint64_t size;
+    char *at = NULL;
+
+    if (!layer || !layer->state->input) {
+        ERR("Layer 4 is not initialized\n");
+        return 1;
+    }
+    ckpt = &layer->state->ckpt;
+    dm = &layer->state->dirty;
+
+    /* an append that failed leaves the log short */
+    if (ckpt_writer_failed(ckpt->writer))
+        sync_l4_ckpt(layer);
+
+    /* nothing to extend, or compaction is due */
+    if (!ckpt->path || strcmp(ckpt->path, path) ||
+        ckpt->log_size > ckpt->base_size)
+        return save_l4(layer, path);
+
+    tiles = malloc(sizeof(uint32_t)*(dm->tiles+1));
+    if (!tiles)
+        goto fail_ret;
+
+    memset(&dh, 0, sizeof(struct delta_header));
+    dh.magic = DELTA_MAGIC;
+    dh.seq = ckpt->seq;
+    dh.generation = ckpt->generation;
+    dh.inhibition_radius = layer->inhibition_radius;
+    dh.size = sizeof(struct mc_state)*layer->height*layer->width;
+    for (t=0; t<dm->tiles; t++) {
+        if (!(dm->bits[t/32] & 1u << t%32))
+            continue;
+        tiles[n++] = t;
+        tile_bounds(layer, t, &y, &x0, &x1);
+        for (x=x0; x<x1; x++)
+            dh.size += sizeof(struct synapse) *
+                (*(*(layer->minicolumns+y)+x))->num_synapses;
+    }
+    dh.num_tiles = n;
+    dh.size += sizeof(uint32_t)*n;
+    size = sizeof(struct delta_header) + dh.size +
+        sizeof(struct delta_trailer);
+
+    /* the whole entry is taken now, the layer moves on while
+       the writer has it */
+    e = malloc(sizeof(struct delta_entry) + size);
+    if (!e)
+        goto fail_ret;
+    e->next = NULL;
+    e->log = suffix_path(path, ".log");
+    e->off = ckpt->log_size;
+    e->size = size;
+    e->num_tiles = n;
+    if (!e->log)
+        goto fail_ret;
+
+    at = e->data;
+    memcpy(at, &dh, sizeof(struct delta_header));
+    at += sizeof(struct delta_header);
+    dt.magic = DELTA_MAGIC;
+    dt.sum = FNV_BASIS;
+    copy_sum(&at, tiles, sizeof(uint32_t)*n, &dt.sum);
+
+    memset(&ms, 0, sizeof(struct mc_state));
+    for (y=0; y<layer->height; y++) {
+        for (x=0; x<layer->width; x++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            ms.overlap = mc->overlap;
+            ms.raw_overlap = mc->raw_overlap;
+            ms.boost = mc->boost;
+            ms.active_mask = mc->active_mask;
+            copy_sum(&at, &ms, sizeof(struct mc_state), &dt.sum);
+        }
+    }
+
+    for (t=0; t<n; t++) {
+        tile_bounds(layer, tiles[t], &y, &x0, &x1);
+        for (x=x0; x<x1; x++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            copy_sum(&at, mc->proximal_dendrite_segment,
+                sizeof(struct synapse)*mc->num_synapses, &dt.sum);
+        }
+    }
+    memcpy(at, &dt, sizeof(struct delta_trailer));
+
+    if (!ckpt->writer && !(ckpt->writer = start_ckpt_writer()))
+        goto fail_ret;
+    w = ckpt->writer;
+    pthread_mutex_lock(&w->lock);
+    while (w->pending >= DELTA_MAX_PENDING)
+        pthread_cond_wait(&w->written, &w->lock);
+    if (w->tail)
+        w->tail->next = e;
+    else
+        w->head = e;
+    w->tail = e;
+    w->pending++;
+    pthread_cond_signal(&w->queued);
+    pthread_mutex_unlock(&w->lock);
+
+    ckpt->seq++;
+    ckpt->log_size += size;
+    clear_l4_dirty(layer);
+
+    free(tiles);
+
+    return 0;
+
+    fail_ret:
+        ERR("Failed appending to the delta log of %s\n", path);
+        if (e)
+            free(e->log);
+        free(e);
+        free(tiles);
+        return 1;
+}
+
+/* check an entry against the layer before changing anything,
+   then apply it */
+static int32_t
+apply_delta (struct layer *layer, struct delta_header *dh, char *buf)
+{
+    struct dirty_map *dm = &layer->state->dirty;
+    uint32_t *tiles = (uint32_t *)buf;
+    struct mc_state *st = NULL;
+    struct synapse *syn = NULL;
+    struct minicolumn *mc = NULL;
+    uint64_t size;
+    uint32_t t, x, y, x0, x1, s;
+
+    if (dh->num_tiles > dm->tiles)
+        return 1;
+    size = sizeof(uint32_t)*dh->num_tiles +
+        sizeof(struct mc_state)*layer->height*layer->width;
+    for (t=0; t<dh->num_tiles; t++) {
+        if (tiles[t] >= dm->tiles)
+            return 1;
+        tile_bounds(layer, tiles[t], &y, &x0, &x1);
+        for (x=x0; x<x1; x++)
+            size += sizeof(struct synapse) *
+                (*(*(layer->minicolumns+y)+x))->num_synapses;
+    }
+    if (size != dh->size)
+        return 1;
+
+    /* learning moves permanences, never the bits synapses sit on */
+    syn = (struct synapse *)((struct mc_state *)(tiles + dh->num_tiles) +
+        (size_t)layer->height*layer->width);
+    for (t=0; t<dh->num_tiles; t++) {
+        tile_bounds(layer, tiles[t], &y, &x0, &x1);
+        for (x=x0; x<x1; x++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            for (s=0; s<mc->num_synapses; s++, syn++)
+                if (syn->srcx != mc->proximal_dendrite_segment[s].srcx ||
+                    syn->srcy != mc->proximal_dendrite_segment[s].srcy)
+                    return 1;
+        }
+    }
+
+    st = (struct mc_state *)(tiles + dh->num_tiles);
+    for (y=0; y<layer->height; y++) {
+        for (x=0; x<layer->width; x++, st++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            mc->overlap = st->overlap;
+            mc->raw_overlap = st->raw_overlap;
+            mc->boost = st->boost;
+            mc->active_mask = st->active_mask;
+        }
+    }
+
+    syn = (struct synapse *)st;
+    for (t=0; t<dh->num_tiles; t++) {
+        tile_bounds(layer, tiles[t], &y, &x0, &x1);
+        for (x=x0; x<x1; x++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            memcpy(mc->proximal_dendrite_segment, syn,
+                sizeof(struct synapse)*mc->num_synapses);
+            syn += mc->num_synapses;
+        }
+    }
+
+    layer->inhibition_radius = dh->inhibition_radius;
+
+    return 0;
+}
+
+/* apply every complete entry of the checkpoint's log in order.
+   replay stops at the first entry that is torn, corrupt or from
+   another checkpoint, and the log is cut there. */
+static int32_t
+replay_l4_log (struct layer *layer, const char *path)
+{
+    struct ckpt_state *ckpt = &layer->state->ckpt;
+    struct delta_header dh;
+    struct delta_trailer dt;
+    char *log = NULL, *buf = NULL, *nbuf = NULL;
+    uint64_t cap = 0;
+    long good = 0;
+    FILE *f = NULL;
+
+    log = suffix_path(path, ".log");
+    if (!log)
+        return 1;
+    f = fopen(log, "rb");
+    if (!f) {
+        /* no log, the checkpoint is all there is */
+        free(log);
+        return 0;
+    }
+
+    while (fread(&dh, sizeof(struct delta_header), 1, f) == 1) {
+        if (dh.magic != DELTA_MAGIC ||
+            dh.generation != ckpt->generation || dh.seq != ckpt->seq)
+            break;
+        if (dh.size > cap) {
+            if (!(nbuf = realloc(buf, dh.size)))
+                break;
+            buf = nbuf;
+            cap = dh.size;
+        }
+        if (fread(buf, 1, dh.size, f) != dh.size ||
+            fread(&dt, sizeof(struct delta_trailer), 1, f) != 1 ||
+            dt.magic != DELTA_MAGIC ||
+            dt.sum != fnv1a(FNV_BASIS, buf, dh.size) ||
+            apply_delta(layer, &dh, buf))
+            break;
+        ckpt->seq++;
+        good = ftell(f);
+    }
+    fclose(f);
+    free(buf);
+
+    if (good < 0 || truncate(log, good)) {
+        ERR("Failed to truncate %s\n", log);
+        free(log);
+        return 1;
+    }
+    ckpt->log_size = good;
+
+    INFO("Replayed %u delta log entries from %s\n", ckpt->seq, log);
+    free(log);
+
+    return 0;
+}
+
+static void
+warn_unreplayed_log (const char *path)
+{
+    struct stat sb;
+    char *log = suffix_path(path, ".log");
+
+    if (log && !stat(log, &sb) && sb.st_size > 0)
+        WARN("Delta log %s is not applied to a shared model. "
+            "Compact it into the checkpoint first.\n", log);
+    free(log);
+}
+
+/* everything in the header must agree with this build and the
+   file, before anything in the mapping is trusted */
+static int32_t
+check_ckpt (struct ckpt_header *hdr, size_t size, repr_t *input)
+{
+    uint64_t num_mcs;
+
+    if (hdr->magic != CKPT_MAGIC) {
+        ERR("Not a checkpoint file\n");
+        return 1;
+    }
+    if (hdr->version != CKPT_VERSION) {
+        ERR("Checkpoint version %u, expected %u\n",
+            hdr->version, CKPT_VERSION);
+        return 1;
+    }
+    if (hdr->mc_size != sizeof(struct minicolumn) ||
+        hdr->syn_size != sizeof(struct synapse)) {
+        ERR("Checkpoint was written by an incompatible build\n");
+        return 1;
+    }
+    if (hdr->height != hdr->conf.height ||
+        hdr->width != hdr->conf.width) {
+        ERR("Checkpoint dimensions are inconsistent\n");
+        return 1;
+    }
+
+    num_mcs = (uint64_t)hdr->height*hdr->width;
+    if (hdr->file_size != size ||
+        hdr->mc_off % CKPT_ALIGN || hdr->syn_off % CKPT_ALIGN ||
+        hdr->mc_off < sizeof(struct ckpt_header) ||
+        hdr->syn_off < hdr->mc_off + num_mcs*sizeof(struct minicolumn) ||
+        hdr->file_size !=
+            hdr->syn_off + hdr->num_synapses*sizeof(struct synapse)) {
+        ERR("Checkpoint is truncated or corrupt\n");
+        return 1;
+    }
+
+    if (hdr->input_rows != input->rows ||
+        hdr->input_cols != input->cols) {
+        ERR("Checkpoint input (%u, %u) does not match (%u, %u)\n",
+            hdr->input_rows, hdr->input_cols,
+            input->rows, input->cols);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* the kernels index the input with the synapses of the mapping
+   as they are, so every minicolumn's range and every synapse's
+   bit must be inside the checkpoint and the input */
+static int32_t
+check_ckpt_synapses (
+    struct ckpt_header *hdr,
+    struct minicolumn *mcs,
+    struct synapse *syns
+) {
+    uint64_t m, s, off;
+
+    for (m=0; m<(uint64_t)hdr->height*hdr->width; m++) {
+        off = (uintptr_t)mcs[m].proximal_dendrite_segment;
+        if (off > hdr->num_synapses ||
+            mcs[m].num_synapses > hdr->num_synapses - off) {
+            ERR("Checkpoint synapse range out of bounds\n");
+            return 1;
+        }
+    }
+    for (s=0; s<hdr->num_synapses; s++) {
+        if (syns[s].srcx >= hdr->input_cols ||
+            syns[s].srcy >= hdr->input_rows) {
+            ERR("Checkpoint synapse %lu is outside the input\n",
+                (unsigned long)s);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+struct layer*
+map_l4 (const char *path, repr_t *input, char shared)
+{
+    struct ckpt_header *hdr = NULL;
+    struct minicolumn *mcs = NULL, *mc = NULL;
+    struct synapse *syns = NULL;
+    struct layer *layer = NULL;
+    struct stat sb;
+    void *addr = NULL;
+    uint32_t x, y;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        ERR("Failed to open %s\n", path);
+        return NULL;
+    }
+    if (fstat(fd, &sb) || (size_t)sb.st_size < sizeof(struct ckpt_header)) {
+        ERR("Checkpoint %s is too small\n", path);
+        close(fd);
+        return NULL;
+    }
+    /* private, so learning after a restore never writes back
+       into the checkpoint */
+    addr = mmap(NULL, sb.st_size, PROT_READ|PROT_WRITE,
+        MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+        ERR("Failed to map %s\n", path);
+        close(fd);
+        return NULL;
+    }
+
+    hdr = (struct ckpt_header *)addr;
+    if (check_ckpt(hdr, sb.st_size, input)) {
+        close(fd);
+        goto fail_ret;
+    }
+
+    /* the synapses are the bulk of the model. mapped shared over
+       their private pages, every process restoring the file reads
+       the same page cache copy, and only the minicolumn records,
+       where overlaps and activity live, are per process. the
+       synapse array starts on a page boundary for this. */
+    if (shared && hdr->num_synapses &&
+        mmap((char *)addr + hdr->syn_off, sb.st_size - hdr->syn_off,
+            PROT_READ, MAP_SHARED|MAP_FIXED, fd, hdr->syn_off)
+                == MAP_FAILED) {
+        ERR("Failed to map the synapses of %s shared\n", path);
+        close(fd);
+        goto fail_ret;
+    }
+    close(fd);
+
+    mcs = (struct minicolumn *)((char *)addr + hdr->mc_off);
+    syns = (struct synapse *)((char *)addr + hdr->syn_off);
+    if (check_ckpt_synapses(hdr, mcs, syns))
+        goto fail_ret;
+
+    if (!(layer = calloc(1, sizeof(struct layer))))
+        goto fail_ret;
+    if (!(layer->state = calloc(1, sizeof(struct layer_state))))
+        goto fail_ret;
+    layer->minicolumns = calloc(
+        hdr->height, sizeof(struct minicolumn **));
+    if (!layer->minicolumns)
+        goto fail_ret;
+    for (y=0; y<hdr->height; y++) {
+        *(layer->minicolumns+y) = calloc(
+            hdr->width, sizeof(struct minicolumn *));
+        if (!*(layer->minicolumns+y))
+            goto fail_ret;
+    }
+
+    for (y=0; y<hdr->height; y++) {
+        for (x=0; x<hdr->width; x++) {
+            mc = mcs + (uint64_t)y*hdr->width + x;
+            mc->proximal_dendrite_segment =
+                syns + (uintptr_t)mc->proximal_dendrite_segment;
+            mc->neighbors = NULL;
+            mc->cells = NULL;
+            *(*(layer->minicolumns+y)+x) = mc;
+        }
+    }
+
+    layer->state->mcs = mcs;
+    layer->state->map.addr = addr;
+    layer->state->map.size = sb.st_size;
+
+    layer->inhibition_radius = hdr->inhibition_radius;
+    if (configure_layer4(layer, hdr->conf)) {
+        ERR("No memory to configure layer 4\n");
+        free_l4(layer);
+        return NULL;
+    }
+    layer->state->learning = !shared;
+
+    /* a shared model never learns, so it has no log of its own,
+       and the synapses could not take the entries of one */
+    if (shared)
+        warn_unreplayed_log(path);
+    else if (set_ckpt_base(layer, path, hdr->generation, sb.st_size) ||
+             replay_l4_log(layer, path)) {
+        free_l4(layer);
+        return NULL;
+    }
+
+    if (rebuild_l4_neighbors(layer)) {
+        ERR("No memory for minicolumn neighbors\n");
+        free_l4(layer);
+        return NULL;
+    }
+    if (attach_l4_input(layer, input)) {
+        free_l4(layer);
+        return NULL;
+    }
+    /* the winners of the step the layer was saved after, in
+       the list the inhibition keeps too */
+    for (y=0; y<layer->height; y++)
+        for (x=0; x<layer->width; x++)
+            if (MC_ACTIVE_AT(*(*(layer->minicolumns+y)+x), 0)) {
+                SET_REPR_BIT_FAST(layer->state->active, y, x);
+                layer->state->active->active
+                    [layer->state->active->num_active++] =
+                    y*layer->width + x;
+            }
+
+    INFO("Layer 4 restored from %s%s, dimensions = (%u, %u)\n",
+        path, shared ? " (shared, read-only)" : "",
+        layer->height, layer->width);
+
+    return layer;
+
+    fail_ret:
+        if (layer) {
+            if (layer->minicolumns)
+                for (y=0; y<hdr->height; y++)
+                    free(*(layer->minicolumns+y));
+            free(layer->minicolumns);
+            free(layer->state);
+            free(layer);
+        }
+        munmap(addr, sb.st_size);
+        return NULL;
+}
+
+void
+unmap_l4 (struct layer *layer)
+{
+    struct layer_map *map = &layer->state->map;
+
+    if (!map->addr)
+        return;
+
+    munmap(map->addr, map->size);
+    memset(map, 0, sizeof(struct layer_map));
+}
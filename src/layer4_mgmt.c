@@ -7,188 +7,389 @@
 #include "minicolumn.h"
 #include "synapse.h"
 #include "threads.h"
+#include "cpu.h"
+#include "plugin.h"
+#include "affinity.h"
 #include "utils.h"
 
-/* globals declared extern */
-struct layer *layer4, *layer6;
-uint32_t layer4_width;
-uint32_t layer4_height;
-float local_mc_activity;
-pthread_attr_t threadattr;
-
-/* structure passed to the threads */
-struct thread_data td[NUM_THREADS];
-/* represents number of minicolumn rows per thread */
-static uint32_t rows_thread_bitmask;
-/* represents theoretical maximum rows for number of threads */
-static uint32_t max_rows_mask;
-
-int32_t
-free_l4 ( void );
+static int32_t
+build_input_index (struct layer *layer, repr_t *input);
+static void
+free_input_index (struct layer *layer);
 
 #define LAYER_BAIL \
     do { \
-        free_l4(); \
+        free_l4(layer); \
         ERR("No memory to alloc layer 4\n"); \
         return NULL; \
     } while (0);
 
+/* explicitly make threads joinable */
+static void
+init_thread_attr (pthread_attr_t *attr)
+{
+    pthread_attr_init(attr);
+    pthread_attr_setdetachstate(attr, PTHREAD_CREATE_JOINABLE);
+}
+
+/* split the minicolumn rows between the threads, in order. the
+   first threads take one more row while the remainder lasts. */
+static void
+partition_l4_rows (struct layer *layer)
+{
+    struct layer_state *st = layer->state;
+    struct thread_data *td = st->td;
+    uint32_t t, n = st->num_threads;
+
+    for (t=0; t<n; t++) {
+        td[t].layer = layer;
+        td[t].minicolumns = layer->minicolumns;
+        td[t].input = st->input;
+        td[t].column_complexity = st->conf.colconf.column_complexity;
+        td[t].row_num = layer->height/n + (t < layer->height%n);
+        td[t].row_width = layer->width;
+        td[t].row_start =
+            t ? td[t-1].row_start + td[t-1].row_num : 0;
+        td[t].avg_inhib_rad = &layer->inhibition_radius;
+    }
+}
+
+int32_t
+layer4_set_threads (
+    struct layer *layer,
+    uint32_t threads,
+    const char *affinity
+) {
+    struct layer_state *st = layer->state;
+    int32_t cpus[MAX_AFFINITY_CPUS];
+    int32_t num_cpus;
+    uint32_t t;
+
+    if (!threads)
+        threads = 1;
+    if (threads > MAX_THREADS || threads > layer->height) {
+        ERR("Layer 4 runs on at most %u threads, and one per row\n",
+            MAX_THREADS);
+        return 1;
+    }
+    if ((num_cpus = affinity_cpus(affinity, cpus, MAX_AFFINITY_CPUS)) < 0)
+        return 1;
+
+    for (t=0; t<threads; t++) {
+        /* a fresh attribute unpins the thread */
+        pthread_attr_destroy(&st->threadattr[t]);
+        init_thread_attr(&st->threadattr[t]);
+        if (num_cpus &&
+            pin_thread_attr(&st->threadattr[t], cpus[t % num_cpus]))
+            return 1;
+    }
+    st->num_threads = threads;
+    partition_l4_rows(layer);
+    INFO("Layer 4 runs on %u threads%s\n", threads,
+        num_cpus ? ", pinned" : "");
+
+    return 0;
+}
+
+/* set the layer dimensions, the parameters shared with the
+   algorithms, and partition the minicolumn rows between the
+   threads. layer->minicolumns must already be in place. */
+int32_t
+configure_layer4 (struct layer *layer, struct layer4_conf conf)
+{
+    struct layer_state *st = layer->state;
+    uint32_t t;
+
+    st->conf = conf;
+    st->learning = 1;
+    /* layers built without an htm pick their kernels here */
+    cpu_dispatch();
+
+    layer->height = conf.height;
+    layer->width = conf.width;
+
+    st->local_mc_activity = conf.colconf.local_activity;
+    st->delta_overlap_max = conf.colconf.delta_overlap_max;
+    st->build_input_index =
+        conf.colconf.input_index || st->delta_overlap_max > 0;
+    layer4_use_reference(layer, conf.colconf.reference);
+
+    if (!st->active &&
+        !(st->active = new_repr(conf.height, conf.width)))
+        return 1;
+    /* the inhibition lists the winners as it goes, and every
+       minicolumn may win */
+    if (reserve_active_repr(st->active, conf.height*conf.width))
+        return 1;
+
+    /* one floating thread until layer4_set_threads says
+       otherwise */
+    if (!st->num_threads) {
+        for (t=0; t<MAX_THREADS; t++)
+            init_thread_attr(&st->threadattr[t]);
+        st->num_threads = 1;
+    }
+    partition_l4_rows(layer);
+
+    return alloc_l4_dirty(layer);
+}
+
 struct layer*
 alloc_layer4 (struct layer4_conf conf)
 {
-    unsigned int rem_rows;
-    uint32_t t, x, y;
+    struct layer *layer = NULL;
+    struct layer_state *st = NULL;
+    uint32_t x, y;
 
     INFO("Allocating layer 4, dimensions = (%u, %u)\n",
         conf.height, conf.width);
 
-    /* free any pre-existing layer4 memory */
-    if (layer4 != NULL)
-        free_l4();
-
-    if (!(layer4 = calloc(1, sizeof(struct layer))))
+    if (!(layer = calloc(1, sizeof(struct layer))))
+        LAYER_BAIL
+    if (!(st = layer->state = calloc(1, sizeof(struct layer_state))))
         LAYER_BAIL
+    layer->height = conf.height;
+    layer->width = conf.width;
 
-    layer4->minicolumns = calloc(
+    layer->minicolumns = calloc(
             conf.height, sizeof(struct minicolumn **));
-    if (!layer4->minicolumns)
+    if (!layer->minicolumns)
         LAYER_BAIL
 
+    /* the row pointers index into one block of minicolumns. a
+       large block comes as fresh pages, untouched until the
+       threads of init_l4 write their rows. */
+    st->arena.mcs = calloc(
+        (size_t)conf.height*conf.width, sizeof(struct minicolumn));
+    if (!st->arena.mcs)
+        LAYER_BAIL
+    st->mcs = st->arena.mcs;
+
     for (y=0; y<conf.height; y++) {
-        *(layer4->minicolumns+y) = calloc(
+        *(layer->minicolumns+y) = calloc(
             conf.width, sizeof(struct minicolumn *));
-        if (!*(layer4->minicolumns+y))
+        if (!*(layer->minicolumns+y))
             LAYER_BAIL
-        for (x=0; x<conf.width; x++) {
-            *(*(layer4->minicolumns+y)+x) = calloc(
-                1, sizeof(struct minicolumn));
-            if (!*(*(layer4->minicolumns+y)+x))
-                LAYER_BAIL
-        }
+        for (x=0; x<conf.width; x++)
+            *(*(layer->minicolumns+y)+x) =
+                st->arena.mcs + (size_t)y*conf.width + x;
     }
 
-    layer4->height = conf.height;
-    layer4->width = conf.width;
-    layer4_height = conf.height;
-    layer4_width = conf.width;
-
-    local_mc_activity = conf.colconf.local_activity;
-
-    /* partition minicolumns between multiple threads. given
-       the number of threads, compute how many rows of minicolumns
-       can be stored?
-
-       1 thread: 32-bit mask can encode rows using all 32
-       bits, 0xffffffff (4294967295) rows at maximum.
-       2 threads: 16 bits, 0xffff (65535) rows.
-       4 threads: 8 bits, 0xff (255) rows
-       8 threads: 4 bits, 0xf (15) rows */
-
-/*
-    max_rows_mask =
-        UINT_MAX >>
-            ((uint32_t)__WORDSIZE - ((uint32_t)(
-                ((float)sizeof(uint32_t)/NUM_THREADS)*8)));
-*/
-
-    /* this does not always equal zero because it is integer
-       math. */
-    rem_rows =
-        layer4->height-layer4->height/NUM_THREADS*NUM_THREADS;
-
-    /* rows per thread vs maximum allowed */
-/*
-    if (layer->height/NUM_THREADS+rem_rows > max_rows_mask) {
-        ERR("%d threads not supported "
-                        "for %u rows\n",
-                NUM_THREADS, layer->height);
-        return NULL;
+    if (configure_layer4(layer, conf))
+        LAYER_BAIL
+
+    INFO("Layer 4 allocation complete.\n");
+
+    return layer;
+}
+
+int32_t
+free_l4 (struct layer *layer)
+{
+    struct layer_state *st = NULL;
+    uint32_t x, y, t;
+
+    if (!layer)
+        return 0;
+    if (!(st = layer->state)) {
+        free(layer);
+        return 0;
     }
-*/
-
-    /* set the bitmask of minicolumn rows for each thread */
-/*    for (t=0; t<NUM_THREADS; t++) {*/
-        /* the remainder rows are added to thread 0 */
-/*        rows_thread_bitmask |=
-            (layer->height/NUM_THREADS+(!t?rem_rows:0)) <<
-                t * ((uint32_t)(
-                    ((float)sizeof(uint32_t)/NUM_THREADS)*8));
+
+    free_input_index(layer);
+    unload_l4_kernels(layer);
+    /* the attributes are set up with the first configuration */
+    for (t=0; t<MAX_THREADS && st->num_threads; t++)
+        pthread_attr_destroy(&st->threadattr[t]);
+
+    /* neighbor lists are the only memory of a minicolumn of
+       its own. the minicolumns and synapses are in the arena,
+       or in the checkpoint mapping of a restored layer. */
+    for (y=0; y<layer->height && layer->minicolumns; y++) {
+        if (!*(layer->minicolumns+y))
+            continue;
+        for (x=0; x<layer->width; x++)
+            free((*(*(layer->minicolumns+y)+x))->neighbors);
+        free(*(layer->minicolumns+y));
     }
-*/
-    /* set the attributes of thread structures */
-    for (t=0; t<NUM_THREADS; t++) {
-        td[t].minicolumns = layer4->minicolumns;
-        td[t].column_complexity = conf.colconf.column_complexity;
-        td[t].row_num = layer4->height/NUM_THREADS+(!t?rem_rows:0);
-/*
-            max_rows_mask & (rows_thread_bitmask >> t * ((uint32_t)(
-                ((float)sizeof(uint32_t)/NUM_THREADS)*8)));
-*/
-        td[t].row_width = layer4->width;
+    free(layer->minicolumns);
+    free(st->arena.mcs);
+    free(st->arena.syns);
+    free_l4_dirty(layer);
+    unmap_l4(layer);
+    if (st->active)
+        free_repr(st->active);
+    free(st->syn_offsets);
 
-        td[t].row_start =
-            t ? td[t-1].row_start + td[t-1].row_num : 0;
+    /* free the layer */
+    free(st);
+    free(layer);
 
-        td[t].avg_inhib_rad = &layer4->inhibition_radius;
-    }
+    return 0;
+}
+
+/* the part of the input a minicolumn centered on (xcent, ycent)
+   samples, rad input bits around the center. max is exclusive. */
+static inline uint32_t
+receptive_field (
+    repr_t *input,
+    uint32_t rad,
+    uint32_t xcent,
+    uint32_t ycent,
+    uint32_t *minx,
+    uint32_t *maxx,
+    uint32_t *miny,
+    uint32_t *maxy
+) {
+    *maxx = xcent+rad >= input->cols?
+        input->cols - 1 : xcent+rad;
+    *maxy = 0;
+    if (input->rows>1)
+        *maxy = ycent+rad >= input->rows?
+            input->rows - 1 : ycent + rad;
+    *minx = xcent < rad ? 0 : xcent - rad;
+    *miny = 0;
+    if (input->rows>1)
+        *miny = ycent < rad ? 0 : ycent - rad;
+
+    return (*maxx-*minx)*(*maxy-*miny);
+}
 
-    /* set the attribute to explicitly make threads joinable */
-    pthread_attr_init(&threadattr);
-    pthread_attr_setdetachstate(&threadattr, PTHREAD_CREATE_JOINABLE);
+/* the number of synapses a minicolumn samples from a receptive
+   field of n input bits, its potential pool */
+static inline uint32_t
+potential_size (struct layer *layer, uint32_t n)
+{
+    float pct = layer->state->conf.colconf.potential_pct;
 
-    INFO("Layer 4 allocation complete.\n");
+    if (pct <= 0 || pct >= 1)
+        return n;
 
-    return layer4;
+    return ceil(n*pct);
 }
 
-int32_t
-free_l4 ( void )
+/* place a thread's minicolumns over the input and size their
+   potential pools. this is the first write to the block of
+   minicolumns, which alloc_layer4 leaves untouched, so the pages
+   of each thread's rows are placed in its node. */
+static void*
+place_minicolumns (void *thread_data)
 {
-    uint32_t x, y;
+    uint32_t x, y, xcent, ycent;
+    uint32_t minx, miny, maxx, maxy;
+    struct thread_data *td = (struct thread_data *)thread_data;
+    struct layer *layer = td->layer;
+    repr_t *input = td->input;
+    struct minicolumn *mc = NULL;
+
+    for (y=td->row_start; y<td->row_start+td->row_num; y++) {
+        for (x=0; x<td->row_width; x++) {
+            mc = *(*(td->minicolumns+y)+x);
+            /* compute the natural center over the input */
+            xcent = x*(input->cols/layer->width) +
+                    input->cols/layer->width/2;
+            ycent = 0; /* true always when input is 1D */
+            if (input->rows>1)
+                ycent = y*(input->rows/layer->height) +
+                        input->rows/layer->height/2;
+            mc->input_xcent = xcent;
+            mc->input_ycent = ycent;
+            mc->num_synapses = potential_size(layer, receptive_field(input,
+                td->rec_fld_rad, xcent, ycent,
+                &minx, &maxx, &miny, &maxy));
+        }
+    }
 
-    /* free the layer's minicolumns */
-    for (y=0; y<layer4->height; y++) {
-        for (x=0; x<layer4->width; x++) {
-            free_dendrite(
-                (*(*(layer4->minicolumns+y)+x))->proximal_dendrite_segment
-            );
-            free(*(*(layer4->minicolumns+y)+x));
+    pthread_exit(NULL);
+}
+
+/* fill the synapses of a thread's rows. the arena is written
+   by the threads that will work on it, for the same reason. */
+static void*
+init_minicolumns (void *thread_data)
+{
+    uint32_t x, y, xidx, yidx;
+    uint32_t minx, miny, maxx, maxy;
+    uint32_t n, k;
+    uint64_t rng;
+    struct thread_data *td = (struct thread_data *)thread_data;
+    struct layer4_conf *conf = &td->layer->state->conf;
+    float pct = conf->colconf.potential_pct;
+    char sampled = pct > 0 && pct < 1;
+    struct minicolumn *mc = NULL;
+    struct synapse *synptr = NULL;
+
+    for (y=td->row_start; y<td->row_start+td->row_num; y++) {
+        for (x=0; x<td->row_width; x++) {
+            mc = *(*(td->minicolumns+y)+x);
+            n = receptive_field(td->input, td->rec_fld_rad,
+                mc->input_xcent, mc->input_ycent,
+                &minx, &maxx, &miny, &maxy);
+            k = mc->num_synapses;
+            /* a stream per minicolumn, so the layer does not
+               depend on how the rows are split between threads */
+            rng = conf->colconf.seed ^
+                (uint64_t)(y*td->row_width+x) * 0xd1b54a32d192ed03ull;
+            /* initialize the proximal dendrite segment with
+               synapses connected to input bits from the
+               receptive field */
+            synptr = mc->proximal_dendrite_segment;
+            for (yidx=miny; yidx<maxy; yidx++) {
+                for (xidx=minx; xidx<maxx; xidx++, n--) {
+                    /* selection sampling. of the n bits left, take
+                       this one with probability k/n, which keeps
+                       exactly k of them, in order. */
+                    if (k < n && next_rand_unit(&rng)*n >= k)
+                        continue;
+                    synptr->perm = CONNECTED_PERM;
+                    if (sampled)
+                        synptr->perm += PERM_INIT_RANGE *
+                            (2*next_rand_unit(&rng) - 1);
+                    synptr->srcx = xidx;
+                    synptr->srcy = yidx;
+                    synptr++;
+                    k--;
+                }
+            }
+            /* initialize active bitmask */
+            mc->active_mask = 0;
+            /* set the initial boost value */
+            mc->boost = 1.0;
         }
-        free(*(layer4->minicolumns+y));
     }
 
-    /* free the layer */
-    free(layer4);
-    layer4 = NULL;
+    pthread_exit(NULL);
 }
 
 int32_t
 init_l4(
+    struct layer *layer,
     repr_t *input,
     float rec_fld_perc
 ) {
-    uint32_t x, y, xidx, yidx;
-    uint32_t xcent, ycent;
-    uint32_t minx, miny, maxx, maxy;
-    uint32_t rec_fld_sz, sqr;
-    struct synapse *synptr = NULL;
+    struct layer_state *st = layer->state;
+    struct thread_data *td = st->td;
+    uint32_t x, y, t;
+    uint32_t sqr;
+    uint64_t total = 0;
+    struct minicolumn *mc = NULL;
 
     /* validate input dimensions are compatible. the input
        dimensions must be at least equal to that of the
        minicolumns. */
     if (input->rows>1 && input->cols>1) {
         /* Input pattern is 2-dimensional. */
-        if (layer4->height > input->rows) {
+        if (layer->height > input->rows) {
             ERR("input height less than minicolumn height\n");
             return 1;
         }
-        if (layer4->width > input->cols) {
+        if (layer->width > input->cols) {
             ERR("input width less than minicolumn width\n");
             return 1;
         }
     } else if (input->rows==1 && input->cols>1) {
         /* Input is 1-dimensional. */
-        if (layer4->width > input->cols) {
+        if (layer->width > input->cols) {
             ERR("input width less than minicolumn width\n");
             return 1;
         }
@@ -203,62 +404,203 @@ init_l4(
     /* radius of the square */
      sqr /= 2;
 
-    for (y=0; y<layer4->height; y++) {
-        for (x=0; x<layer4->width; x++) {
-            /* compute the natural center over the input */
-            xcent = x*(input->cols/layer4->width) +
-                    input->cols/layer4->width/2;
-            ycent = 0; /* true always when input is 1D */
-            if (input->rows>1)
-                ycent = y*(input->rows/layer4->height) +
-                        input->rows/layer4->height/2;
-            /*INFO("xcent %u ycent %u\n", xcent, ycent);*/
-            layer4->minicolumns[y][x]->input_xcent = xcent;
-            layer4->minicolumns[y][x]->input_ycent = ycent;
-
-            /* compute number of synapses */
-            maxx = xcent+sqr >= input->cols?
-                input->cols - 1 : xcent+sqr;
-            maxy = 0;
-            if (input->rows>1)
-                maxy = ycent+sqr >= input->rows?
-                    input->rows - 1 : ycent + sqr;
-            minx = xcent < sqr ? 0 : xcent - sqr;
-            miny = 0;
-            if (input->rows>1)
-                miny = ycent < sqr ? 0 : ycent - sqr;
-
-            (*(*(layer4->minicolumns+y)+x))->num_synapses =
-                (maxx-minx)*(maxy-miny);
-            /*INFO("x %u %u y %u %u\n",
-                minx, maxx, miny, maxy);*/
-            /*INFO("%u\n", (*(*(layer4->minicolumns+y)+x))->num_synapses);*/
-            /* allocate the synaptic memory */
-            if (alloc_minicolumn_synapses(
-                *(*(layer4->minicolumns+y)+x))>0) {
-                ERR("No memory for minicolumn synapses\n");
-                return 1;
-            }
-            /* initialize the proximal dendrite segment with
-               synapses connected to input bits from the
-               receptive field */
-            synptr = (*(*(layer4->minicolumns+y)+x))->proximal_dendrite_segment;
-            for (yidx=miny; yidx<maxy; yidx++) {
-                for (xidx=minx; xidx<maxx; xidx++) {
-                    synptr->source = input;
-                    synptr->perm = CONNECTED_PERM;
-                    synptr->srcx = xidx;
-                    synptr->srcy = yidx;
-                    synptr++;
-                }
+    for (t=0; t<st->num_threads; t++) {
+        td[t].input = input;
+        td[t].rec_fld_rad = sqr;
+    }
+    if (run_l4_phase(st, place_minicolumns)) {
+        ERR("Failed to place the minicolumns\n");
+        return 1;
+    }
+
+    /* count the synapses of every potential pool, so they all
+       fit in one allocation */
+    for (y=0; y<layer->height; y++)
+        for (x=0; x<layer->width; x++)
+            total += (*(*(layer->minicolumns+y)+x))->num_synapses;
+
+    free(st->arena.syns);
+    free(st->syn_offsets);
+    st->syn_offsets = NULL;
+    st->arena.num_synapses = total;
+    st->arena.syns = malloc(sizeof(struct synapse)*(total+1));
+    if (!st->arena.syns) {
+        ERR("No memory for minicolumn synapses\n");
+        return 1;
+    }
+
+    total = 0;
+    for (y=0; y<layer->height; y++) {
+        for (x=0; x<layer->width; x++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            mc->proximal_dendrite_segment = st->arena.syns + total;
+            total += mc->num_synapses;
+        }
+    }
+
+    if (run_l4_phase(st, init_minicolumns)) {
+        ERR("Failed to initialize the minicolumns\n");
+        return 1;
+    }
+
+    return attach_l4_input(layer, input);
+}
+
+/* make input the pattern the layer samples from, once its
+   synapses are in place */
+int32_t
+attach_l4_input (struct layer *layer, repr_t *input)
+{
+    layer->state->input = input;
+
+    free_input_index(layer);
+    if (layer->state->build_input_index &&
+        build_input_index(layer, input)) {
+        ERR("No memory for the input bit index\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+void
+layer4_use_reference (struct layer *layer, char on)
+{
+    struct layer_state *st = layer->state;
+
+    if (on)
+        st->kern = &mc_reference_kernels;
+    else
+        st->kern = st->plugin ? st->plugin_kern : &mc_default_kernels;
+}
+
+/* the minicolumns and their synapses are each one row major
+   block, whether allocated or mapped, so every field is a
+   strided view of its block */
+int32_t
+layer4_state_view (struct layer *layer, state_view_t *view)
+{
+    struct layer_state *st = layer->state;
+    struct minicolumn *mcs = st->mcs;
+    uint64_t i, num_mcs = (uint64_t)layer->height*layer->width;
+    grid_view_t grid;
+
+    if (!mcs || !mcs->proximal_dendrite_segment) {
+        ERR("Layer 4 is not initialized\n");
+        return 1;
+    }
+
+    /* every block ends where the next one starts */
+    if (!st->syn_offsets) {
+        st->syn_offsets = malloc(sizeof(uint64_t)*(num_mcs+1));
+        if (!st->syn_offsets) {
+            ERR("No memory for the synapse offsets\n");
+            return 1;
+        }
+        st->syn_offsets[0] = 0;
+        for (i=0; i<num_mcs; i++)
+            st->syn_offsets[i+1] =
+                st->syn_offsets[i] + mcs[i].num_synapses;
+    }
+
+    grid.stride = sizeof(struct minicolumn);
+    grid.height = layer->height;
+    grid.width = layer->width;
+
+    grid.base = &mcs->overlap;
+    view->overlaps = grid;
+    grid.base = &mcs->raw_overlap;
+    view->raw_overlaps = grid;
+    grid.base = &mcs->boost;
+    view->boosts = grid;
+    view->active = st->active;
+
+    /* the first minicolumn's synapses open the block */
+    view->perms = &mcs->proximal_dendrite_segment->perm;
+    view->perm_stride = sizeof(struct synapse);
+    view->syn_offsets = st->syn_offsets;
+    view->num_synapses = st->syn_offsets[num_mcs];
+
+    return 0;
+}
+
+/* invert the proximal synapses into a per input bit list.
+   counting first lets every list live in one array. */
+static int32_t
+build_input_index (struct layer *layer, repr_t *input)
+{
+    struct input_index *idx = &layer->state->index;
+    struct minicolumn *mc = NULL;
+    struct synapse *synptr = NULL;
+    uint32_t *cursor = NULL;
+    uint32_t x, y, s, b, nbits;
+
+    idx->input = input;
+    idx->words = REPR_WORDS(input);
+    /* the index is over bit offsets, row padding included. the
+       padding is never set, it just gets empty lists */
+    nbits = idx->words * SZ;
+    idx->max_changed =
+        layer->state->delta_overlap_max * input->rows * input->cols;
+
+    idx->offsets = calloc(nbits+1, sizeof(uint32_t));
+    cursor = calloc(nbits, sizeof(uint32_t));
+    idx->prev = calloc(idx->words, sizeof(uint32_t));
+    if (!idx->offsets || !cursor || !idx->prev)
+        goto fail_ret;
+
+    for (y=0; y<layer->height; y++) {
+        for (x=0; x<layer->width; x++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            synptr = mc->proximal_dendrite_segment;
+            for (s=0; s<mc->num_synapses; s++, synptr++)
+                idx->offsets[
+                    BIT_OFFSET(input, synptr->srcy, synptr->srcx)+1]++;
+        }
+    }
+    for (b=0; b<nbits; b++) {
+        idx->offsets[b+1] += idx->offsets[b];
+        cursor[b] = idx->offsets[b];
+    }
+
+    idx->refs = malloc(
+        sizeof(struct synapse_ref) * (idx->offsets[nbits]+1));
+    if (!idx->refs)
+        goto fail_ret;
+
+    for (y=0; y<layer->height; y++) {
+        for (x=0; x<layer->width; x++) {
+            mc = *(*(layer->minicolumns+y)+x);
+            synptr = mc->proximal_dendrite_segment;
+            for (s=0; s<mc->num_synapses; s++, synptr++) {
+                b = BIT_OFFSET(input, synptr->srcy, synptr->srcx);
+                idx->refs[cursor[b]].mc = mc;
+                idx->refs[cursor[b]].syn = synptr;
+                cursor[b]++;
             }
-            /* initialize active bitmask */
-            (*(*(layer4->minicolumns+y)+x))->active_mask = 0;
-            /* set the initial boost value */
-            (*(*(layer4->minicolumns+y)+x))->boost = 1.0;
         }
     }
 
+    free(cursor);
+    /* the first step always computes overlaps in full */
+    idx->valid = 0;
+
     return 0;
+
+    fail_ret:
+        free(cursor);
+        free_input_index(layer);
+        return 1;
+}
+
+static void
+free_input_index (struct layer *layer)
+{
+    struct input_index *idx = &layer->state->index;
+
+    free(idx->offsets);
+    free(idx->refs);
+    free(idx->prev);
+    memset(idx, 0, sizeof(struct input_index));
 }
 
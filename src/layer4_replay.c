@@ -0,0 +1,217 @@
+/* sysconf is POSIX, not C99 */
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "layer.h"
+#include "utils.h"
+
+/* Replaying recorded inputs against a frozen model has no step
+   depending on the one before it, so the steps are spread over
+   the workers rather than the rows of each step. A worker scores
+   its steps in blocks with the batch kernels, over scratch of its
+   own, and only reads the model. */
+
+struct replay_worker
+{
+    struct thread_data td;
+    struct l4_batch bt;
+    repr_t **inputs;
+    /* steps first up to but not including last */
+    uint32_t first, last;
+    /* winners of each of the worker's steps, and all of them in
+       order */
+    uint64_t *counts;
+    uint32_t *cols;
+    uint64_t num_cols, cap_cols;
+    char failed;
+};
+
+static int32_t
+push_col (struct replay_worker *w, uint32_t col)
+{
+    uint32_t *ncols = NULL;
+
+    if (w->num_cols == w->cap_cols) {
+        w->cap_cols = w->cap_cols ? w->cap_cols*2 : 1024;
+        ncols = realloc(w->cols, sizeof(uint32_t)*w->cap_cols);
+        if (!ncols)
+            return 1;
+        w->cols = ncols;
+    }
+    w->cols[w->num_cols++] = col;
+
+    return 0;
+}
+
+static void*
+replay_steps (void *arg)
+{
+    struct replay_worker *w = (struct replay_worker *)arg;
+    struct l4_batch *bt = &w->bt;
+    uint64_t num_mcs = (uint64_t)w->td.row_num*w->td.row_width;
+    uint64_t i;
+    uint32_t s, b;
+
+    for (s=w->first; s<w->last; s+=L4_BATCH) {
+        bt->inputs = w->inputs + s;
+        bt->n = w->last-s < L4_BATCH ? w->last-s : L4_BATCH;
+        memset(bt->active, 0, num_mcs*L4_BATCH);
+        l4_block_overlaps(&w->td);
+        l4_block_inhibition(&w->td);
+
+        for (b=0; b<bt->n; b++) {
+            for (i=0; i<num_mcs; i++) {
+                if (!bt->active[i*L4_BATCH+b])
+                    continue;
+                if (push_col(w, i)) {
+                    w->failed = 1;
+                    pthread_exit(NULL);
+                }
+                w->counts[s-w->first+b]++;
+            }
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+static uint32_t
+num_workers (uint32_t blocks)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if (cpus < 1)
+        cpus = 1;
+
+    return (uint32_t)cpus < blocks ? (uint32_t)cpus : blocks;
+}
+
+active_columns_t*
+layer4_replay (struct layer *layer, repr_t **inputs, uint32_t n)
+{
+    struct layer_state *st = layer->state;
+    struct replay_worker *workers = NULL, *w = NULL;
+    pthread_t *threads = NULL;
+    active_columns_t *ac = NULL;
+    uint64_t num_mcs = (uint64_t)layer->height*layer->width;
+    uint64_t total = 0;
+    uint32_t blocks, nw, started = 0, k, s;
+    int rc;
+
+    if (l4_batch_inputs(layer, inputs, n))
+        return NULL;
+
+    blocks = (n + L4_BATCH-1) / L4_BATCH;
+    nw = num_workers(blocks ? blocks : 1);
+    workers = calloc(nw, sizeof(struct replay_worker));
+    threads = calloc(nw, sizeof(pthread_t));
+    if (!workers || !threads)
+        goto fail_ret;
+
+    for (k=0; k<nw; k++) {
+        w = workers + k;
+        /* one worker over every row */
+        w->td = st->td[0];
+        w->td.row_start = 0;
+        w->td.row_num = layer->height;
+        w->td.row_width = layer->width;
+        w->td.batch = &w->bt;
+        w->inputs = inputs;
+        /* whole blocks per worker */
+        w->first = (uint64_t)blocks*k/nw * L4_BATCH;
+        w->last = (uint64_t)blocks*(k+1)/nw * L4_BATCH;
+        if (w->last > n)
+            w->last = n;
+        if (w->first > w->last)
+            w->first = w->last;
+        w->counts = calloc(w->last-w->first+1, sizeof(uint64_t));
+        w->bt.overlaps = malloc(sizeof(uint32_t)*num_mcs*L4_BATCH);
+        w->bt.active = malloc(num_mcs*L4_BATCH);
+        if (!w->counts || !w->bt.overlaps || !w->bt.active) {
+            ERR("No memory for replay worker %u\n", k);
+            goto fail_ret;
+        }
+    }
+
+    /* the workers are not the layer's threads, and are left to
+       float over every core rather than take its pinning */
+    for (k=0; k<nw; k++, started++) {
+        rc = pthread_create(&threads[k], NULL, replay_steps,
+            (void *)&workers[k]);
+        if (rc != 0) {
+            ERR("Replay thread %u creation failed: %d\n", k, rc);
+            goto fail_ret;
+        }
+    }
+    for (k=0; k<nw; k++) {
+        rc = pthread_join(threads[k], NULL);
+        if (rc != 0)
+            ERR("Replay thread %u join failed: %d\n", k, rc);
+    }
+    started = 0;
+    for (k=0; k<nw; k++) {
+        if (workers[k].failed) {
+            ERR("Replay worker %u ran out of memory\n", k);
+            goto fail_ret;
+        }
+        total += workers[k].num_cols;
+    }
+
+    /* the workers' steps follow each other, so their lists are
+       concatenated in worker order */
+    ac = calloc(1, sizeof(active_columns_t));
+    if (!ac)
+        goto fail_ret;
+    ac->steps = n;
+    ac->offsets = malloc(sizeof(uint64_t)*(n+1));
+    ac->columns = malloc(sizeof(uint32_t)*(total+1));
+    if (!ac->offsets || !ac->columns)
+        goto fail_ret;
+    ac->offsets[0] = 0;
+    total = 0;
+    for (k=0; k<nw; k++) {
+        w = workers + k;
+        memcpy(ac->columns + total, w->cols,
+            sizeof(uint32_t)*w->num_cols);
+        total += w->num_cols;
+        for (s=w->first; s<w->last; s++)
+            ac->offsets[s+1] = ac->offsets[s] + w->counts[s-w->first];
+    }
+
+    for (k=0; k<nw; k++) {
+        free(workers[k].counts);
+        free(workers[k].cols);
+        free(workers[k].bt.overlaps);
+        free(workers[k].bt.active);
+    }
+    free(workers);
+    free(threads);
+
+    return ac;
+
+    fail_ret:
+        for (k=0; k<started; k++)
+            pthread_join(threads[k], NULL);
+        for (k=0; workers && k<nw; k++) {
+            free(workers[k].counts);
+            free(workers[k].cols);
+            free(workers[k].bt.overlaps);
+            free(workers[k].bt.active);
+        }
+        free(workers);
+        free(threads);
+        if (ac) {
+            free(ac->offsets);
+            free(ac->columns);
+            free(ac);
+        }
+        return NULL;
+}
@@ -0,0 +1,248 @@
+/* clock_gettime, localtime_r and nanosleep are POSIX, not C99 */
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "htm.h"
+#include "logger.h"
+
+#define LOAD_ACQ(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RLX(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_REL(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/* the coarse clocks are read from the vdso without a syscall,
+   and their few milliseconds of resolution do for logs */
+#ifdef CLOCK_REALTIME_COARSE
+# define LOG_CLOCK CLOCK_REALTIME_COARSE
+#else
+# define LOG_CLOCK CLOCK_REALTIME
+#endif
+
+/* how long the drainer sleeps when every ring is empty */
+#define LOG_DRAIN_NS 1000000
+
+/* the log goes to one stream for the whole process, so unlike
+   the rest of the library its state is not per context */
+static struct
+{
+    /* every ring ever claimed, pushed to the front */
+    struct log_ring *rings;
+    pthread_key_t key;
+    pthread_mutex_t lock;
+    pthread_t drainer;
+    FILE *out;
+    char key_made;
+    /* whether messages are queued, and whether the drainer
+       should exit */
+    char on, stop;
+} logger = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static uint64_t
+log_clock (void)
+{
+    struct timespec ts;
+
+    clock_gettime(LOG_CLOCK, &ts);
+
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void
+print_record (FILE *out, const struct log_record *rec)
+{
+    time_t sec = (time_t)(rec->ns / 1000000000ull);
+    struct tm tm;
+    char ts[32];
+
+    localtime_r(&sec, &tm);
+    strftime(ts, sizeof(ts), "%a %b %d %H:%M:%S", &tm);
+    fprintf(out, "%s.%03u %d [%s - %s:%s:%d]  %s", ts,
+        (unsigned)(rec->ns / 1000000ull % 1000),
+        tm.tm_year + 1900, rec->level, rec->file, rec->func,
+        rec->line, rec->msg);
+}
+
+/* the thread is gone, its ring goes to the next one that logs */
+static void
+release_ring (void *arg)
+{
+    struct log_ring *ring = (struct log_ring *)arg;
+
+    STORE_REL(&ring->owned, 0);
+}
+
+static struct log_ring*
+claim_ring (void)
+{
+    struct log_ring *ring = NULL;
+    char expected;
+
+    for (ring=LOAD_ACQ(&logger.rings); ring; ring=ring->next) {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&ring->owned, &expected, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (!ring) {
+        if (!(ring = calloc(1, sizeof(struct log_ring))))
+            return NULL;
+        ring->owned = 1;
+        ring->next = LOAD_RLX(&logger.rings);
+        while (!__atomic_compare_exchange_n(&logger.rings, &ring->next,
+                ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    if (pthread_setspecific(logger.key, ring)) {
+        release_ring(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+/* queue a message on the calling thread's ring. returns 1 when
+   the thread has no ring, so the message is printed instead. */
+static int32_t
+queue_msg (const char *level, const char *file, const char *func,
+    int line, const char *fmt, va_list ap)
+{
+    struct log_ring *ring = pthread_getspecific(logger.key);
+    struct log_record *rec = NULL;
+    uint32_t head;
+
+    if (!ring && !(ring = claim_ring()))
+        return 1;
+
+    head = ring->head;
+    if (head - LOAD_ACQ(&ring->tail) == LOG_RING_SZ) {
+        __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+
+    rec = &ring->records[head & (LOG_RING_SZ-1)];
+    rec->ns = log_clock();
+    rec->level = level;
+    rec->file = file;
+    rec->func = func;
+    rec->line = line;
+    vsnprintf(rec->msg, LOG_MSG_SZ, fmt, ap);
+    STORE_REL(&ring->head, head+1);
+
+    return 0;
+}
+
+void
+log_msg (const char *level, const char *file, const char *func,
+    int line, const char *fmt, ...)
+{
+    struct log_record rec;
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (LOAD_ACQ(&logger.on) &&
+        !queue_msg(level, file, func, line, fmt, ap)) {
+        va_end(ap);
+        return;
+    }
+    va_end(ap);
+
+    rec.ns = log_clock();
+    rec.level = level;
+    rec.file = file;
+    rec.func = func;
+    rec.line = line;
+    va_start(ap, fmt);
+    vsnprintf(rec.msg, LOG_MSG_SZ, fmt, ap);
+    va_end(ap);
+    print_record(stdout, &rec);
+}
+
+/* print what every ring holds. returns how many were printed. */
+static uint64_t
+drain_rings (FILE *out)
+{
+    struct log_ring *ring = NULL;
+    uint64_t printed = 0, dropped;
+    uint32_t tail, head;
+
+    for (ring=LOAD_ACQ(&logger.rings); ring; ring=ring->next) {
+        tail = ring->tail;
+        head = LOAD_ACQ(&ring->head);
+        for (; tail != head; tail++, printed++)
+            print_record(out, &ring->records[tail & (LOG_RING_SZ-1)]);
+        STORE_REL(&ring->tail, tail);
+
+        dropped = __atomic_exchange_n(&ring->dropped, 0,
+            __ATOMIC_RELAXED);
+        if (dropped)
+            fprintf(out, "[WARN - %s]  %lu log messages dropped\n",
+                __func__, (unsigned long)dropped);
+    }
+    if (printed)
+        fflush(out);
+
+    return printed;
+}
+
+static void*
+drain_log (void *arg)
+{
+    struct timespec nap = { 0, LOG_DRAIN_NS };
+
+    (void)arg;
+    while (!LOAD_ACQ(&logger.stop))
+        if (!drain_rings(logger.out))
+            nanosleep(&nap, NULL);
+    drain_rings(logger.out);
+
+    return NULL;
+}
+
+int32_t
+htm_start_async_log (FILE *out)
+{
+    int rc;
+
+    pthread_mutex_lock(&logger.lock);
+    if (logger.on) {
+        pthread_mutex_unlock(&logger.lock);
+        return 0;
+    }
+    if (!logger.key_made) {
+        if (pthread_key_create(&logger.key, release_ring)) {
+            pthread_mutex_unlock(&logger.lock);
+            return 1;
+        }
+        logger.key_made = 1;
+    }
+
+    logger.out = out ? out : stdout;
+    STORE_REL(&logger.stop, 0);
+    rc = pthread_create(&logger.drainer, NULL, drain_log, NULL);
+    if (rc == 0)
+        STORE_REL(&logger.on, 1);
+    pthread_mutex_unlock(&logger.lock);
+
+    return rc != 0;
+}
+
+void
+htm_stop_async_log (void)
+{
+    pthread_mutex_lock(&logger.lock);
+    if (logger.on) {
+        STORE_REL(&logger.on, 0);
+        STORE_REL(&logger.stop, 1);
+        pthread_join(logger.drainer, NULL);
+    }
+    pthread_mutex_unlock(&logger.lock);
+}
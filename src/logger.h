@@ -0,0 +1,45 @@
+/* Interface for the log output behind the LOG macros. A message
+is printed as it is logged, or, while the asynchronous logger
+runs, queued on a ring owned by the logging thread and printed
+by a background thread. */
+#ifndef LOGGER_H_
+#define LOGGER_H_ 1
+
+#include <stdint.h>
+
+/* records per thread ring. must be a power of two. */
+#define LOG_RING_SZ 256
+/* longest message kept, the rest is cut off */
+#define LOG_MSG_SZ 224
+
+struct log_record
+{
+    /* wall clock time in nanoseconds, from a coarse clock */
+    uint64_t ns;
+    const char *level, *file, *func;
+    int line;
+    char msg[LOG_MSG_SZ];
+};
+
+/* single producer, single consumer ring of one thread. a ring
+   outlives its thread and is handed to the next thread that
+   logs, so threads created per phase do not pile up rings. */
+struct log_ring
+{
+    struct log_record records[LOG_RING_SZ];
+    /* free running counters, the record is the counter modulo
+       the ring size. the owner advances head, the drainer
+       tail. */
+    uint32_t head, tail;
+    /* messages lost to a full ring since the last drain */
+    uint64_t dropped;
+    char owned;
+    struct log_ring *next;
+};
+
+void
+log_msg (const char *level, const char *file, const char *func,
+    int line, const char *fmt, ...)
+    __attribute__((format(printf, 5, 6)));
+
+#endif
@@ -1,46 +1,31 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+# include <immintrin.h>
+#endif
 #include "htm.h"
 #include "minicolumn.h"
 #include "synapse.h"
+#include "cpu.h"
 
 /* import interface for input pattern representations from encoders*/
 #include "repr.h"
 
 #include "utils.h"
 
-int alloc_minicolumn_synapses(
-    struct minicolumn *minicolumn
-) {
-    struct synapse *syns=NULL;
-
-    syns = (struct synapse *)calloc(
-        minicolumn->num_synapses,
-        sizeof(struct synapse));
-    if (!syns)
-        return 1;
-
-    minicolumn->proximal_dendrite_segment = syns;
-
-    return 0;
-}
-
 void inline __attribute__((always_inline))
 inc_perm_vectors (float *permv)
 {
 }
 
-void check_minicolumn_activation(
+char check_minicolumn_activation(
     struct minicolumn *mc,
     float local_activity)
 {
     struct minicolumn **nptr = NULL;
     unsigned int num_higher = 0, num_active = 0;
     unsigned int max_active, num_mcs;
-    struct synapse *synptr = NULL;
-    uint32_t s;
-    /*v4sf */
 
     /* if the overlap didn't meet the minicolumn overlap
     complexity even after boosting, then the minicolumn
@@ -48,7 +33,7 @@ void check_minicolumn_activation(
     if (mc->overlap == 0) {
         DEBUG("Overlap does not satisfy minicolumn complexity\n");
         mc->active_mask <<= 1;
-        return;
+        return 0;
     }
 
     /* count number of neighboring minicolumns with more
@@ -69,12 +54,7 @@ void check_minicolumn_activation(
     num_mcs = 
         (((uintptr_t)nptr-(uintptr_t)(mc->neighbors)) /
         sizeof(struct minicolumn *) + 1);
-    max_active = num_mcs * local_activity;
-    /* NOTE: requiring a minimum of 1 active minicolumn
-    causes local_activity to not be exactly honored,
-    because 1 minicolumn can be > local_activity for
-    small enough receptive fields. */
-    if (max_active < 1) max_active = 1;
+    max_active = mc_max_active(num_mcs, local_activity);
     DEBUG("Max number of active minicolumns in radius: %u/%u\n", max_active, num_mcs);
     /* bitmask has been pre-shifted, so now just set the
     minicolumn activity and SP processed flag bits */
@@ -82,26 +62,38 @@ void check_minicolumn_activation(
         DEBUG("Minicolumn activating, overlap: %u/%u, activity: %u/%u\n",
             num_higher, max_active, num_active, max_active);
         MC_MARK_ACTIVE(mc);
-        /* modify synaptic permanence */
-        synptr = mc->proximal_dendrite_segment;
-        for (s=0; s<mc->num_synapses; s++) {
-            if (TEST_REPR_BIT_FAST(synptr->source, synptr->srcy, synptr->srcx))
-                synptr->perm += PERM_INC;
-            else
-                synptr->perm -= PERM_DEC;
-            synptr++;
-        }
     } else {
         DEBUG("minicolumn NOT active, Num active %u/%u, neighbor overlaps %u/%u\n",
             num_active, max_active, num_higher, max_active);
         MC_MARK_INACTIVE(mc);
+        return 0;
     }
+
+    return 1;
 }
 
-void free_dendrite(struct synapse *dendrite)
+void
+learn_minicolumn (struct minicolumn *mc, repr_t *input)
 {
-    if (dendrite)
-        free(dendrite);
+    struct synapse *synptr = mc->proximal_dendrite_segment;
+    uint32_t s;
+    float perm;
+    /*v4sf */
+
+    /* modify synaptic permanence */
+    for (s=0; s<mc->num_synapses; s++) {
+        if (TEST_REPR_BIT_FAST(input, synptr->srcy, synptr->srcx)) {
+            perm = synptr->perm;
+            synptr->perm += PERM_INC;
+            /* a synapse connecting on an active bit keeps the
+               raw overlap exact for the next input delta */
+            mc->raw_overlap +=
+                perm < CONNECTED_PERM &&
+                synptr->perm >= CONNECTED_PERM;
+        } else
+            synptr->perm -= PERM_DEC;
+        synptr++;
+    }
 }
 
 /* GNU SIMD vector extensions */
@@ -135,6 +127,184 @@ compute_minicolumn_inhib_rad (struct minicolumn *mc)
     return (uint32_t)(avgdist/scnt);
 }
 
+uint32_t
+minicolumn_overlap (struct minicolumn *mc, repr_t *input)
+{
+    struct synapse *synptr = mc->proximal_dendrite_segment;
+    uint32_t s, raw = 0;
+
+    for (s=0; s<mc->num_synapses; s++) {
+        if (synptr->perm >= CONNECTED_PERM &&
+            TEST_REPR_BIT_FAST(input, synptr->srcy, synptr->srcx))
+            raw++;
+        synptr++;
+    }
+
+    return raw;
+}
+
+const struct mc_kernels mc_reference_kernels =
+{
+    "reference",
+    minicolumn_overlap,
+    check_minicolumn_activation,
+    compute_minicolumn_inhib_rad,
+    learn_minicolumn
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+
+/* ints between consecutive synapses, for gathering a field of
+   eight of them */
+#define SYN_INTS (sizeof(struct synapse)/sizeof(int))
+
+/* the permanence tests below are made on floats. CONNECTED_PERM
+   rounds up to (float)CONNECTED_PERM, so a float is at least the
+   one exactly when it is at least the other, and the tests agree
+   with the double tests of the scalar kernels. */
+
+/* eight synapses at a time. the source bits are gathered from
+   the input words the scalar kernel tests one by one. */
+static TARGET_AVX2 uint32_t
+minicolumn_overlap_avx2 (struct minicolumn *mc, repr_t *input)
+{
+    const int *syn = (const int *)mc->proximal_dendrite_segment;
+    const __m256i lanes = _mm256_setr_epi32(
+        0, SYN_INTS, 2*SYN_INTS, 3*SYN_INTS,
+        4*SYN_INTS, 5*SYN_INTS, 6*SYN_INTS, 7*SYN_INTS);
+    const __m256i stride = _mm256_set1_epi32(input->stride);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256i low = _mm256_set1_epi32(SZ-1);
+    const __m256 conn = _mm256_set1_ps((float)CONNECTED_PERM);
+    __m256i acc = _mm256_setzero_si256(), x, y, w, bit;
+    __m256 perm;
+    __m128i sum;
+    struct synapse *synptr = NULL;
+    uint32_t s, raw;
+
+    for (s=0; s+8<=mc->num_synapses; s+=8, syn+=8*SYN_INTS) {
+        perm = _mm256_i32gather_ps((const float *)syn, lanes, 4);
+        x = _mm256_i32gather_epi32(syn+1, lanes, 4);
+        y = _mm256_i32gather_epi32(syn+2, lanes, 4);
+        /* BIT_IDX and BIT_POS */
+        w = _mm256_add_epi32(_mm256_mullo_epi32(y, stride),
+            _mm256_srli_epi32(x, 5));
+        w = _mm256_i32gather_epi32((const int *)input->repr, w, 4);
+        bit = _mm256_and_si256(
+            _mm256_srlv_epi32(w, _mm256_and_si256(x, low)), one);
+        bit = _mm256_and_si256(bit, _mm256_castps_si256(
+            _mm256_cmp_ps(perm, conn, _CMP_GE_OQ)));
+        acc = _mm256_add_epi32(acc, bit);
+    }
+    sum = _mm_add_epi32(_mm256_castsi256_si128(acc),
+        _mm256_extracti128_si256(acc, 1));
+    sum = _mm_hadd_epi32(sum, sum);
+    raw = (uint32_t)_mm_cvtsi128_si32(_mm_hadd_epi32(sum, sum));
+
+    synptr = mc->proximal_dendrite_segment + s;
+    for (; s<mc->num_synapses; s++, synptr++)
+        if (synptr->perm >= CONNECTED_PERM &&
+            TEST_REPR_BIT_FAST(input, synptr->srcy, synptr->srcx))
+            raw++;
+
+    return raw;
+}
+
+/* the permanences are moved in doubles and rounded back, as the
+   scalar kernel's float += double does, so they match it to the
+   bit. AVX2 has no scatter, so they are stored one by one. */
+static TARGET_AVX2 void
+learn_minicolumn_avx2 (struct minicolumn *mc, repr_t *input)
+{
+    struct synapse *synptr = mc->proximal_dendrite_segment;
+    const int *syn = (const int *)synptr;
+    const __m256i lanes = _mm256_setr_epi32(
+        0, SYN_INTS, 2*SYN_INTS, 3*SYN_INTS,
+        4*SYN_INTS, 5*SYN_INTS, 6*SYN_INTS, 7*SYN_INTS);
+    const __m256i stride = _mm256_set1_epi32(input->stride);
+    const __m256i low = _mm256_set1_epi32(SZ-1);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256d inc = _mm256_set1_pd(PERM_INC);
+    const __m256d dec = _mm256_set1_pd(-PERM_DEC);
+    const __m256 conn = _mm256_set1_ps((float)CONNECTED_PERM);
+    __m256i x, y, w, on;
+    __m256 old, perm;
+    __m256d lo, hi;
+    float out[8], prev;
+    uint32_t s, i, crossed;
+
+    for (s=0; s+8<=mc->num_synapses; s+=8, syn+=8*SYN_INTS) {
+        old = _mm256_i32gather_ps((const float *)syn, lanes, 4);
+        x = _mm256_i32gather_epi32(syn+1, lanes, 4);
+        y = _mm256_i32gather_epi32(syn+2, lanes, 4);
+        w = _mm256_add_epi32(_mm256_mullo_epi32(y, stride),
+            _mm256_srli_epi32(x, 5));
+        w = _mm256_i32gather_epi32((const int *)input->repr, w, 4);
+        /* all ones in the lanes on active bits */
+        on = _mm256_cmpeq_epi32(_mm256_and_si256(
+            _mm256_srlv_epi32(w, _mm256_and_si256(x, low)), one), one);
+
+        lo = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(old)),
+            _mm256_blendv_pd(dec, inc, _mm256_castsi256_pd(
+                _mm256_cvtepi32_epi64(_mm256_castsi256_si128(on)))));
+        hi = _mm256_add_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(old, 1)),
+            _mm256_blendv_pd(dec, inc, _mm256_castsi256_pd(
+                _mm256_cvtepi32_epi64(_mm256_extracti128_si256(on, 1)))));
+        perm = _mm256_set_m128(_mm256_cvtpd_ps(hi), _mm256_cvtpd_ps(lo));
+
+        /* connected by this step, on an active bit */
+        crossed = _mm256_movemask_ps(_mm256_and_ps(
+            _mm256_castsi256_ps(on),
+            _mm256_andnot_ps(_mm256_cmp_ps(old, conn, _CMP_GE_OQ),
+                _mm256_cmp_ps(perm, conn, _CMP_GE_OQ))));
+        mc->raw_overlap += __builtin_popcount(crossed);
+
+        _mm256_storeu_ps(out, perm);
+        for (i=0; i<8; i++)
+            synptr[s+i].perm = out[i];
+    }
+
+    synptr += s;
+    for (; s<mc->num_synapses; s++, synptr++) {
+        if (TEST_REPR_BIT_FAST(input, synptr->srcy, synptr->srcx)) {
+            prev = synptr->perm;
+            synptr->perm += PERM_INC;
+            mc->raw_overlap +=
+                prev < CONNECTED_PERM && synptr->perm >= CONNECTED_PERM;
+        } else
+            synptr->perm -= PERM_DEC;
+    }
+}
+
+#endif
+
+struct mc_kernels mc_default_kernels =
+{
+    "default",
+    minicolumn_overlap,
+    check_minicolumn_activation,
+    compute_minicolumn_inhib_rad,
+    learn_minicolumn
+};
+
+void
+bind_mc_kernels (enum cpu_level level)
+{
+    mc_default_kernels = mc_reference_kernels;
+    mc_default_kernels.name = "default";
+#if defined(__x86_64__) || defined(__i386__)
+    /* nothing wider pays off on gathers, AVX-512 runs these too.
+       activation stays scalar: its loads chase neighbor pointers,
+       and gathering them measured slower than the plain loop. */
+    if (level >= CPU_AVX2) {
+        mc_default_kernels.overlap = minicolumn_overlap_avx2;
+        mc_default_kernels.learn = learn_minicolumn_avx2;
+    }
+#endif
+}
+
 unsigned char
 mc_active_at (struct minicolumn *mc, uint32_t t)
 {
@@ -1,16 +1,51 @@
 #ifndef MINICOLUMN_H_
 #define MINICOLUMN_H_ 1
 
-int32_t
-alloc_minicolumn_synapses (struct minicolumn *minicolumn);
-void
+/* returns 1 when the minicolumn won against its neighbors */
+char
 check_minicolumn_activation(
     struct minicolumn *mc,
     float local_activity);
+/* adapt the permanences of an active minicolumn to input */
+void
+learn_minicolumn (struct minicolumn *mc, repr_t *input);
 uint32_t
 compute_minicolumn_inhib_rad (struct minicolumn *mc);
-void
-free_dendrite (struct synapse *dendrite);
+/* connected synapses of mc on active bits of input */
+uint32_t
+minicolumn_overlap (struct minicolumn *mc, repr_t *input);
+
+/* the per minicolumn kernels of the spatial pooler. a layer
+   calls them through one of these tables. */
+struct mc_kernels
+{
+    const char *name;
+    uint32_t (*overlap)(struct minicolumn *mc, repr_t *input);
+    char (*activation)(struct minicolumn *mc, float local_activity);
+    uint32_t (*inhib_rad)(struct minicolumn *mc);
+    void (*learn)(struct minicolumn *mc, repr_t *input);
+};
+
+/* the plain scalar loops above. every other kernel must give
+   the same overlaps, winners and permanences, bit for bit. */
+extern const struct mc_kernels mc_reference_kernels;
+/* what layers run unless configured for the reference. the
+   fastest kernels the CPU supports, once cpu_dispatch has run. */
+extern struct mc_kernels mc_default_kernels;
+
+/* the most minicolumns that may be active in a neighborhood of
+   num_mcs, itself included */
+static inline unsigned int
+mc_max_active (unsigned int num_mcs, float local_activity)
+{
+    unsigned int max_active = num_mcs * local_activity;
+
+    /* NOTE: requiring a minimum of 1 active minicolumn
+    causes local_activity to not be exactly honored,
+    because 1 minicolumn can be > local_activity for
+    small enough receptive fields. */
+    return max_active < 1 ? 1 : max_active;
+}
 
 #endif
 
@@ -39,7 +39,13 @@ xml_el htm_conf_attrs[] =
     },
 */
     HTMCONF_NODE(target, STRING, 1),
-    HTMCONF_NODE(allow_boosting, BOOLEAN, 0)
+    HTMCONF_NODE(allow_boosting, BOOLEAN, 0),
+    HTMCONF_NODE(pipelined, BOOLEAN, 0),
+    HTMCONF_NODE(shared_model, BOOLEAN, 0),
+    HTMCONF_NODE(snapshots, BOOLEAN, 0),
+    HTMCONF_NODE(kernels, STRING, 0),
+    HTMCONF_NODE(threads, ULONG, 0),
+    HTMCONF_NODE(affinity, STRING, 0)
 };
 
 xml_el layer6_conf_attrs[] =
@@ -63,7 +69,12 @@ xml_el columns_conf_attrs[] =
     COLCONF_NODE(local_activity, FLOAT, 1),
     COLCONF_NODE(column_complexity, FLOAT, 1),
     COLCONF_NODE(high_tier, BOOLEAN, 1),
-    COLCONF_NODE(activity_cycle_window, ULONG, 1)
+    COLCONF_NODE(activity_cycle_window, ULONG, 1),
+    COLCONF_NODE(delta_overlap_max, FLOAT, 0),
+    COLCONF_NODE(input_index, BOOLEAN, 0),
+    COLCONF_NODE(potential_pct, FLOAT, 0),
+    COLCONF_NODE(seed, ULONG, 0),
+    COLCONF_NODE(reference, BOOLEAN, 0)
 };
 
 int parse_htm_conf (void)
@@ -224,7 +235,7 @@ set_conf_node_attr (xmlNodePtr node, xml_el attr)
                 *(char *)attr.conf_data = 1;
             break;
         case STRING:
-            attr.conf_data =
+            *(char **)attr.conf_data =
                 strdup((char *)xmlstr);
             break;
         case ULONG:
@@ -0,0 +1,215 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "pipeline.h"
+#include "utils.h"
+
+/* the ring is single producer, single consumer, so the two
+   counters are the only shared state. the producer publishes
+   a slot with a release store of head, and the consumer
+   returns it with a release store of tail. the lock is only
+   taken by a side that finds the ring empty or full and goes
+   to sleep, and by the other side to wake it. */
+#define LOAD_ACQ(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOAD_RLX(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STORE_REL(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define STORE_RLX(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+/* orders a store of a counter before the load of the other
+   side's waiting flag, and the store of a waiting flag before
+   the load of the other side's counter. one of the two sides
+   sees the other's store, so a sleeper is never missed. */
+#define FENCE() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define RING_SLOT(ring, cnt) \
+    (&(ring)->slots[(cnt) & (INPUT_RING_SZ-1)])
+
+/* wake the other side if it sleeps on cond */
+static void
+wake_ring (struct input_ring *ring, uint32_t *waits, pthread_cond_t *cond)
+{
+    FENCE();
+    if (!LOAD_RLX(waits))
+        return;
+    pthread_mutex_lock(&ring->lock);
+    pthread_cond_signal(cond);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/* sleep until the spatial pooler frees a slot. returns 1 when
+   the ring was stopped instead. */
+static char
+wait_drained (struct input_ring *ring, uint32_t head)
+{
+    char stop;
+
+    pthread_mutex_lock(&ring->lock);
+    STORE_RLX(&ring->producer_waits, 1);
+    FENCE();
+    while (!LOAD_RLX(&ring->stop) &&
+           head - LOAD_ACQ(&ring->tail) == INPUT_RING_SZ)
+        pthread_cond_wait(&ring->drained, &ring->lock);
+    STORE_RLX(&ring->producer_waits, 0);
+    stop = LOAD_RLX(&ring->stop) != 0;
+    pthread_mutex_unlock(&ring->lock);
+
+    return stop;
+}
+
+/* sleep until the codec publishes the slot at tail */
+static void
+wait_filled (struct input_ring *ring, uint32_t tail)
+{
+    pthread_mutex_lock(&ring->lock);
+    STORE_RLX(&ring->consumer_waits, 1);
+    FENCE();
+    while (LOAD_ACQ(&ring->head) == tail)
+        pthread_cond_wait(&ring->filled, &ring->lock);
+    STORE_RLX(&ring->consumer_waits, 0);
+    pthread_mutex_unlock(&ring->lock);
+}
+
+static void*
+codec_producer (void *arg)
+{
+    struct input_ring *ring = (struct input_ring *)arg;
+    input_patterns *ip = NULL;
+    struct input_slot *slot = NULL;
+    uint32_t head = LOAD_RLX(&ring->head);
+    uint32_t rows, cols;
+
+    while (!LOAD_ACQ(&ring->stop)) {
+        /* every slot is waiting on the spatial pooler */
+        if (head - LOAD_ACQ(&ring->tail) == INPUT_RING_SZ &&
+            wait_drained(ring, head))
+            break;
+
+        slot = RING_SLOT(ring, head);
+        rows = slot->pattern->rows;
+        cols = slot->pattern->cols;
+
+        ip = ring->cb();
+        if (!ip || !ip->sensory_pattern) {
+            ERR("Codec returned null pattern.\n");
+            slot->failed = 1;
+        } else if (ip->sensory_pattern->rows != rows ||
+                   ip->sensory_pattern->cols != cols) {
+            ERR("Codec pattern (%u, %u) does not match (%u, %u)\n",
+                ip->sensory_pattern->rows,
+                ip->sensory_pattern->cols,
+                rows, cols);
+            slot->failed = 1;
+        } else if (copy_repr(slot->pattern, ip->sensory_pattern)) {
+            /* the codec is free to reuse its pattern on the
+               next call, so it is copied either way */
+            slot->failed = 1;
+        }
+        free(ip); /* nullptr is fine */
+
+        STORE_REL(&ring->head, ++head);
+        wake_ring(ring, &ring->consumer_waits, &ring->filled);
+        if (slot->failed)
+            break;
+    }
+
+    return NULL;
+}
+
+int32_t
+start_input_pipeline (struct input_ring *ring, codec_cb cb, repr_t *live)
+{
+    uint32_t s;
+    int32_t rc;
+
+    if (ring->running)
+        stop_input_pipeline(ring);
+
+    memset(ring, 0, sizeof(struct input_ring));
+    ring->cb = cb;
+    pthread_mutex_init(&ring->lock, NULL);
+    pthread_cond_init(&ring->filled, NULL);
+    pthread_cond_init(&ring->drained, NULL);
+    for (s=0; s<INPUT_RING_SZ; s++) {
+        ring->slots[s].pattern = new_repr(live->rows, live->cols);
+        if (!ring->slots[s].pattern)
+            goto fail_ret;
+    }
+
+    rc = pthread_create(&ring->producer, NULL, codec_producer, ring);
+    if (rc != 0) {
+        ERR("Codec producer thread creation failed: %d\n", rc);
+        goto fail_ret;
+    }
+    ring->running = 1;
+
+    return 0;
+
+    fail_ret:
+        for (s=0; s<INPUT_RING_SZ; s++)
+            if (ring->slots[s].pattern)
+                free_repr(ring->slots[s].pattern);
+        pthread_mutex_destroy(&ring->lock);
+        pthread_cond_destroy(&ring->filled);
+        pthread_cond_destroy(&ring->drained);
+        memset(ring, 0, sizeof(struct input_ring));
+        return 1;
+}
+
+int32_t
+next_pipelined_input (struct input_ring *ring, repr_t *live)
+{
+    struct input_slot *slot = NULL;
+    uint32_t tail;
+
+    if (!ring->running) {
+        ERR("Input pipeline is not running.\n");
+        return 1;
+    }
+
+    /* the codec is behind, this is the only stall */
+    tail = LOAD_RLX(&ring->tail);
+    if (LOAD_ACQ(&ring->head) == tail)
+        wait_filled(ring, tail);
+
+    /* a failed slot stays at the tail, so every later call
+       fails too */
+    slot = RING_SLOT(ring, tail);
+    if (slot->failed)
+        return 1;
+
+    /* synapses point at the live repr_t, so swapping the bit
+       arrays hands the new pattern over without a copy */
+    swap_repr(live, slot->pattern);
+
+    STORE_REL(&ring->tail, tail+1);
+    wake_ring(ring, &ring->producer_waits, &ring->drained);
+
+    return 0;
+}
+
+void
+stop_input_pipeline (struct input_ring *ring)
+{
+    uint32_t s;
+
+    if (!ring->running)
+        return;
+
+    /* wakes a producer waiting on a full ring. one inside the
+       codec finishes that call first. */
+    pthread_mutex_lock(&ring->lock);
+    STORE_REL(&ring->stop, 1);
+    pthread_cond_signal(&ring->drained);
+    pthread_mutex_unlock(&ring->lock);
+    pthread_join(ring->producer, NULL);
+    ring->running = 0;
+
+    for (s=0; s<INPUT_RING_SZ; s++)
+        free_repr(ring->slots[s].pattern);
+    pthread_mutex_destroy(&ring->lock);
+    pthread_cond_destroy(&ring->filled);
+    pthread_cond_destroy(&ring->drained);
+    memset(ring, 0, sizeof(struct input_ring));
+}
@@ -0,0 +1,60 @@
+/* Interface for the pipelined codec input. The codec is
+called on a producer thread that fills a small ring of input
+patterns while the spatial pooler works on the current one. */
+#ifndef PIPELINE_H_
+#define PIPELINE_H_ 1
+
+#include <stdint.h>
+#include <pthread.h>
+
+/* import interface for input pattern representations from encoders*/
+#include "repr.h"
+
+/* number of pattern slots between the codec and the spatial
+   pooler. must be a power of two. */
+#define INPUT_RING_SZ 2
+
+struct input_slot
+{
+    repr_t *pattern;
+    /* set by the producer when the codec failed. no slot is
+       published after a failed one. */
+    char failed;
+};
+
+struct input_ring
+{
+    struct input_slot slots[INPUT_RING_SZ];
+    /* free running counters, the slot is the counter modulo
+       the ring size. handed over with release stores and
+       acquire loads. */
+    uint32_t head, tail;
+    uint32_t stop;
+    /* set while a side sleeps on an empty or full ring, so the
+       other side only takes the lock to wake it */
+    uint32_t consumer_waits, producer_waits;
+    /* only for sleeping. the waiting flags are set under it */
+    pthread_mutex_t lock;
+    /* head moved */
+    pthread_cond_t filled;
+    /* tail moved, or stop was set */
+    pthread_cond_t drained;
+    codec_cb cb;
+    pthread_t producer;
+    char running;
+};
+
+/* spawn the producer thread. every pattern it receives from
+   the codec must have the dimensions of live. */
+int32_t
+start_input_pipeline (struct input_ring *ring, codec_cb cb, repr_t *live);
+
+/* block until the producer published the next pattern, then
+   hand its bits over to live. */
+int32_t
+next_pipelined_input (struct input_ring *ring, repr_t *live);
+
+void
+stop_input_pipeline (struct input_ring *ring);
+
+#endif
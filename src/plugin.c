@@ -0,0 +1,294 @@
+/* dlopen is POSIX, not C99 */
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <dlfcn.h>
+
+#include "htm.h"
+#include "layer.h"
+#include "minicolumn.h"
+#include "synapse.h"
+#include "plugin.h"
+#include "utils.h"
+
+/* the side of the square of a minicolumn away from the edges,
+   as init_l4 places them. 0 when it samples nothing. */
+static uint32_t
+square_side (uint32_t rows, uint32_t cols, float rec_fld_perc)
+{
+    uint32_t sqr = sqrt(cols*rows*rec_fld_perc);
+
+    return sqr/2*2;
+}
+
+/* the statements for one row of the square. the row is fetched
+   SZ bits at a time, every synapse tests a constant bit. */
+static void
+write_row (FILE *f, uint32_t side, const char *stmt)
+{
+    uint32_t c, j, n;
+
+    for (c=0; c<side; c+=SZ) {
+        n = side-c < SZ ? side-c : SZ;
+        fprintf(f, "        b = row_bits(row, x0 + %u, %u);\n", c, n);
+        for (j=0; j<n; j++)
+            fprintf(f, stmt, c+j, j);
+    }
+}
+
+/* the distance of every synapse of the square from its center,
+   computed as compute_minicolumn_inhib_rad does and written
+   exactly, so the sums come out the same */
+static void
+write_distances (FILE *f, uint32_t side)
+{
+    uint32_t i, j, rad = side/2;
+
+    fprintf(f, "static const double dist[SIDE][SIDE] =\n{\n");
+    for (i=0; i<side; i++) {
+        fprintf(f, "    {");
+        for (j=0; j<side; j++)
+            fprintf(f, "%s%a", j ? ", " : "", sqrt(
+                pow(j>rad?j-rad:rad-j, 2) +
+                pow(i>rad?i-rad:rad-i, 2)));
+        fprintf(f, "}%s\n", i+1 < side ? "," : "");
+    }
+    fprintf(f, "};\n\n");
+}
+
+int32_t
+write_l4_kernels (
+    FILE *f,
+    const struct layer4_conf *conf,
+    uint32_t rows,
+    uint32_t cols
+) {
+    float pct = conf->colconf.potential_pct;
+    uint32_t c;
+    uint32_t side = square_side(rows, cols, conf->colconf.rec_field_sz);
+
+    if (rows < 2 || cols < 2) {
+        ERR("Kernels are only generated for 2 dimensional inputs\n");
+        return 1;
+    }
+    if (pct > 0 && pct < 1) {
+        ERR("Sampled receptive fields have no fixed layout, "
+            "potential_pct must be 0\n");
+        return 1;
+    }
+    if (!side) {
+        ERR("The receptive field of %g is empty\n",
+            conf->colconf.rec_field_sz);
+        return 1;
+    }
+
+    fprintf(f,
+        "/* generated by kernelgen for a %ux%u layer 4 over %ux%u "
+        "inputs,\n   rec_field_sz %a. do not edit. */\n"
+        "#include \"htm.h\"\n"
+        "#include \"minicolumn.h\"\n"
+        "#include \"synapse.h\"\n"
+        "#include \"plugin.h\"\n\n"
+        "/* the side of the square of synapses, and ints per input "
+        "row */\n"
+        "#define SIDE %u\n"
+        "#define STRIDE %u\n\n",
+        conf->height, conf->width, rows, cols,
+        conf->colconf.rec_field_sz, side, (unsigned)ROW_STRIDE(cols));
+
+    /* as row_bits_repr, with the stride folded */
+    fprintf(f,
+        "static inline uint32_t\n"
+        "row_bits (const uint32_t *row, uint32_t c, uint32_t n)\n"
+        "{\n"
+        "    const uint32_t *w = row + c/32;\n"
+        "    uint64_t span = ((uint64_t)w[1] << 32 | w[0]) >> c%%32;\n\n"
+        "    return (uint32_t)span & (n < 32 ? (1u << n) - 1 : ~0u);\n"
+        "}\n\n");
+
+    fprintf(f,
+        "struct kernel_plugin htm_kernel_plugin;\n\n"
+        "static uint32_t\n"
+        "overlap_kernel (struct minicolumn *mc, repr_t *input)\n"
+        "{\n"
+        "    const struct synapse *s = mc->proximal_dendrite_segment;\n"
+        "    const uint32_t *row = NULL;\n"
+        "    uint32_t raw = 0, b, i, x0;\n\n"
+        "    if (mc->num_synapses != SIDE*SIDE)\n"
+        "        return htm_kernel_plugin.fallback->overlap(mc, input);\n"
+        "    x0 = s->srcx;\n"
+        "    row = input->repr + s->srcy*STRIDE;\n"
+        "    for (i=0; i<SIDE; i++, row+=STRIDE, s+=SIDE) {\n");
+    write_row(f, side,
+        "        raw += (s[%u].perm >= CONNECTED_PERM) & b >> %u;\n");
+    fprintf(f,
+        "    }\n\n"
+        "    return raw;\n"
+        "}\n\n");
+
+    fprintf(f,
+        "#define LEARN(syn, on) \\\n"
+        "    do { \\\n"
+        "        prev = (syn).perm; \\\n"
+        "        if (on) { \\\n"
+        "            (syn).perm += PERM_INC; \\\n"
+        "            mc->raw_overlap += prev < CONNECTED_PERM && \\\n"
+        "                (syn).perm >= CONNECTED_PERM; \\\n"
+        "        } else \\\n"
+        "            (syn).perm -= PERM_DEC; \\\n"
+        "    } while (0)\n\n"
+        "static void\n"
+        "learn_kernel (struct minicolumn *mc, repr_t *input)\n"
+        "{\n"
+        "    struct synapse *s = mc->proximal_dendrite_segment;\n"
+        "    const uint32_t *row = NULL;\n"
+        "    uint32_t b, i, x0;\n"
+        "    float prev;\n\n"
+        "    if (mc->num_synapses != SIDE*SIDE) {\n"
+        "        htm_kernel_plugin.fallback->learn(mc, input);\n"
+        "        return;\n"
+        "    }\n"
+        "    x0 = s->srcx;\n"
+        "    row = input->repr + s->srcy*STRIDE;\n"
+        "    for (i=0; i<SIDE; i++, row+=STRIDE, s+=SIDE) {\n");
+    write_row(f, side, "        LEARN(s[%u], b >> %u & 1);\n");
+    fprintf(f,
+        "    }\n"
+        "}\n\n");
+
+    write_distances(f, side);
+    fprintf(f,
+        "static uint32_t\n"
+        "inhib_rad_kernel (struct minicolumn *mc)\n"
+        "{\n"
+        "    const struct synapse *s = mc->proximal_dendrite_segment;\n"
+        "    float avgdist = 0;\n"
+        "    uint32_t scnt = 0, i;\n\n"
+        "    if (mc->num_synapses != SIDE*SIDE)\n"
+        "        return htm_kernel_plugin.fallback->inhib_rad(mc);\n"
+        "    for (i=0; i<SIDE; i++, s+=SIDE) {\n");
+    for (c=0; c<side; c++)
+        fprintf(f,
+            "        if (s[%u].perm >= CONNECTED_PERM) {\n"
+            "            scnt++;\n"
+            "            avgdist += dist[i][%u];\n"
+            "        }\n", c, c);
+    fprintf(f,
+        "    }\n\n"
+        "    return (uint32_t)(avgdist/scnt);\n"
+        "}\n\n");
+
+    fprintf(f,
+        "struct kernel_plugin htm_kernel_plugin =\n"
+        "{\n"
+        "    KERNEL_PLUGIN_VERSION,\n"
+        "    sizeof(struct minicolumn), sizeof(struct synapse),\n"
+        "    %u, %u,\n"
+        "    %u, %u,\n"
+        "    %af,\n"
+        "    overlap_kernel,\n"
+        "    learn_kernel,\n"
+        "    inhib_rad_kernel,\n"
+        "    NULL\n"
+        "};\n",
+        conf->height, conf->width, rows, cols,
+        conf->colconf.rec_field_sz);
+
+    return ferror(f) != 0;
+}
+
+/* whether the plugin was generated for this layer */
+static char
+plugin_fits (struct kernel_plugin *kp, struct layer *layer)
+{
+    struct layer_state *st = layer->state;
+    float pct = st->conf.colconf.potential_pct;
+
+    if (kp->version != KERNEL_PLUGIN_VERSION ||
+        kp->mc_size != sizeof(struct minicolumn) ||
+        kp->syn_size != sizeof(struct synapse)) {
+        WARN("Kernel plugin was built against other headers\n");
+        return 0;
+    }
+    if (kp->height != layer->height || kp->width != layer->width ||
+        kp->input_rows != st->input->rows ||
+        kp->input_cols != st->input->cols ||
+        kp->rec_field_sz != st->conf.colconf.rec_field_sz ||
+        (pct > 0 && pct < 1)) {
+        WARN("Kernel plugin is for a %ux%u layer over %ux%u inputs, "
+            "rec_field_sz %g, and potential_pct 0\n",
+            kp->height, kp->width, kp->input_rows, kp->input_cols,
+            kp->rec_field_sz);
+        return 0;
+    }
+
+    return 1;
+}
+
+int32_t
+layer4_load_kernels (struct layer *layer, const char *path)
+{
+    struct layer_state *st = layer->state;
+    struct kernel_plugin *kp = NULL;
+    void *so = NULL;
+    char reference = st->kern == &mc_reference_kernels;
+
+    if (!st->input) {
+        ERR("Layer 4 is not initialized\n");
+        return 1;
+    }
+    if (!(so = dlopen(path, RTLD_NOW | RTLD_LOCAL))) {
+        ERR("Failed to load kernel plugin: %s\n", dlerror());
+        return 1;
+    }
+    if (!(kp = dlsym(so, KERNEL_PLUGIN_SYMBOL))) {
+        ERR("%s is not a kernel plugin\n", path);
+        dlclose(so);
+        return 1;
+    }
+    if (!plugin_fits(kp, layer)) {
+        dlclose(so);
+        return 0;
+    }
+
+    unload_l4_kernels(layer);
+    if (!(st->plugin_kern = malloc(sizeof(struct mc_kernels)))) {
+        ERR("No memory for plugin kernels\n");
+        dlclose(so);
+        return 1;
+    }
+    kp->fallback = &mc_default_kernels;
+    *st->plugin_kern = mc_default_kernels;
+    st->plugin_kern->name = "plugin";
+    if (kp->overlap)
+        st->plugin_kern->overlap = kp->overlap;
+    if (kp->learn)
+        st->plugin_kern->learn = kp->learn;
+    if (kp->inhib_rad)
+        st->plugin_kern->inhib_rad = kp->inhib_rad;
+    st->plugin = so;
+    layer4_use_reference(layer, reference);
+    INFO("Loaded the kernels of %s\n", path);
+
+    return 0;
+}
+
+void
+unload_l4_kernels (struct layer *layer)
+{
+    struct layer_state *st = layer->state;
+
+    if (!st->plugin)
+        return;
+    if (st->kern == st->plugin_kern)
+        st->kern = &mc_default_kernels;
+    dlclose(st->plugin);
+    free(st->plugin_kern);
+    st->plugin = NULL;
+    st->plugin_kern = NULL;
+}
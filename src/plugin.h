@@ -0,0 +1,70 @@
+/* Interface for kernels generated for one layer geometry. With
+potential_pct at 0 every minicolumn away from the edges of the
+input samples a full square of it, in row order, so its synapses
+need no coordinates: the generated kernels fetch the rows of the
+square whole and test each synapse against a constant bit of
+them, and take the distances of the synapses from the center
+from a table. kernelgen writes them out as C for a conf, to be
+built into a shared object that a layer loads when its geometry
+matches:
+
+    HTM_CONF_PATH=htm.conf ./kernelgen -r rows -c cols > kernels.c
+    cc -O2 -march=native -shared -fPIC -Isrc kernels.c -o kernels.so
+
+and kernels="./kernels.so" on the Htm element of the conf. The
+path goes to dlopen as is, so one without a slash is looked up
+in the library path rather than the working directory. */
+#ifndef PLUGIN_H_
+#define PLUGIN_H_ 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "htm.h"
+#include "conf.h"
+
+#define KERNEL_PLUGIN_VERSION 1
+/* what a plugin exports, a struct kernel_plugin */
+#define KERNEL_PLUGIN_SYMBOL "htm_kernel_plugin"
+
+struct mc_kernels;
+
+struct kernel_plugin
+{
+    uint32_t version;
+    /* as compiled into the plugin, to catch one built against
+       other headers */
+    uint32_t mc_size, syn_size;
+    /* the geometry it was generated for */
+    uint32_t height, width;
+    uint32_t input_rows, input_cols;
+    float rec_field_sz;
+    /* NULL leaves the layer's own kernel in place */
+    uint32_t (*overlap)(struct minicolumn *mc, repr_t *input);
+    void (*learn)(struct minicolumn *mc, repr_t *input);
+    uint32_t (*inhib_rad)(struct minicolumn *mc);
+    /* set on load. the kernels hand the minicolumns at the
+       edges, whose squares are cut short, to these. */
+    const struct mc_kernels *fallback;
+};
+
+/* write the C source of kernels for layers of conf over inputs
+   of rows by cols */
+int32_t
+write_l4_kernels (
+    FILE *f,
+    const struct layer4_conf *conf,
+    uint32_t rows,
+    uint32_t cols
+);
+
+/* load the plugin at path into a layer with its input attached.
+   a plugin for another geometry is left out with a warning. path
+   is searched for like dlopen does. */
+int32_t
+layer4_load_kernels (struct layer *layer, const char *path);
+
+void
+unload_l4_kernels (struct layer *layer);
+
+#endif
@@ -0,0 +1,379 @@
+/* mmap, posix_madvise and fstat are POSIX, not C99 */
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "htm.h"
+#include "recording.h"
+#include "utils.h"
+
+int32_t
+open_recorder (struct input_recorder *rec, const char *path)
+{
+    memset(rec, 0, sizeof(struct input_recorder));
+    if (!(rec->f = fopen(path, "wb"))) {
+        ERR("Failed to open recording %s\n", path);
+        return 1;
+    }
+
+    return 0;
+}
+
+static int32_t
+write_header (struct input_recorder *rec, input_patterns *ip)
+{
+    struct rec_header *hdr = &rec->hdr;
+
+    memcpy(hdr->magic, REC_MAGIC, sizeof(hdr->magic));
+    hdr->version = REC_VERSION;
+    hdr->sensory_rows = ip->sensory_pattern->rows;
+    hdr->sensory_cols = ip->sensory_pattern->cols;
+    if (ip->location_pattern) {
+        hdr->location_rows = ip->location_pattern->rows;
+        hdr->location_cols = ip->location_pattern->cols;
+    }
+
+    return fwrite(hdr, sizeof(struct rec_header), 1, rec->f) != 1;
+}
+
+static int32_t
+write_pattern (struct input_recorder *rec, repr_t *rep,
+    uint32_t rows, uint32_t cols)
+{
+    const uint32_t *idx = NULL;
+    uint32_t n, tag, *nidx = NULL;
+
+    if (!rep || rep->rows != rows || rep->cols != cols) {
+        ERR("Pattern does not match the recording's (%u, %u)\n",
+            rows, cols);
+        return 1;
+    }
+
+    if (rep->sparse)
+        n = rep->num_active;
+    else
+        n = popcount_repr(rep);
+
+    /* the bit array is smaller, or all there is */
+    if ((uint64_t)n >= REPR_WORDS(rep) && !rep->sparse) {
+        tag = REPR_WORDS(rep) | REC_DENSE;
+        return fwrite(&tag, sizeof(uint32_t), 1, rec->f) != 1 ||
+            fwrite(rep->repr, sizeof(uint32_t), REPR_WORDS(rep),
+                rec->f) != REPR_WORDS(rep);
+    }
+
+    idx = rep->active;
+    if (!rep->sparse) {
+        if (n > rec->idx_cap) {
+            if (!(nidx = realloc(rec->idx, sizeof(uint32_t)*n)))
+                return 1;
+            rec->idx = nidx;
+            rec->idx_cap = n;
+        }
+        active_bits_repr(rep, rec->idx);
+        idx = rec->idx;
+    }
+
+    tag = n;
+    return fwrite(&tag, sizeof(uint32_t), 1, rec->f) != 1 ||
+        fwrite(idx, sizeof(uint32_t), n, rec->f) != n;
+}
+
+int32_t
+record_patterns (struct input_recorder *rec, input_patterns *ip)
+{
+    if (!rec->steps && write_header(rec, ip)) {
+        ERR("Failed to write the recording header\n");
+        return 1;
+    }
+
+    if (write_pattern(rec, ip->sensory_pattern,
+            rec->hdr.sensory_rows, rec->hdr.sensory_cols) ||
+        (rec->hdr.location_rows &&
+         write_pattern(rec, ip->location_pattern,
+            rec->hdr.location_rows, rec->hdr.location_cols))) {
+        ERR("Failed to record step %lu\n", (unsigned long)rec->steps);
+        return 1;
+    }
+    rec->steps++;
+
+    return 0;
+}
+
+int32_t
+close_recorder (struct input_recorder *rec)
+{
+    int32_t rc = 0;
+
+    if (rec->f && fclose(rec->f)) {
+        ERR("Failed to write the recording\n");
+        rc = 1;
+    }
+    free(rec->idx);
+    memset(rec, 0, sizeof(struct input_recorder));
+
+    return rc;
+}
+
+int32_t
+open_player (struct input_player *pl, const char *path)
+{
+    struct stat sb;
+    void *addr = NULL;
+    int fd;
+
+    memset(pl, 0, sizeof(struct input_player));
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        ERR("Failed to open recording %s\n", path);
+        return 1;
+    }
+    if (fstat(fd, &sb) || (size_t)sb.st_size < sizeof(struct rec_header)) {
+        ERR("Recording %s is too short\n", path);
+        close(fd);
+        return 1;
+    }
+    addr = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        ERR("Failed to map recording %s\n", path);
+        return 1;
+    }
+    /* read once, front to back */
+    posix_madvise(addr, sb.st_size, POSIX_MADV_SEQUENTIAL);
+    pl->base = addr;
+    pl->size = sb.st_size;
+
+    memcpy(&pl->hdr, pl->base, sizeof(struct rec_header));
+    if (memcmp(pl->hdr.magic, REC_MAGIC, sizeof(pl->hdr.magic)) ||
+        pl->hdr.version != REC_VERSION) {
+        ERR("%s is not a recording of this version\n", path);
+        close_player(pl);
+        return 1;
+    }
+    pl->pos = sizeof(struct rec_header);
+
+    pl->ip.sensory_pattern = new_repr(pl->hdr.sensory_rows,
+        pl->hdr.sensory_cols);
+    if (!pl->ip.sensory_pattern) {
+        close_player(pl);
+        return 1;
+    }
+    if (pl->hdr.location_rows) {
+        pl->ip.location_pattern = new_repr(pl->hdr.location_rows,
+            pl->hdr.location_cols);
+        if (!pl->ip.location_pattern) {
+            close_player(pl);
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* the ints at the current position, if n of them are left */
+static const uint32_t*
+take_ints (struct input_player *pl, uint32_t n)
+{
+    const uint32_t *p = (const uint32_t *)(pl->base + pl->pos);
+
+    if (pl->size - pl->pos < (size_t)n*sizeof(uint32_t))
+        return NULL;
+    pl->pos += (size_t)n*sizeof(uint32_t);
+
+    return p;
+}
+
+/* whether a dense payload leaves the padding of every row zero,
+   as the kernels that fetch whole words count on */
+static char
+padding_clear (const repr_t *rep, const uint32_t *payload)
+{
+    uint32_t r, w;
+    uint32_t last = rep->cols/SZ;
+    uint32_t tail = rep->cols%SZ ? ~0u << rep->cols%SZ : ~0u;
+
+    for (r=0; r<rep->rows; r++, payload+=rep->stride) {
+        if (last < rep->stride && payload[last] & tail)
+            return 0;
+        for (w=last+1; w<rep->stride; w++)
+            if (payload[w])
+                return 0;
+    }
+
+    return 1;
+}
+
+static int32_t
+read_pattern (struct input_player *pl, repr_t *rep)
+{
+    const uint32_t *tag = NULL, *payload = NULL;
+    uint32_t n;
+
+    if (!(tag = take_ints(pl, 1)))
+        return 1;
+    n = *tag & ~REC_DENSE;
+
+    if (*tag & REC_DENSE) {
+        if (n != REPR_WORDS(rep) || !(payload = take_ints(pl, n)) ||
+            !padding_clear(rep, payload))
+            return 1;
+        memcpy(rep->repr, payload, sizeof(uint32_t)*n);
+        rep->sparse = 0;
+        return 0;
+    }
+
+    /* set_active_repr checks the indices themselves */
+    if (n > rep->rows*rep->cols || !(payload = take_ints(pl, n)))
+        return 1;
+
+    return set_active_repr(rep, payload, n);
+}
+
+int32_t
+play_patterns (struct input_player *pl)
+{
+    if (pl->pos == pl->size)
+        return 1;
+
+    if (read_pattern(pl, pl->ip.sensory_pattern) ||
+        (pl->ip.location_pattern &&
+         read_pattern(pl, pl->ip.location_pattern))) {
+        ERR("Recording is cut short or corrupt at step %lu\n",
+            (unsigned long)pl->steps);
+        pl->pos = pl->size;
+        return 1;
+    }
+    pl->steps++;
+
+    return 0;
+}
+
+void
+rewind_player (struct input_player *pl)
+{
+    pl->pos = sizeof(struct rec_header);
+    pl->steps = 0;
+}
+
+void
+close_player (struct input_player *pl)
+{
+    if (pl->base)
+        munmap((void *)pl->base, pl->size);
+    if (pl->ip.sensory_pattern)
+        free_repr(pl->ip.sensory_pattern);
+    if (pl->ip.location_pattern)
+        free_repr(pl->ip.location_pattern);
+    memset(pl, 0, sizeof(struct input_player));
+}
+
+/* a codec callback takes no arguments, so the codecs below work
+   on the one recorder and the one player of the process */
+static struct
+{
+    struct input_recorder rec;
+    codec_cb cb;
+} recording;
+
+static struct
+{
+    struct input_player pl;
+    char loop;
+} playback;
+
+int32_t
+htm_start_recording (codec_cb cb, const char *path)
+{
+    if (!cb) {
+        ERR("codec callback is null\n");
+        return 1;
+    }
+    if (recording.cb) {
+        ERR("A recording is already running\n");
+        return 1;
+    }
+    if (open_recorder(&recording.rec, path))
+        return 1;
+    recording.cb = cb;
+
+    return 0;
+}
+
+input_patterns*
+htm_recording_codec (void)
+{
+    input_patterns *ip = NULL;
+
+    if (!recording.cb)
+        return NULL;
+    ip = recording.cb();
+    /* a failed write leaves the htm running, only the
+       recording stops */
+    if (ip && ip->sensory_pattern && recording.rec.f &&
+        record_patterns(&recording.rec, ip)) {
+        close_recorder(&recording.rec);
+    }
+
+    return ip;
+}
+
+int32_t
+htm_stop_recording (void)
+{
+    int32_t rc = close_recorder(&recording.rec);
+
+    recording.cb = NULL;
+
+    return rc;
+}
+
+int32_t
+htm_start_playback (const char *path, char loop)
+{
+    if (playback.pl.base) {
+        ERR("A playback is already running\n");
+        return 1;
+    }
+    if (open_player(&playback.pl, path))
+        return 1;
+    playback.loop = loop;
+
+    return 0;
+}
+
+input_patterns*
+htm_playback_codec (void)
+{
+    input_patterns *ip = NULL;
+
+    if (!playback.pl.base)
+        return NULL;
+    if (play_patterns(&playback.pl)) {
+        if (!playback.loop || !playback.pl.steps)
+            return NULL;
+        rewind_player(&playback.pl);
+        if (play_patterns(&playback.pl))
+            return NULL;
+    }
+
+    /* the htm frees the container, the patterns stay ours */
+    if (!(ip = malloc(sizeof(input_patterns))))
+        return NULL;
+    *ip = playback.pl.ip;
+
+    return ip;
+}
+
+void
+htm_stop_playback (void)
+{
+    close_player(&playback.pl);
+}
@@ -0,0 +1,86 @@
+/* Interface for recording the input patterns a codec returns to
+a file, and for playing them back. A recording is a header and
+one record per step, in host byte order:
+
+    header    magic, version, sensory rows and cols, location
+              rows and cols (0 when the codec has none)
+    record    a pattern for the sensory, then the location
+              pattern if there is one
+    pattern   uint32_t tag, then the payload. with REC_DENSE set
+              in the tag, the payload is the bit array of the
+              pattern, rows*ROW_STRIDE(cols) ints. otherwise the
+              tag counts the sorted linear indices that follow.
+
+A pattern is stored in whichever form is smaller. Playback maps
+the file and copies each pattern into place, so it costs about
+as much as the memcpy. */
+#ifndef RECORDING_H_
+#define RECORDING_H_ 1
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "repr.h"
+
+#define REC_MAGIC "HTMREC\0\0"
+#define REC_VERSION 1
+#define REC_DENSE 0x80000000u
+
+struct rec_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t sensory_rows, sensory_cols;
+    uint32_t location_rows, location_cols;
+    uint32_t reserved;
+};
+
+struct input_recorder
+{
+    FILE *f;
+    struct rec_header hdr;
+    /* active bits of a pattern being written */
+    uint32_t *idx;
+    uint32_t idx_cap;
+    uint64_t steps;
+};
+
+struct input_player
+{
+    const unsigned char *base;
+    size_t size, pos;
+    struct rec_header hdr;
+    /* the patterns handed out, owned by the player */
+    input_patterns ip;
+    uint64_t steps;
+};
+
+int32_t
+open_recorder (struct input_recorder *rec, const char *path);
+
+/* append the patterns of one step. the first one sets the
+   dimensions every later one must have. */
+int32_t
+record_patterns (struct input_recorder *rec, input_patterns *ip);
+
+int32_t
+close_recorder (struct input_recorder *rec);
+
+/* map a recording, and allocate patterns of its dimensions */
+int32_t
+open_player (struct input_player *pl, const char *path);
+
+/* copy the next step into pl->ip. returns 1 at the end of the
+   recording, or when a record is cut short. */
+int32_t
+play_patterns (struct input_player *pl);
+
+/* start over from the first step */
+void
+rewind_player (struct input_player *pl);
+
+void
+close_player (struct input_player *pl);
+
+#endif
@@ -1,12 +1,16 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "repr.h"
+#include "sdr.h"
 #include "utils.h"
 
 /* user wants their 2D structure, but it isn't
-literally stored that way. it's just a large
-enough 1D array of ints to store the bits. */
+literally stored that way. it's a 1D array of ints
+with each row padded out to a 64 bit boundary, plus a
+guard int for reading a window at the end of the last
+row. */
 repr_t *
 new_repr(uint32_t r, uint32_t c)
 {
@@ -20,7 +24,7 @@ new_repr(uint32_t r, uint32_t c)
     }
 
     repr->repr = (uint32_t *)calloc(
-        INT_LEN(r, c), SZ);
+        r*ROW_STRIDE(c)+1, sizeof(uint32_t));
 
     if (repr->repr == NULL) {
         ERR("Failed memory allocation for (%u, %u)"
@@ -30,6 +34,7 @@ new_repr(uint32_t r, uint32_t c)
 
     repr->rows = r;
     repr->cols = c;
+    repr->stride = ROW_STRIDE(c);
 
     return repr;
 }
@@ -38,17 +43,26 @@ void
 print_repr(repr_t *r)
 {
     uint32_t b = r->rows*r->cols;
-    INFO("%u bits in %u ints\n",
-        b, (uint32_t)(INT_LEN(r->rows, r->cols)));
+    uint32_t y, x;
     int i;
-    for (i=0; i<b; i++) {
-        if (i>0 && i%SZ==0)
-            printf("\n");
-        printf("%u",
-            (r->repr[i/SZ] & ((1 << (i%SZ)))) >> (i%SZ)
-        );
+
+    /* a sparse pattern prints as its active indices */
+    if (r->sparse || (!unpack_repr(r) && REPR_SPARSE_CHEAPER(r))) {
+        INFO("%u of %u bits active\n", r->num_active, b);
+        for (i=0; i<r->num_active; i++)
+            printf("%u%c", r->active[i],
+                i%16==15 ? '\n' : ' ');
+        printf("\n");
+        return;
+    }
+
+    INFO("%u bits in %u ints\n",
+        b, (uint32_t)REPR_WORDS(r));
+    for (y=0; y<r->rows; y++) {
+        for (x=0; x<r->cols; x++)
+            printf("%u", TEST_REPR_BIT_FAST(r, y, x) ? 1 : 0);
+        printf("\n");
     }
-    printf("\n");
 }
 
 void
@@ -56,7 +70,177 @@ free_repr(repr_t *r)
 {
     free(r->repr);
     r->repr = NULL;
+    free(r->active);
+    r->active = NULL;
     free(r);
     r = NULL;
 }
 
+/* grow the index list to hold at least n indices */
+int32_t
+reserve_active_repr(repr_t *rep, uint32_t n)
+{
+    uint32_t *active = NULL;
+    uint32_t cap = rep->active_cap ? rep->active_cap : 64;
+
+    if (n <= rep->active_cap)
+        return 0;
+    while (cap < n)
+        cap *= 2;
+
+    active = (uint32_t *)realloc(rep->active, sizeof(uint32_t)*cap);
+    if (!active) {
+        ERR("Failed memory allocation for %u active indices\n", n);
+        return 1;
+    }
+    rep->active = active;
+    rep->active_cap = cap;
+
+    return 0;
+}
+
+int32_t
+set_active_repr(repr_t *rep, const uint32_t *idx, uint32_t n)
+{
+    uint64_t size = (uint64_t)rep->rows*rep->cols;
+    uint32_t i;
+
+    /* the indices are written into the bit array as they are,
+       and the sparse walks count on each coming once in order */
+    for (i=0; i<n; i++) {
+        if (idx[i] >= size || (i && idx[i] <= idx[i-1])) {
+            ERR("Active index %u (%u of %u) is out of range or "
+                "order for (%u, %u)\n", idx[i], i, n, rep->rows, rep->cols);
+            return 1;
+        }
+    }
+    if (reserve_active_repr(rep, n))
+        return 1;
+
+    memcpy(rep->active, idx, sizeof(uint32_t)*n);
+    rep->num_active = n;
+    rep->sparse = 1;
+
+    return 0;
+}
+
+void
+pack_repr(repr_t *rep)
+{
+    if (!rep->sparse)
+        return;
+
+    memset(rep->repr, 0, sizeof(uint32_t)*REPR_WORDS(rep));
+    rep->sparse = 0;
+    set_bits_repr(rep, rep->active, rep->num_active);
+}
+
+int32_t
+unpack_repr(repr_t *rep)
+{
+    uint32_t n;
+
+    if (rep->sparse)
+        return 0;
+
+    /* count first, so the list is sized once */
+    n = popcount_repr(rep);
+    if (reserve_active_repr(rep, n))
+        return 1;
+    rep->num_active = active_bits_repr(rep, rep->active);
+
+    return 0;
+}
+
+int32_t
+sync_repr(repr_t *rep)
+{
+    if (rep->sparse) {
+        pack_repr(rep);
+        return 0;
+    }
+
+    return unpack_repr(rep);
+}
+
+int32_t
+copy_repr(repr_t *dst, repr_t *src)
+{
+    if (src->sparse)
+        return set_active_repr(dst, src->active, src->num_active);
+
+    memcpy(dst->repr, src->repr, sizeof(uint32_t)*REPR_WORDS(src));
+    dst->sparse = 0;
+
+    return 0;
+}
+
+/* n <= 32 bits of a flat bitstream of words ints from bit off */
+static uint32_t
+flat_bits(const uint32_t *flat, uint64_t words, uint64_t off, uint32_t n)
+{
+    uint64_t w = off/SZ;
+    uint64_t span = flat[w];
+
+    if (w+1 < words)
+        span |= (uint64_t)flat[w+1] << SZ;
+    span >>= off%SZ;
+
+    return (uint32_t)span & (n < SZ ? (1u << n) - 1 : ~0u);
+}
+
+void
+repr_from_flat(repr_t *rep, const uint32_t *flat)
+{
+    uint64_t words = FLAT_WORDS(rep);
+    uint32_t r, c, n;
+
+    /* the padding stays zero */
+    memset(rep->repr, 0, sizeof(uint32_t)*REPR_WORDS(rep));
+    for (r=0; r<rep->rows; r++) {
+        for (c=0; c<rep->cols; c+=SZ) {
+            n = rep->cols-c < SZ ? rep->cols-c : SZ;
+            rep->repr[BIT_IDX(rep, r, c)] = flat_bits(flat, words,
+                (uint64_t)r*rep->cols+c, n);
+        }
+    }
+    rep->sparse = 0;
+}
+
+void
+repr_to_flat(repr_t *rep, uint32_t *flat)
+{
+    uint64_t off;
+    uint32_t r, c, n, bits;
+
+    pack_repr(rep);
+    memset(flat, 0, sizeof(uint32_t)*FLAT_WORDS(rep));
+    for (r=0; r<rep->rows; r++) {
+        for (c=0; c<rep->cols; c+=SZ) {
+            n = rep->cols-c < SZ ? rep->cols-c : SZ;
+            bits = row_bits_repr(rep, r, c, n);
+            off = (uint64_t)r*rep->cols+c;
+            flat[off/SZ] |= bits << off%SZ;
+            if (off%SZ + n > SZ)
+                flat[off/SZ+1] |= bits >> (SZ - off%SZ);
+        }
+    }
+}
+
+void
+swap_repr(repr_t *a, repr_t *b)
+{
+    repr_t tmp = *a;
+
+    a->repr = b->repr;
+    a->active = b->active;
+    a->num_active = b->num_active;
+    a->active_cap = b->active_cap;
+    a->sparse = b->sparse;
+
+    b->repr = tmp.repr;
+    b->active = tmp.active;
+    b->num_active = tmp.num_active;
+    b->active_cap = tmp.active_cap;
+    b->sparse = tmp.sparse;
+}
@@ -8,17 +8,36 @@ arrays */
 /* bits in an int */
 #define SZ (8*sizeof(uint32_t))
 
-#define INT_EXTRA(r, c) \
-    (r)*(c) % SZ
-#define INT_LEN(r, c) \
-    (r)*(c)/SZ + (INT_EXTRA(r, c)? 1 : 0)
+/* the layout of the bit array of a repr_t. layout 1 was a flat
+bitstream of the rows one after another. layout 2 pads every row
+to a 64 bit boundary. code that wrote the bit array as a flat
+bitstream breaks with it, and goes through repr_from_flat and
+repr_to_flat instead. */
+#define REPR_LAYOUT 2
+
+/* ints per row of c bits. every row starts on a 64 bit
+boundary and its padding bits stay zero, so a window of a row
+can be fetched as whole words without per-bit arithmetic. */
+#define ROW_STRIDE(c) \
+    ( ((c)+2*SZ-1)/(2*SZ)*2 )
+/* ints in the bit array of a repr_t */
+#define REPR_WORDS(rep) \
+    ((rep)->rows*(rep)->stride)
+
+/* ints of a flat bitstream of the bits of rep, the rows one
+after another with no padding, as layout 1 stored them */
+#define FLAT_WORDS(rep) \
+    (((uint64_t)(rep)->rows*(rep)->cols+SZ-1)/SZ)
 
 /* index of bit in int array. rep must be a pointer to repr_t */
 #define BIT_IDX(rep, r ,c) \
-    (((r)*(rep)->cols+(c))/SZ)
+    ((r)*(rep)->stride+(c)/SZ)
 /* position of bit in int at index */
 #define BIT_POS(rep, r, c) \
-    (((r)*(rep)->cols+(c))%SZ)
+    ((c)%SZ)
+/* bit offset from the start of the int array, padding included */
+#define BIT_OFFSET(rep, r, c) \
+    ((r)*(rep)->stride*SZ+(c))
 /* perform operation if it is valid, otherwise print a
 warning. */
 #define VALID_MODIFY(operation, rep, r, c) \
@@ -54,12 +73,27 @@ pointer to a repr_t. */
     ( (rep)->repr[BIT_IDX(rep, r, c)] & 1<<BIT_POS(rep, r, c) )
 
 
+/* the active index list is smaller than the bit array. the
+kernels use this to pick which form to walk. */
+#define REPR_SPARSE_CHEAPER(rep) \
+    ( (uint64_t)(rep)->num_active*SZ < \
+      (uint64_t)(rep)->rows*(rep)->cols )
+
 /* raw input patterns are represented by a binary
-array of bits. */
+array of bits, and optionally by the sorted linear indices
+(r*cols+c) of the active bits. */
 typedef struct
 {
     uint32_t rows, cols;
+    /* ints per row */
+    uint32_t stride;
     uint32_t *repr;
+    uint32_t *active;
+    uint32_t num_active, active_cap;
+    /* set when only the index list is current. the bit macros
+    above work on the bit array alone, so pack_repr must be
+    called before using them on a sparse repr_t. */
+    char sparse;
 } repr_t;
 
 
@@ -72,6 +106,61 @@ print_repr(repr_t *rep);
 void
 free_repr(repr_t *r);
 
+/* hand over a sorted list of active bit indices. the bit array
+is not touched until it is packed. returns 1 when an index is
+outside the repr or not above the one before it. */
+int32_t
+set_active_repr(repr_t *rep, const uint32_t *idx, uint32_t n);
+
+/* room for n indices in the index list, which keeps what it
+holds. returns 1 when there is no memory for them. */
+int32_t
+reserve_active_repr(repr_t *rep, uint32_t n);
+
+/* rebuild the bit array from the index list */
+void
+pack_repr(repr_t *rep);
+
+/* rebuild the index list from the bit array */
+int32_t
+unpack_repr(repr_t *rep);
+
+/* make both forms current from whichever one is */
+int32_t
+sync_repr(repr_t *rep);
+
+/* copy the current form of src into dst of equal dimensions */
+int32_t
+copy_repr(repr_t *dst, repr_t *src);
+
+/* set rep from a flat bitstream of FLAT_WORDS(rep) ints, bit
+r*cols+c being bit (r, c) */
+void
+repr_from_flat(repr_t *rep, const uint32_t *flat);
+
+/* write the bits of rep to flat as a flat bitstream of
+FLAT_WORDS(rep) ints. a sparse rep is packed first. */
+void
+repr_to_flat(repr_t *rep, uint32_t *flat);
+
+/* exchange the bits and index lists of two repr_t of equal
+dimensions, leaving the repr_t structs themselves in place */
+void
+swap_repr(repr_t *a, repr_t *b);
+
+/* n <= 32 bits of row r starting at column c, with column c in
+the lowest bit. c+n must not pass the end of the row. the row
+padding and a guard int after the last row keep the second int
+in bounds. */
+static inline uint32_t
+row_bits_repr(const repr_t *rep, uint32_t r, uint32_t c, uint32_t n)
+{
+    const uint32_t *w = rep->repr + BIT_IDX(rep, r, c);
+    uint64_t span = ((uint64_t)w[1] << SZ | w[0]) >> BIT_POS(rep, r, c);
+
+    return (uint32_t)span & (n < SZ ? (1u << n) - 1 : ~0u);
+}
+
 /* data structure containing the various patterns within
 the input provided by the external encoder */
 typedef struct
@@ -0,0 +1,517 @@
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+/* SSE2 is the baseline the library is built with, and the
+   vector macros below are its. the kernels of every higher level
+   are compiled in regardless, each for its own instruction set,
+   and picked at runtime. */
+#include <immintrin.h>
+
+#include "sdr.h"
+#include "cpu.h"
+#include "utils.h"
+
+typedef __m128i vbits_t;
+#define VWORDS 4
+#define VZERO() _mm_setzero_si128()
+#define VLOAD(p) _mm_loadu_si128((const __m128i *)(p))
+#define VSTORE(p, v) _mm_storeu_si128((__m128i *)(p), (v))
+#define VAND(a, b) _mm_and_si128((a), (b))
+#define VOR(a, b) _mm_or_si128((a), (b))
+#define VXOR(a, b) _mm_xor_si128((a), (b))
+#define VANDNOT(a, b) _mm_andnot_si128((b), (a))
+#define VADD64(a, b) _mm_add_epi64((a), (b))
+#define VISZERO(v) \
+    (_mm_movemask_epi8(_mm_cmpeq_epi8((v), _mm_setzero_si128())) \
+        == 0xffff)
+
+/* no popcnt instruction before SSE4.2, so count bits in
+   parallel within each byte, then sum per 64 bit lane */
+static inline vbits_t
+vpopcnt (vbits_t v)
+{
+    const __m128i m1 = _mm_set1_epi8(0x55);
+    const __m128i m2 = _mm_set1_epi8(0x33);
+    const __m128i m4 = _mm_set1_epi8(0x0f);
+
+    v = _mm_sub_epi8(v, _mm_and_si128(_mm_srli_epi16(v, 1), m1));
+    v = _mm_add_epi8(_mm_and_si128(v, m2),
+        _mm_and_si128(_mm_srli_epi16(v, 2), m2));
+    v = _mm_and_si128(_mm_add_epi8(v, _mm_srli_epi16(v, 4)), m4);
+
+    return _mm_sad_epu8(v, _mm_setzero_si128());
+}
+
+static inline uint32_t
+vhsum64 (vbits_t v)
+{
+    return (uint32_t)(_mm_cvtsi128_si32(v) +
+        _mm_cvtsi128_si32(_mm_srli_si128(v, 8)));
+}
+
+/* operands of different dimensions would run past the end of
+   the smaller bit array */
+static inline char
+same_dims (repr_t *a, repr_t *b)
+{
+    if (__builtin_expect(a->rows==b->rows && a->cols==b->cols, 1))
+        return 1;
+
+    WARN("repr dimensions (%u, %u) and (%u, %u) differ.\n",
+        a->rows, a->cols, b->rows, b->cols);
+    return 0;
+}
+
+/* the counting kernels below take two operands and count the
+   bits of one of them, of their xor or of their and */
+enum pop_op { POP_ONE, POP_XOR, POP_AND };
+
+#define POP_WORD(op, x, y) \
+    ( (op) == POP_XOR ? (x) ^ (y) : (op) == POP_AND ? (x) & (y) : (x) )
+
+#define ALWAYS_INLINE __attribute__((always_inline))
+
+/* built like the rest of this file */
+static inline ALWAYS_INLINE uint32_t
+count_base (const uint32_t *a, const uint32_t *b, uint32_t words,
+    enum pop_op op)
+{
+    vbits_t acc = VZERO(), v;
+    uint32_t w = 0, cnt;
+
+    for (; w+VWORDS<=words; w+=VWORDS) {
+        v = VLOAD(a+w);
+        if (op == POP_XOR)
+            v = VXOR(v, VLOAD(b+w));
+        else if (op == POP_AND)
+            v = VAND(v, VLOAD(b+w));
+        acc = VADD64(acc, vpopcnt(v));
+    }
+    cnt = vhsum64(acc);
+    for (; w<words; w++)
+        cnt += __builtin_popcount(POP_WORD(op, a[w], b[w]));
+
+    return cnt;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+#define TARGET_POPCNT __attribute__((target("popcnt")))
+#define TARGET_AVX2 __attribute__((target("avx2,popcnt")))
+#define TARGET_AVX512 \
+    __attribute__((target("avx512f,avx512bw,avx512vpopcntdq,avx2,popcnt")))
+
+/* the popcnt instruction, a 64 bit word at a time */
+static inline ALWAYS_INLINE TARGET_POPCNT uint32_t
+count_popcnt (const uint32_t *a, const uint32_t *b, uint32_t words,
+    enum pop_op op)
+{
+    uint64_t x, y = 0;
+    uint32_t w = 0, cnt = 0;
+
+    for (; w+2<=words; w+=2) {
+        memcpy(&x, a+w, sizeof(uint64_t));
+        if (op != POP_ONE)
+            memcpy(&y, b+w, sizeof(uint64_t));
+        cnt += __builtin_popcountll(POP_WORD(op, x, y));
+    }
+    if (w < words)
+        cnt += __builtin_popcount(POP_WORD(op, a[w], b[w]));
+
+    return cnt;
+}
+
+/* popcount of each nibble from a lookup table in a shuffle,
+   then summed per 64 bit lane */
+static inline ALWAYS_INLINE TARGET_AVX2 __m256i
+vpopcnt_avx2 (__m256i v)
+{
+    const __m256i lut = _mm256_setr_epi8(
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+        0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, low));
+    __m256i hi = _mm256_shuffle_epi8(lut,
+        _mm256_and_si256(_mm256_srli_epi16(v, 4), low));
+
+    return _mm256_sad_epu8(_mm256_add_epi8(lo, hi),
+        _mm256_setzero_si256());
+}
+
+static inline ALWAYS_INLINE TARGET_AVX2 uint32_t
+count_avx2 (const uint32_t *a, const uint32_t *b, uint32_t words,
+    enum pop_op op)
+{
+    __m256i acc = _mm256_setzero_si256(), v;
+    __m128i s;
+    uint32_t w = 0, cnt;
+
+    for (; w+8<=words; w+=8) {
+        v = _mm256_loadu_si256((const __m256i *)(a+w));
+        if (op == POP_XOR)
+            v = _mm256_xor_si256(v,
+                _mm256_loadu_si256((const __m256i *)(b+w)));
+        else if (op == POP_AND)
+            v = _mm256_and_si256(v,
+                _mm256_loadu_si256((const __m256i *)(b+w)));
+        acc = _mm256_add_epi64(acc, vpopcnt_avx2(v));
+    }
+    s = _mm_add_epi64(_mm256_castsi256_si128(acc),
+        _mm256_extracti128_si256(acc, 1));
+    cnt = (uint32_t)(_mm_cvtsi128_si32(s) +
+        _mm_cvtsi128_si32(_mm_srli_si128(s, 8)));
+    for (; w<words; w++)
+        cnt += __builtin_popcount(POP_WORD(op, a[w], b[w]));
+
+    return cnt;
+}
+
+/* a popcount instruction per 64 bit lane, and the tail as a
+   masked load rather than a scalar loop */
+static inline ALWAYS_INLINE TARGET_AVX512 uint32_t
+count_avx512 (const uint32_t *a, const uint32_t *b, uint32_t words,
+    enum pop_op op)
+{
+    __m512i acc = _mm512_setzero_si512(), v;
+    __mmask16 tail;
+    uint32_t w = 0;
+
+    for (; w<words; w+=16) {
+        tail = words-w < 16 ? (__mmask16)((1u << (words-w)) - 1) : 0xffff;
+        v = _mm512_maskz_loadu_epi32(tail, a+w);
+        if (op == POP_XOR)
+            v = _mm512_xor_si512(v, _mm512_maskz_loadu_epi32(tail, b+w));
+        else if (op == POP_AND)
+            v = _mm512_and_si512(v, _mm512_maskz_loadu_epi32(tail, b+w));
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(v));
+    }
+
+    return (uint32_t)_mm512_reduce_add_epi64(acc);
+}
+
+#endif
+
+/* the three counts of one level, as functions to point to */
+#define COUNT_KERNELS(level, TARGET) \
+static TARGET uint32_t \
+count_one_##level (const uint32_t *a, const uint32_t *b, uint32_t words) \
+{ \
+    return count_##level(a, b, words, POP_ONE); \
+} \
+static TARGET uint32_t \
+count_xor_##level (const uint32_t *a, const uint32_t *b, uint32_t words) \
+{ \
+    return count_##level(a, b, words, POP_XOR); \
+} \
+static TARGET uint32_t \
+count_and_##level (const uint32_t *a, const uint32_t *b, uint32_t words) \
+{ \
+    return count_##level(a, b, words, POP_AND); \
+}
+
+COUNT_KERNELS(base, )
+#if defined(__x86_64__) || defined(__i386__)
+COUNT_KERNELS(popcnt, TARGET_POPCNT)
+COUNT_KERNELS(avx2, TARGET_AVX2)
+COUNT_KERNELS(avx512, TARGET_AVX512)
+#endif
+
+/* the bitwise kernels write the operator of two operands into
+   dst, which may alias either */
+enum bit_op { BIT_AND, BIT_OR, BIT_XOR, BIT_ANDNOT };
+
+#define BIT_WORD(op, x, y) \
+    ( (op) == BIT_AND ? (x) & (y) : (op) == BIT_OR ? (x) | (y) : \
+      (op) == BIT_XOR ? (x) ^ (y) : (x) & ~(y) )
+
+static inline ALWAYS_INLINE void
+bitwise_base (uint32_t *dst, const uint32_t *a, const uint32_t *b,
+    uint32_t words, enum bit_op op)
+{
+    vbits_t x, y;
+    uint32_t w = 0;
+
+    for (; w+VWORDS<=words; w+=VWORDS) {
+        x = VLOAD(a+w);
+        y = VLOAD(b+w);
+        VSTORE(dst+w, op == BIT_AND ? VAND(x, y) : op == BIT_OR ?
+            VOR(x, y) : op == BIT_XOR ? VXOR(x, y) : VANDNOT(x, y));
+    }
+    for (; w<words; w++)
+        dst[w] = BIT_WORD(op, a[w], b[w]);
+}
+
+/* the indices of the set bits of word w of rep, back from the
+   padded layout to r*cols+c */
+static inline ALWAYS_INLINE uint32_t*
+word_bits (const repr_t *rep, uint32_t w, uint32_t bits, uint32_t *out)
+{
+    uint32_t r = w / rep->stride;
+    uint32_t base = r*rep->cols + (w - r*rep->stride)*SZ;
+
+    while (bits) {
+        *out++ = base + __builtin_ctz(bits);
+        bits &= bits - 1;
+    }
+
+    return out;
+}
+
+/* skip a whole vector of inactive words at once, which is the
+   common case for sparse patterns */
+static inline ALWAYS_INLINE uint32_t
+active_base (const repr_t *rep, uint32_t *out)
+{
+    uint32_t w = 0, words = REPR_WORDS(rep);
+    uint32_t *start = out;
+
+    for (; w+VWORDS<=words; w+=VWORDS) {
+        if (VISZERO(VLOAD(rep->repr+w)))
+            continue;
+        out = word_bits(rep, w, rep->repr[w], out);
+        out = word_bits(rep, w+1, rep->repr[w+1], out);
+        out = word_bits(rep, w+2, rep->repr[w+2], out);
+        out = word_bits(rep, w+3, rep->repr[w+3], out);
+    }
+    for (; w<words; w++)
+        out = word_bits(rep, w, rep->repr[w], out);
+
+    return out - start;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static inline ALWAYS_INLINE TARGET_AVX2 void
+bitwise_avx2 (uint32_t *dst, const uint32_t *a, const uint32_t *b,
+    uint32_t words, enum bit_op op)
+{
+    __m256i x, y;
+    uint32_t w = 0;
+
+    for (; w+8<=words; w+=8) {
+        x = _mm256_loadu_si256((const __m256i *)(a+w));
+        y = _mm256_loadu_si256((const __m256i *)(b+w));
+        /* andnot complements its first operand */
+        _mm256_storeu_si256((__m256i *)(dst+w),
+            op == BIT_AND ? _mm256_and_si256(x, y) :
+            op == BIT_OR ? _mm256_or_si256(x, y) :
+            op == BIT_XOR ? _mm256_xor_si256(x, y) :
+            _mm256_andnot_si256(y, x));
+    }
+    for (; w<words; w++)
+        dst[w] = BIT_WORD(op, a[w], b[w]);
+}
+
+static TARGET_AVX2 uint32_t
+active_avx2 (const repr_t *rep, uint32_t *out)
+{
+    uint32_t w = 0, i, words = REPR_WORDS(rep);
+    uint32_t *start = out;
+    __m256i v;
+
+    for (; w+8<=words; w+=8) {
+        v = _mm256_loadu_si256((const __m256i *)(rep->repr+w));
+        if (_mm256_testz_si256(v, v))
+            continue;
+        for (i=0; i<8; i++)
+            out = word_bits(rep, w+i, rep->repr[w+i], out);
+    }
+    for (; w<words; w++)
+        out = word_bits(rep, w, rep->repr[w], out);
+
+    return out - start;
+}
+
+#endif
+
+/* the four bitwise operations of one level, as functions to
+   point to */
+#define BITWISE_KERNELS(level, TARGET) \
+static TARGET void \
+and_##level (uint32_t *d, const uint32_t *a, const uint32_t *b, uint32_t n) \
+{ \
+    bitwise_##level(d, a, b, n, BIT_AND); \
+} \
+static TARGET void \
+or_##level (uint32_t *d, const uint32_t *a, const uint32_t *b, uint32_t n) \
+{ \
+    bitwise_##level(d, a, b, n, BIT_OR); \
+} \
+static TARGET void \
+xor_##level (uint32_t *d, const uint32_t *a, const uint32_t *b, uint32_t n) \
+{ \
+    bitwise_##level(d, a, b, n, BIT_XOR); \
+} \
+static TARGET void \
+andnot_##level (uint32_t *d, const uint32_t *a, const uint32_t *b, uint32_t n) \
+{ \
+    bitwise_##level(d, a, b, n, BIT_ANDNOT); \
+}
+
+BITWISE_KERNELS(base, )
+#if defined(__x86_64__) || defined(__i386__)
+BITWISE_KERNELS(avx2, TARGET_AVX2)
+#endif
+
+static uint32_t
+active_bits_base (const repr_t *rep, uint32_t *out)
+{
+    return active_base(rep, out);
+}
+
+typedef uint32_t (*count_fn)(const uint32_t *, const uint32_t *, uint32_t);
+typedef void (*bitwise_fn)(uint32_t *, const uint32_t *, const uint32_t *,
+    uint32_t);
+typedef uint32_t (*active_fn)(const repr_t *, uint32_t *);
+
+/* bound by bind_sdr_kernels, the baseline until then */
+static struct
+{
+    count_fn one, xor_, and_;
+    bitwise_fn and_bits, or_bits, xor_bits, andnot_bits;
+    active_fn active;
+} kern = {
+    count_one_base, count_xor_base, count_and_base,
+    and_base, or_base, xor_base, andnot_base,
+    active_bits_base
+};
+
+void
+bind_sdr_kernels (enum cpu_level level)
+{
+    switch (level) {
+#if defined(__x86_64__) || defined(__i386__)
+    case CPU_AVX512:
+        kern.one = count_one_avx512;
+        kern.xor_ = count_xor_avx512;
+        kern.and_ = count_and_avx512;
+        break;
+    case CPU_AVX2:
+        kern.one = count_one_avx2;
+        kern.xor_ = count_xor_avx2;
+        kern.and_ = count_and_avx2;
+        break;
+    case CPU_POPCNT:
+        kern.one = count_one_popcnt;
+        kern.xor_ = count_xor_popcnt;
+        kern.and_ = count_and_popcnt;
+        break;
+#endif
+    default:
+        kern.one = count_one_base;
+        kern.xor_ = count_xor_base;
+        kern.and_ = count_and_base;
+    }
+
+    /* nothing wider than AVX2 for the bitwise kernels, the loads
+       and stores are what they wait on */
+#if defined(__x86_64__) || defined(__i386__)
+    if (level >= CPU_AVX2) {
+        kern.and_bits = and_avx2;
+        kern.or_bits = or_avx2;
+        kern.xor_bits = xor_avx2;
+        kern.andnot_bits = andnot_avx2;
+        kern.active = active_avx2;
+        return;
+    }
+#endif
+    kern.and_bits = and_base;
+    kern.or_bits = or_base;
+    kern.xor_bits = xor_base;
+    kern.andnot_bits = andnot_base;
+    kern.active = active_bits_base;
+}
+
+uint32_t
+popcount_words(const uint32_t *a, uint32_t words)
+{
+    return kern.one(a, a, words);
+}
+
+uint32_t
+xor_popcount_words(const uint32_t *a, const uint32_t *b, uint32_t words)
+{
+    return kern.xor_(a, b, words);
+}
+
+static uint32_t
+and_popcount_words(const uint32_t *a, const uint32_t *b, uint32_t words)
+{
+    return kern.and_(a, b, words);
+}
+
+uint32_t
+popcount_repr(repr_t *a)
+{
+    /* the index list already knows */
+    if (a->sparse)
+        return a->num_active;
+
+    return popcount_words(a->repr, REPR_WORDS(a));
+}
+
+uint32_t
+overlap_repr(repr_t *a, repr_t *b)
+{
+    if (!same_dims(a, b))
+        return 0;
+    pack_repr(a);
+    pack_repr(b);
+
+    return and_popcount_words(a->repr, b->repr, REPR_WORDS(a));
+}
+
+uint32_t
+hamming_repr(repr_t *a, repr_t *b)
+{
+    if (!same_dims(a, b))
+        return 0;
+    pack_repr(a);
+    pack_repr(b);
+
+    return xor_popcount_words(a->repr, b->repr, REPR_WORDS(a));
+}
+
+/* the four bitwise operations only differ in the kernel, so
+   they share one body */
+#define BITWISE_REPR(name, fn) \
+void \
+name(repr_t *dst, repr_t *a, repr_t *b) \
+{ \
+    if (!same_dims(a, b) || !same_dims(dst, a)) \
+        return; \
+    pack_repr(a); \
+    pack_repr(b); \
+    kern.fn(dst->repr, a->repr, b->repr, REPR_WORDS(a)); \
+    dst->sparse = 0; \
+}
+
+BITWISE_REPR(and_repr, and_bits)
+BITWISE_REPR(or_repr, or_bits)
+BITWISE_REPR(xor_repr, xor_bits)
+BITWISE_REPR(andnot_repr, andnot_bits)
+
+void
+set_bits_repr(repr_t *rep, const uint32_t *idx, uint32_t n)
+{
+    const uint32_t *end = idx + n;
+    uint32_t r, c;
+
+    pack_repr(rep);
+    /* a scatter, nothing to vectorize */
+    for (; idx<end; idx++) {
+        r = *idx / rep->cols;
+        c = *idx - r*rep->cols;
+        rep->repr[BIT_IDX(rep, r, c)] |= 1u << BIT_POS(rep, r, c);
+    }
+}
+
+uint32_t
+active_bits_repr(repr_t *rep, uint32_t *out)
+{
+    pack_repr(rep);
+
+    return kern.active(rep, out);
+}
@@ -0,0 +1,51 @@
+/* Interface for operations between whole sparse distributed
+representations. Every operand is a repr_t of equal dimensions,
+sparse operands are packed first. The bitwise operations write
+the packed result into dst, which may alias an operand. */
+#ifndef SDR_H_
+#define SDR_H_ 1
+
+#include <stdint.h>
+
+#include "repr.h"
+
+/* number of active bits */
+uint32_t
+popcount_repr(repr_t *a);
+
+/* dst = a & b, a | b, a ^ b, a & ~b */
+void
+and_repr(repr_t *dst, repr_t *a, repr_t *b);
+void
+or_repr(repr_t *dst, repr_t *a, repr_t *b);
+void
+xor_repr(repr_t *dst, repr_t *a, repr_t *b);
+void
+andnot_repr(repr_t *dst, repr_t *a, repr_t *b);
+
+/* number of bits active in both, without materializing a & b */
+uint32_t
+overlap_repr(repr_t *a, repr_t *b);
+
+/* number of bits active in exactly one */
+uint32_t
+hamming_repr(repr_t *a, repr_t *b);
+
+/* set every bit in a list of linear indices (r*cols+c). the
+indices are not range checked. */
+void
+set_bits_repr(repr_t *rep, const uint32_t *idx, uint32_t n);
+
+/* write the sorted linear indices of the active bits to out,
+which must hold popcount_repr(rep) of them. returns the count. */
+uint32_t
+active_bits_repr(repr_t *rep, uint32_t *out);
+
+/* the same kernels over raw word arrays, for library code that
+keeps bits outside of a repr_t */
+uint32_t
+popcount_words(const uint32_t *a, uint32_t words);
+uint32_t
+xor_popcount_words(const uint32_t *a, const uint32_t *b, uint32_t words);
+
+#endif
@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+#include "layer.h"
+#include "utils.h"
+
+/* the middle index is the only shared state. the writer
+   publishes its frame with a release exchange, and the reader
+   takes it with an acquire one, which also hands its old frame
+   back to the writer. */
+#define LOAD_RLX(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define EXCHANGE_ACQ_REL(p, v) \
+    __atomic_exchange_n((p), (v), __ATOMIC_ACQ_REL)
+
+int32_t
+alloc_snapshots (struct snapshot_buf *sb, struct layer *layer)
+{
+    uint32_t f;
+
+    memset(sb, 0, sizeof(struct snapshot_buf));
+    for (f=0; f<3; f++) {
+        sb->frames[f].height = layer->height;
+        sb->frames[f].width = layer->width;
+        sb->frames[f].overlaps = calloc(
+            (size_t)layer->height*layer->width, sizeof(uint32_t));
+        sb->frames[f].active = new_repr(layer->height, layer->width);
+        if (!sb->frames[f].overlaps || !sb->frames[f].active) {
+            free_snapshots(sb);
+            return 1;
+        }
+    }
+    sb->back = 0;
+    sb->middle = 1;
+    sb->front = 2;
+
+    return 0;
+}
+
+void
+free_snapshots (struct snapshot_buf *sb)
+{
+    uint32_t f;
+
+    for (f=0; f<3; f++) {
+        free(sb->frames[f].overlaps);
+        if (sb->frames[f].active)
+            free_repr(sb->frames[f].active);
+    }
+    memset(sb, 0, sizeof(struct snapshot_buf));
+}
+
+snapshot_t*
+snapshot_back (struct snapshot_buf *sb)
+{
+    return &sb->frames[sb->back];
+}
+
+void
+publish_snapshot (struct snapshot_buf *sb)
+{
+    /* whatever the reader did not take yet is overwritten next */
+    sb->back = EXCHANGE_ACQ_REL(&sb->middle,
+        sb->back | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+}
+
+void
+publish_l4_snapshot (struct snapshot_buf *sb, struct layer *layer,
+    uint64_t step)
+{
+    snapshot_t *frame = snapshot_back(sb);
+    struct minicolumn *mcs = layer->state->mcs;
+    uint32_t i, num_mcs = layer->height*layer->width;
+
+    frame->step = step;
+    for (i=0; i<num_mcs; i++)
+        frame->overlaps[i] = mcs[i].overlap;
+    copy_repr(frame->active, layer->state->active);
+
+    publish_snapshot(sb);
+}
+
+const snapshot_t*
+read_snapshot (struct snapshot_buf *sb)
+{
+    if (LOAD_RLX(&sb->middle) & SNAPSHOT_FRESH)
+        sb->front = EXCHANGE_ACQ_REL(&sb->middle, sb->front) &
+            ~SNAPSHOT_FRESH;
+
+    /* steps count from 1 */
+    if (!sb->frames[sb->front].step)
+        return NULL;
+
+    return &sb->frames[sb->front];
+}
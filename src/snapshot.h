@@ -0,0 +1,51 @@
+/* Interface for publishing the state after every step to a
+reader on another thread. Frames go through a triple buffer, so
+the step never waits for the reader and the reader never sees a
+frame being written. */
+#ifndef SNAPSHOT_H_
+#define SNAPSHOT_H_ 1
+
+#include <stdint.h>
+
+#include "htm.h"
+
+/* a frame is one of the three buffers. the index of the middle
+   one is published together with this bit when the writer left
+   a frame the reader has not taken yet. */
+#define SNAPSHOT_FRESH 4
+
+struct snapshot_buf
+{
+    snapshot_t frames[3];
+    /* the writer owns back, the reader owns front, and the two
+       exchange theirs with middle */
+    uint32_t back, middle, front;
+};
+
+/* frames of the dimensions of layer */
+int32_t
+alloc_snapshots (struct snapshot_buf *sb, struct layer *layer);
+
+void
+free_snapshots (struct snapshot_buf *sb);
+
+/* the frame the writer may fill */
+snapshot_t*
+snapshot_back (struct snapshot_buf *sb);
+
+/* hand the filled back frame over to the reader */
+void
+publish_snapshot (struct snapshot_buf *sb);
+
+/* copy the state of layer after step into the back frame and
+   publish it */
+void
+publish_l4_snapshot (struct snapshot_buf *sb, struct layer *layer,
+    uint64_t step);
+
+/* the newest frame, or NULL before the first one. it is the
+   reader's until its next call. */
+const snapshot_t*
+read_snapshot (struct snapshot_buf *sb);
+
+#endif
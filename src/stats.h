@@ -0,0 +1,95 @@
+/* Interface for the step instrumentation. Every layer thread
+adds up the cycles of the phases it ran and what it did in them
+on its own stack, and adds that to the stats of its thread_data
+once the phase ends. The thread_data of the threads sit side by
+side, so the hot loops share nothing but writing them once a
+phase. Building with -DHTM_STATS=0 compiles all of it away, and
+htm_get_stats reports zeros. */
+#ifndef STATS_H_
+#define STATS_H_ 1
+
+#include <stdint.h>
+
+#include "htm.h"
+
+#ifndef HTM_STATS
+# define HTM_STATS 1
+#endif
+
+#if HTM_STATS
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+
+/* the time stamp counter, not serialized. a phase runs for far
+   longer than the few instructions it may be off by. */
+static inline uint64_t
+stats_clock (void)
+{
+    return __rdtsc();
+}
+#else
+# include <time.h>
+
+/* processor time stands in for cycles elsewhere */
+static inline uint64_t
+stats_clock (void)
+{
+    return (uint64_t)clock();
+}
+#endif
+
+/* start timing into tick t */
+#define STATS_TIME(t) \
+    uint64_t t = stats_clock()
+/* add the cycles since t to phase of stats s */
+#define STATS_PHASE(s, phase, t) \
+    ((s)->cycles[phase] += stats_clock() - (t))
+/* the same, and restart t for the phase that follows */
+#define STATS_SWITCH(s, phase, t) \
+    do { \
+        uint64_t now_ = stats_clock(); \
+        (s)->cycles[phase] += now_ - (t); \
+        (t) = now_; \
+    } while (0)
+#define STATS_ADD(s, counter, n) \
+    ((s)->counter += (n))
+/* stats s of a phase, local to its thread */
+#define STATS_LOCAL(s) \
+    htm_stats_t s = {0}
+/* add the stats s of a phase to those of its thread */
+#define STATS_MERGE(sum, s) \
+    add_stats(sum, &(s))
+
+#else
+
+#define STATS_TIME(t) \
+    (void)0
+#define STATS_PHASE(s, phase, t) \
+    (void)0
+#define STATS_SWITCH(s, phase, t) \
+    (void)0
+#define STATS_ADD(s, counter, n) \
+    (void)0
+#define STATS_LOCAL(s) \
+    (void)0
+#define STATS_MERGE(sum, s) \
+    (void)0
+
+#endif
+
+/* add the stats s to sum, also used to report them */
+static inline void
+add_stats (htm_stats_t *sum, const htm_stats_t *s)
+{
+    uint32_t p;
+
+    for (p=0; p<HTM_NUM_PHASES; p++)
+        sum->cycles[p] += s->cycles[p];
+    sum->synapses_visited += s->synapses_visited;
+    sum->columns_active += s->columns_active;
+    sum->columns_learned += s->columns_learned;
+    sum->neighbors_rebuilt += s->neighbors_rebuilt;
+}
+
+#endif
@@ -7,11 +7,17 @@
 #define PERM_INC        0.150
 #define PERM_DEC        0.100
 #define NEAR_CONNECTED  CONNECTED_PERM-(CONNECTED_PERM-0.05)
+/* sampled synapses start uniformly within this distance of
+   CONNECTED_PERM, so about half of them are connected */
+#define PERM_INIT_RANGE 0.100
 
+/* every proximal synapse samples the layer's input pattern,
+   so the source is not stored per synapse. this also keeps
+   synapses free of pointers, so they can be mapped straight
+   from a checkpoint. */
 struct synapse
 {
     float perm;
-    repr_t *source;
     unsigned int srcx, srcy;
 };    
 
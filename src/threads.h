@@ -5,10 +5,15 @@ typedef enum { THREAD_SUCCESS=0, THREAD_FAIL=1 } thread_status_t;
 
 struct thread_data
 {
+    /* the layer the thread works on */
+    struct layer *layer;
     struct minicolumn ***minicolumns;
+    /* input pattern of the current step */
+    repr_t *input;
     float column_complexity;
-    /* average for single thread */
-    uint32_t inhibition_radius;
+    /* sum of the radii of the thread's minicolumns, stored
+       once a phase like the stats */
+    uint64_t inhib_rad_sum;
     /* overall average, set by calling thread. it will
        just point to the layer's inhibition radius */
     uint32_t *avg_inhib_rad;
@@ -16,6 +21,19 @@ struct thread_data
     uint32_t row_start;
     uint32_t row_num;
     uint32_t row_width;
+    /* recompute raw overlaps rather than trusting the delta */
+    char full_overlap;
+    /* adapt permanences of active minicolumns */
+    char learn;
+    /* receptive field radius over the input, for init */
+    uint32_t rec_fld_rad;
+    /* streams being scored, for batches */
+    struct l4_batch *batch;
+    /* what this thread's phases cost, added once a phase ends.
+       see stats.h */
+    htm_stats_t stats;
+    /* where this thread's spans go, NULL when not tracing */
+    struct trace_buf *trace;
     thread_status_t exit_status;
 };
 
@@ -0,0 +1,149 @@
+/* clock_gettime is POSIX, not C99 */
+#ifndef _POSIX_C_SOURCE
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+#include "layer.h"
+#include "utils.h"
+
+static const char *trace_names[TRACE_NUM_NAMES] =
+{
+    "step",
+    "inhibition radius",
+    "overlap",
+    "input delta",
+    "inhibition",
+    "learning",
+    "codec wait"
+};
+
+struct tracer*
+alloc_tracer (uint32_t threads, uint32_t cap)
+{
+    struct tracer *tr = NULL;
+    uint32_t b;
+
+    if (!(tr = calloc(1, sizeof(struct tracer))))
+        return NULL;
+    tr->num_bufs = threads+1;
+    if (!(tr->bufs = calloc(tr->num_bufs, sizeof(struct trace_buf)))) {
+        free(tr);
+        return NULL;
+    }
+    for (b=0; b<tr->num_bufs; b++) {
+        tr->bufs[b].cap = cap;
+        tr->bufs[b].events = malloc(sizeof(struct trace_event)*cap);
+        if (!tr->bufs[b].events) {
+            free_tracer(tr);
+            return NULL;
+        }
+    }
+    tr->origin = trace_clock();
+
+    return tr;
+}
+
+void
+free_tracer (struct tracer *tr)
+{
+    uint32_t b;
+
+    if (!tr)
+        return;
+
+    for (b=0; b<tr->num_bufs; b++)
+        free(tr->bufs[b].events);
+    free(tr->bufs);
+    free(tr);
+}
+
+uint64_t
+trace_clock (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+void
+trace_span (struct trace_buf *tb, uint32_t name, uint64_t begin)
+{
+    struct trace_event *ev = NULL;
+
+    if (tb->num_events == tb->cap) {
+        tb->dropped++;
+        return;
+    }
+    ev = tb->events + tb->num_events++;
+    ev->begin = begin;
+    ev->end = trace_clock();
+    ev->name = name;
+}
+
+void
+trace_layer4 (struct layer *layer, struct tracer *tr)
+{
+    struct layer_state *st = layer->state;
+    uint32_t t;
+
+    st->trace = tr ? &tr->bufs[0] : NULL;
+    /* threads without a buffer of their own go untraced */
+    for (t=0; t<st->num_threads; t++)
+        st->td[t].trace = tr && t+1 < tr->num_bufs ? &tr->bufs[t+1] : NULL;
+}
+
+int32_t
+write_trace (struct tracer *tr, const char *path)
+{
+    FILE *f = NULL;
+    struct trace_buf *tb = NULL;
+    struct trace_event *ev = NULL;
+    uint32_t b, e;
+    char sep = ' ';
+
+    if (!(f = fopen(path, "w"))) {
+        ERR("Failed to open trace %s\n", path);
+        return 1;
+    }
+
+    fprintf(f, "{\"traceEvents\":[\n");
+    for (b=0; b<tr->num_bufs; b++) {
+        tb = tr->bufs + b;
+        /* name the thread's track */
+        fprintf(f, "%c{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+            "\"tid\":%u,\"args\":{\"name\":", sep, b);
+        if (b)
+            fprintf(f, "\"layer4 thread %u\"}}\n", b-1);
+        else
+            fprintf(f, "\"step\"}}\n");
+        sep = ',';
+        /* timestamps and durations are in microseconds */
+        for (e=0; e<tb->num_events; e++) {
+            ev = tb->events + e;
+            fprintf(f, ",{\"name\":\"%s\",\"cat\":\"htm\",\"ph\":\"X\","
+                "\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}\n",
+                trace_names[ev->name], b,
+                (double)(ev->begin - tr->origin) / 1000.0,
+                (double)(ev->end - ev->begin) / 1000.0);
+        }
+        if (tb->dropped)
+            WARN("Trace buffer %u dropped %lu spans\n",
+                b, (unsigned long)tb->dropped);
+    }
+    fprintf(f, "],\"displayTimeUnit\":\"ns\"}\n");
+
+    if (fclose(f)) {
+        ERR("Failed to write trace %s\n", path);
+        return 1;
+    }
+
+    return 0;
+}
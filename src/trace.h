@@ -0,0 +1,84 @@
+/* Interface for recording a timeline of the step. Every layer
+thread, and the thread running the step, appends the spans of
+its phases to a buffer of its own. The spans are written out in
+the Chrome trace-event format, for chrome://tracing or
+Perfetto. */
+#ifndef TRACE_H_
+#define TRACE_H_ 1
+
+#include <stdint.h>
+
+struct layer;
+
+/* what a span was spent on */
+enum trace_name
+{
+    TRACE_STEP,
+    TRACE_INHIB_RADIUS,
+    TRACE_OVERLAP,
+    /* overlaps updated from the input delta or its active bits,
+       on the stepping thread */
+    TRACE_INPUT_DELTA,
+    TRACE_INHIBITION,
+    /* the winners adapting, on the layer threads */
+    TRACE_LEARNING,
+    TRACE_CODEC_WAIT,
+    TRACE_NUM_NAMES
+};
+
+struct trace_event
+{
+    /* nanoseconds on the monotonic clock */
+    uint64_t begin, end;
+    uint32_t name;
+};
+
+/* a full buffer drops its thread's later spans */
+struct trace_buf
+{
+    struct trace_event *events;
+    uint32_t num_events, cap;
+    uint64_t dropped;
+};
+
+/* buffer 0 is the stepping thread's, buffer t+1 layer thread
+   t's */
+struct tracer
+{
+    struct trace_buf *bufs;
+    uint32_t num_bufs;
+    /* when tracing started, timestamps are written from it */
+    uint64_t origin;
+};
+
+/* begin a span into tick t, when tb traces */
+#define TRACE_BEGIN(tb, t) \
+    uint64_t t = (tb) ? trace_clock() : 0
+/* end the span begun at t */
+#define TRACE_END(tb, name, t) \
+    do { if (tb) trace_span(tb, name, t); } while (0)
+
+/* buffers of cap spans each, for the stepping thread and for
+   threads layer threads */
+struct tracer*
+alloc_tracer (uint32_t threads, uint32_t cap);
+
+void
+free_tracer (struct tracer *tr);
+
+uint64_t
+trace_clock (void);
+
+void
+trace_span (struct trace_buf *tb, uint32_t name, uint64_t begin);
+
+/* point the threads of layer to the buffers of tr, or stop
+   them tracing when tr is NULL */
+void
+trace_layer4 (struct layer *layer, struct tracer *tr);
+
+/* write every span of tr as trace-event JSON to path */
+int32_t
+write_trace (struct tracer *tr, const char *path);
+
+#endif
@@ -1,35 +1,71 @@
 #ifndef _UTIL_H
 #define _UTIL_H
 
+#include <stdio.h>
+#include <stdint.h>
 #include <string.h>
-#include <time.h>
 
-static inline char *
-get_local_time(void)
-{
-    time_t now;
-    char *ts = NULL;
+#include "logger.h"
 
-    time(&now);
-    ts = ctime(&now);
-    /* strip the newline */
-    ts[strlen(ts)-1] = 0;
+/* messages of a level above HTM_LOG_LEVEL compile away. their
+   arguments are still type checked, but never evaluated. build
+   with CPPFLAGS=-DHTM_LOG_LEVEL=HTM_LOG_DEBUG for the per
+   minicolumn traces. */
+#define HTM_LOG_ERR 0
+#define HTM_LOG_WARN 1
+#define HTM_LOG_INFO 2
+#define HTM_LOG_DEBUG 3
 
-    return ts;
-}
+#ifndef HTM_LOG_LEVEL
+# define HTM_LOG_LEVEL HTM_LOG_INFO
+#endif
 
 #define LOG(LEVEL, ...) \
     do { \
-        printf("%s [%s - %s:%s:%d]  ", get_local_time(), \
-            LEVEL, __FILE__, __func__, __LINE__); \
-        printf(__VA_ARGS__); } while (0)
+        log_msg(LEVEL, __FILE__, __func__, __LINE__, __VA_ARGS__); \
+    } while (0)
+
+#define NO_LOG(...) \
+    do { if (0) printf(__VA_ARGS__); } while (0)
 
-#define DEBUG(...) LOG("DEBUG", __VA_ARGS__)
-#define INFO(...) LOG("INFO", __VA_ARGS__)
-#define WARN(...) LOG("WARN", __VA_ARGS__)
+#if HTM_LOG_LEVEL >= HTM_LOG_DEBUG
+# define DEBUG(...) LOG("DEBUG", __VA_ARGS__)
+#else
+# define DEBUG(...) NO_LOG(__VA_ARGS__)
+#endif
+#if HTM_LOG_LEVEL >= HTM_LOG_INFO
+# define INFO(...) LOG("INFO", __VA_ARGS__)
+#else
+# define INFO(...) NO_LOG(__VA_ARGS__)
+#endif
+#if HTM_LOG_LEVEL >= HTM_LOG_WARN
+# define WARN(...) LOG("WARN", __VA_ARGS__)
+#else
+# define WARN(...) NO_LOG(__VA_ARGS__)
+#endif
 #define ERR(...) LOG("ERR", __VA_ARGS__)
 
 extern char * strdup (const char *s);
 
+/* splitmix64. small, fast and good enough to sample with, and
+   any seed, zero included, gives a full period stream. */
+static inline uint64_t
+next_rand (uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+    return z ^ (z >> 31);
+}
+
+/* uniform in [0, 1) */
+static inline double
+next_rand_unit (uint64_t *state)
+{
+    return (next_rand(state) >> 11) * (1.0/9007199254740992.0);
+}
+
 #endif
 
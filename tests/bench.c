@@ -0,0 +1,394 @@
+/* Throughput benchmark of the layer 4 spatial pooler over
+seeded synthetic SDR streams. Every combination of the swept
+parameters runs in a child process of its own, so its peak RSS
+is its own, and is reported as one JSON object of an array on
+stdout. Library log messages go to stderr.
+
+usage: bench [-l sides] [-i sides] [-s sparsities] [-r rec_field_szs]
+             [-a local_activities] [-c column_complexity] [-d drift]
+             [-n steps] [-w warmup] [-S seed] [-T recording]
+             [-K plugin] [-t threads] [-A affinity]
+
+lists are comma separated. layers and inputs are square, sides
+gives their widths. drift is the fraction of the active bits
+that move between steps, 1 draws every step afresh. the column
+complexity must stay below the sparsity for any minicolumn to
+win. HTM_CPU=sse2 and the like run the kernels of a lower level.
+
+with -T the sensory patterns of a recording made through
+htm_start_recording are the input instead, over and over, and
+the input size, sparsity and drift are the recording's. the
+active_hash of two runs on the same input matches when their
+winners matched at every step.
+
+with -K the layers load the kernel plugin, built as plugin.h
+describes, and report "plugin" as their kernels when it fits.
+-t sweeps the threads layer 4 runs on and -A pins them, as the
+threads and affinity attributes of htm.conf do. the winners do
+not depend on the threads, so neither does the active_hash. */
+
+/* fork, getopt and clock_gettime are POSIX */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "htm.h"
+#include "layer.h"
+#include "recording.h"
+#include "plugin.h"
+#include "utils.h"
+
+#define MAX_SWEEP 16
+
+struct sweep
+{
+    double v[MAX_SWEEP];
+    uint32_t n;
+};
+
+struct bench_conf
+{
+    uint32_t layer_side, input_side;
+    double sparsity, rec_field_sz, local_activity, complexity, drift;
+    uint32_t steps, warmup;
+    uint64_t seed;
+    const char *recording;
+    const char *plugin;
+    uint32_t threads;
+    const char *affinity;
+};
+
+static const char *phase_names[HTM_NUM_PHASES] =
+{
+    "inhib_radius",
+    "overlap",
+    "inhibition",
+    "learning",
+    "neighbors",
+    "codec_wait",
+    "tm"
+};
+
+static int
+parse_sweep (const char *arg, struct sweep *sw)
+{
+    char *end = NULL;
+
+    sw->n = 0;
+    while (*arg) {
+        if (sw->n == MAX_SWEEP)
+            return 1;
+        sw->v[sw->n++] = strtod(arg, &end);
+        if (end == arg || (*end && *end != ','))
+            return 1;
+        arg = *end ? end+1 : end;
+    }
+
+    return sw->n == 0;
+}
+
+static uint64_t
+now_ns (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec*1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+/* the active bits of the stream, as linear indices */
+struct stream
+{
+    uint32_t *bits;
+    uint32_t num_bits, size;
+    uint64_t rng;
+};
+
+static void
+next_input (struct stream *s, repr_t *input, double drift)
+{
+    uint32_t b, moved = (uint32_t)(drift*s->num_bits + 0.5);
+
+    for (b=0; b<moved; b++)
+        s->bits[next_rand(&s->rng) % s->num_bits] =
+            next_rand(&s->rng) % s->size;
+
+    memset(input->repr, 0, sizeof(uint32_t)*REPR_WORDS(input));
+    for (b=0; b<s->num_bits; b++)
+        SET_REPR_BIT_FAST(input, s->bits[b] / input->cols,
+            s->bits[b] % input->cols);
+}
+
+/* fold the winners of the last step into h, FNV-1a */
+static uint64_t
+hash_active (struct layer *l4, uint32_t *cols, uint64_t h)
+{
+    uint32_t i, n;
+
+    n = layer4_active_columns(l4, cols, l4->height*l4->width);
+    for (i=0; i<n; i++) {
+        h ^= cols[i];
+        h *= 1099511628211ull;
+    }
+    /* so the steps do not run into each other */
+    h ^= 0xff;
+    h *= 1099511628211ull;
+
+    return h;
+}
+
+/* the next input, from the recording when there is one */
+static int
+next_step (struct stream *s, struct input_player *pl, repr_t *input,
+    double drift)
+{
+    if (!pl->base) {
+        next_input(s, input, drift);
+        return 0;
+    }
+    if (play_patterns(pl)) {
+        rewind_player(pl);
+        if (play_patterns(pl))
+            return 1;
+    }
+
+    return copy_repr(input, pl->ip.sensory_pattern);
+}
+
+static struct layer4_conf
+layer_conf (const struct bench_conf *bc)
+{
+    struct layer4_conf conf;
+
+    /* the rest as in the shipped htm.conf */
+    memset(&conf, 0, sizeof(conf));
+    conf.height = conf.width = bc->layer_side;
+    conf.cells_per_col = 4;
+    conf.sensorimotor = 1;
+    conf.loc_patt_sz = 1024;
+    conf.loc_patt_bits = 8;
+    conf.colconf.rec_field_sz = bc->rec_field_sz;
+    conf.colconf.local_activity = bc->local_activity;
+    conf.colconf.column_complexity = bc->complexity;
+    conf.colconf.high_tier = 1;
+    conf.colconf.activity_cycle_window = 100;
+    conf.colconf.seed = bc->seed;
+
+    return conf;
+}
+
+/* runs in the child */
+static int
+run_bench (const struct bench_conf *bc)
+{
+    struct layer *l4 = NULL;
+    struct layer_state *st = NULL;
+    struct stream s;
+    struct input_player pl;
+    struct rusage ru;
+    repr_t *input = NULL;
+    htm_stats_t sum;
+    uint64_t syns = 0, cycles = 0, begin, elapsed;
+    uint64_t hash = 14695981039346656037ull;
+    uint32_t i, t, p, *cols = NULL;
+
+    memset(&pl, 0, sizeof(pl));
+    if (bc->recording) {
+        if (open_player(&pl, bc->recording))
+            return 1;
+        input = new_repr(pl.hdr.sensory_rows, pl.hdr.sensory_cols);
+    } else {
+        input = new_repr(bc->input_side, bc->input_side);
+    }
+    s.size = bc->input_side*bc->input_side;
+    s.num_bits = (uint32_t)(bc->sparsity*s.size + 0.5);
+    if (!s.num_bits)
+        s.num_bits = 1;
+    s.bits = malloc(sizeof(uint32_t)*s.num_bits);
+    s.rng = bc->seed;
+    if (!input || !s.bits)
+        return 1;
+    for (i=0; i<s.num_bits; i++)
+        s.bits[i] = next_rand(&s.rng) % s.size;
+    if (next_step(&s, &pl, input, 0))
+        return 1;
+
+    if (!(l4 = alloc_layer4(layer_conf(bc))) ||
+        layer4_set_threads(l4, bc->threads, bc->affinity) ||
+        init_l4(l4, input, bc->rec_field_sz))
+        return 1;
+    if (bc->plugin && layer4_load_kernels(l4, bc->plugin))
+        return 1;
+    st = l4->state;
+    if (!(cols = malloc(sizeof(uint32_t)*l4->height*l4->width)))
+        return 1;
+    for (i=0; i<l4->height*l4->width; i++)
+        syns += st->mcs[i].num_synapses;
+
+    for (i=0; i<bc->warmup; i++) {
+        if (next_step(&s, &pl, input, bc->drift) ||
+            layer4_feedforward(l4))
+            return 1;
+    }
+    for (t=0; t<st->num_threads; t++)
+        memset(&st->td[t].stats, 0, sizeof(htm_stats_t));
+
+    /* making the input and the hash are left out of the time,
+       only layer 4 is timed */
+    elapsed = 0;
+    for (i=0; i<bc->steps; i++) {
+        if (next_step(&s, &pl, input, bc->drift))
+            return 1;
+        begin = now_ns();
+        if (layer4_feedforward(l4))
+            return 1;
+        elapsed += now_ns() - begin;
+        hash = hash_active(l4, cols, hash);
+    }
+
+    memset(&sum, 0, sizeof(sum));
+    for (t=0; t<st->num_threads; t++) {
+        for (p=0; p<HTM_NUM_PHASES; p++)
+            sum.cycles[p] += st->td[t].stats.cycles[p];
+        sum.synapses_visited += st->td[t].stats.synapses_visited;
+        sum.columns_active += st->td[t].stats.columns_active;
+    }
+    for (p=0; p<HTM_NUM_PHASES; p++)
+        cycles += sum.cycles[p];
+    getrusage(RUSAGE_SELF, &ru);
+
+    printf("  {\"layer\": %u, \"input\": %u, \"sparsity\": %g, "
+        "\"rec_field_sz\": %g, \"local_activity\": %g, "
+        "\"column_complexity\": %g, \"drift\": %g, \"threads\": %u, "
+        "\"affinity\": \"%s\", \"kernels\": \"%s\", \"steps\": %u, "
+        "\"seed\": %lu,\n",
+        bc->layer_side,
+        input->cols, bc->recording ? 0 : bc->sparsity, bc->rec_field_sz,
+        bc->local_activity, bc->complexity,
+        bc->recording ? 0 : bc->drift, st->num_threads,
+        bc->affinity ? bc->affinity : "false",
+        st->plugin ? "plugin" : htm_cpu_level(),
+        bc->steps, (unsigned long)bc->seed);
+    printf("   \"synapses\": %lu, \"steps_per_s\": %.2f, "
+        "\"ns_per_synapse\": %.4f, \"synapses_visited\": %lu, "
+        "\"active_per_step\": %.2f, \"active_hash\": \"%016lx\", "
+        "\"peak_rss_kb\": %ld,\n",
+        (unsigned long)syns, bc->steps * 1e9 / elapsed,
+        (double)elapsed / ((double)syns*bc->steps),
+        (unsigned long)sum.synapses_visited,
+        (double)sum.columns_active / bc->steps, (unsigned long)hash,
+        ru.ru_maxrss);
+    /* shares of the cycles counted, summed over the threads */
+    printf("   \"phases\": {");
+    for (p=0; p<HTM_NUM_PHASES; p++)
+        printf("%s\"%s\": %.4f", p ? ", " : "", phase_names[p],
+            cycles ? (double)sum.cycles[p] / cycles : 0);
+    printf("}}");
+
+    free_l4(l4);
+    free_repr(input);
+    free(s.bits);
+    free(cols);
+    close_player(&pl);
+
+    return 0;
+}
+
+static int
+fork_bench (const struct bench_conf *bc)
+{
+    pid_t pid;
+    int status, rc;
+
+    fflush(stdout);
+    if ((pid = fork()) < 0)
+        return 1;
+    if (!pid) {
+        htm_start_async_log(stderr);
+        rc = run_bench(bc);
+        htm_stop_async_log();
+        fflush(stdout);
+        _exit(rc);
+    }
+    if (waitpid(pid, &status, 0) != pid)
+        return 1;
+
+    return !WIFEXITED(status) || WEXITSTATUS(status);
+}
+
+int
+main (int argc, char **argv)
+{
+    struct sweep layers = {{48}, 1}, inputs = {{64}, 1};
+    struct sweep sparsity = {{0.25}, 1}, rec_field = {{0.02}, 1};
+    struct sweep activity = {{0.02}, 1}, threads = {{1}, 1};
+    struct bench_conf bc;
+    uint32_t a, b, c, d, e, f, runs = 0, failed = 0;
+    int opt, bad = 0;
+
+    memset(&bc, 0, sizeof(bc));
+    bc.complexity = 0.1;
+    bc.drift = 1;
+    bc.steps = 100;
+    bc.warmup = 5;
+    bc.seed = 1;
+    while ((opt = getopt(argc, argv, "l:i:s:r:a:c:d:n:w:S:T:K:t:A:")) != -1) {
+        switch (opt) {
+        case 'l': bad |= parse_sweep(optarg, &layers); break;
+        case 'i': bad |= parse_sweep(optarg, &inputs); break;
+        case 's': bad |= parse_sweep(optarg, &sparsity); break;
+        case 'r': bad |= parse_sweep(optarg, &rec_field); break;
+        case 'a': bad |= parse_sweep(optarg, &activity); break;
+        case 'c': bc.complexity = strtod(optarg, NULL); break;
+        case 'd': bc.drift = strtod(optarg, NULL); break;
+        case 'n': bc.steps = strtoul(optarg, NULL, 10); break;
+        case 'w': bc.warmup = strtoul(optarg, NULL, 10); break;
+        case 'S': bc.seed = strtoull(optarg, NULL, 10); break;
+        case 'T': bc.recording = optarg; break;
+        case 'K': bc.plugin = optarg; break;
+        case 't': bad |= parse_sweep(optarg, &threads); break;
+        case 'A': bc.affinity = optarg; break;
+        default: bad = 1;
+        }
+    }
+    if (bad || !bc.steps || bc.drift < 0 || bc.drift > 1) {
+        fprintf(stderr, "usage: %s [-l sides] [-i sides] "
+            "[-s sparsities] [-r rec_field_szs] [-a local_activities] "
+            "[-c column_complexity] [-d drift] [-n steps] [-w warmup] "
+            "[-S seed] [-T recording] [-K plugin] [-t threads] "
+            "[-A affinity]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("[\n");
+    for (a=0; a<layers.n; a++)
+    for (b=0; b<inputs.n; b++)
+    for (c=0; c<sparsity.n; c++)
+    for (d=0; d<rec_field.n; d++)
+    for (e=0; e<activity.n; e++)
+    for (f=0; f<threads.n; f++) {
+        bc.layer_side = (uint32_t)layers.v[a];
+        bc.input_side = (uint32_t)inputs.v[b];
+        bc.sparsity = sparsity.v[c];
+        bc.rec_field_sz = rec_field.v[d];
+        bc.local_activity = activity.v[e];
+        bc.threads = (uint32_t)threads.v[f];
+        if (runs++)
+            printf(",\n");
+        if (fork_bench(&bc)) {
+            /* keep the array well formed */
+            printf("  {\"failed\": true}");
+            failed++;
+        }
+    }
+    printf("\n]\n");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,57 @@
+/* Writes the C source of layer 4 kernels specialized for the
+layer of the conf at HTM_CONF_PATH over inputs of rows by cols,
+to be built into a kernel plugin. See src/plugin.h.
+
+usage: kernelgen -r rows -c cols [-o out.c]
+
+the rows and cols are those of the sensory patterns the codec
+hands the htm. the source goes to stdout without -o. */
+
+/* getopt is POSIX */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "htm.h"
+#include "conf.h"
+#include "parse_conf.h"
+#include "plugin.h"
+
+extern struct htm_conf htmconf;
+
+int
+main (int argc, char **argv)
+{
+    uint32_t rows = 0, cols = 0;
+    const char *out = NULL;
+    FILE *f = stdout;
+    int opt, rc;
+
+    while ((opt = getopt(argc, argv, "r:c:o:")) != -1) {
+        switch (opt) {
+        case 'r': rows = strtoul(optarg, NULL, 10); break;
+        case 'c': cols = strtoul(optarg, NULL, 10); break;
+        case 'o': out = optarg; break;
+        default: rows = 0;
+        }
+    }
+    if (!rows || !cols) {
+        fprintf(stderr, "usage: %s -r rows -c cols [-o out.c]\n",
+            argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (parse_htm_conf())
+        return EXIT_FAILURE;
+    if (out && !(f = fopen(out, "w"))) {
+        perror("Could not open the output");
+        return EXIT_FAILURE;
+    }
+    rc = write_l4_kernels(f, &htmconf.layer4conf, rows, cols);
+    if (out && fclose(f))
+        rc = 1;
+
+    return rc ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/* helpers of the layer 4 tests that step two layers side by
+side. included after the layer 4 sources and check.h. */
+#ifndef L4_HELPERS_H_
+#define L4_HELPERS_H_ 1
+
+/* the layer every test starts from, overriding what it varies */
+static struct layer4_conf
+base_l4_conf (uint32_t height, uint32_t width, float rec_field_sz,
+    uint32_t seed)
+{
+    struct layer4_conf conf;
+
+    memset(&conf, 0, sizeof(conf));
+    conf.height = height;
+    conf.width = width;
+    conf.cells_per_col = 4;
+    conf.sensorimotor = 1;
+    conf.loc_patt_sz = 1024;
+    conf.loc_patt_bits = 8;
+    conf.colconf.rec_field_sz = rec_field_sz;
+    conf.colconf.local_activity = 0.1;
+    conf.colconf.column_complexity = 0.1;
+    conf.colconf.high_tier = 1;
+    conf.colconf.activity_cycle_window = 100;
+    conf.colconf.seed = seed;
+
+    return conf;
+}
+
+/* every input bit is on with a chance of 0.3 */
+static void
+random_input (repr_t *in, uint64_t *rng)
+{
+    uint32_t r, c;
+
+    memset(in->repr, 0, sizeof(uint32_t)*REPR_WORDS(in));
+    for (r=0; r<in->rows; r++)
+        for (c=0; c<in->cols; c++)
+            if (next_rand_unit(rng) < 0.3)
+                SET_REPR_BIT_FAST(in, r, c);
+}
+
+/* everything a step leaves behind must match */
+static void
+assert_same_layers (struct layer *a, struct layer *b)
+{
+    struct minicolumn *ma = NULL, *mb = NULL;
+    uint32_t x, y, s, w;
+
+    ck_assert(a->inhibition_radius == b->inhibition_radius);
+    for (y=0; y<a->height; y++) {
+        for (x=0; x<a->width; x++) {
+            ma = a->minicolumns[y][x];
+            mb = b->minicolumns[y][x];
+            ck_assert_msg(ma->raw_overlap == mb->raw_overlap,
+                "raw overlap of (%u,%u): %u != %u",
+                y, x, ma->raw_overlap, mb->raw_overlap);
+            ck_assert(ma->overlap == mb->overlap);
+            ck_assert(ma->active_mask == mb->active_mask);
+            ck_assert(ma->boost == mb->boost);
+            ck_assert(ma->num_synapses == mb->num_synapses);
+            for (s=0; s<ma->num_synapses; s++) {
+                ck_assert(ma->proximal_dendrite_segment[s].perm ==
+                    mb->proximal_dendrite_segment[s].perm);
+                ck_assert(ma->proximal_dendrite_segment[s].srcx ==
+                    mb->proximal_dendrite_segment[s].srcx);
+                ck_assert(ma->proximal_dendrite_segment[s].srcy ==
+                    mb->proximal_dendrite_segment[s].srcy);
+            }
+        }
+    }
+    for (w=0; w<REPR_WORDS(a->state->active); w++)
+        ck_assert(a->state->active->repr[w] == b->state->active->repr[w]);
+    ck_assert(a->state->active->num_active ==
+        b->state->active->num_active);
+    ck_assert(!memcmp(a->state->active->active, b->state->active->active,
+        sizeof(uint32_t)*a->state->active->num_active));
+}
+
+#endif
@@ -0,0 +1,452 @@
+
+/* the checkpoint code needs POSIX */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <check.h>
+
+#include "conf.h"
+#include "repr.h"
+#include "repr.c"
+#include "layer4_mgmt.c"
+#include "layer4_algs.c"
+#include "layer4_ckpt.c"
+
+#define CKPT_PATH "test_l4_ckpt.bin"
+
+struct layer4_conf l4conf;
+input_patterns in;
+
+static void
+configure (void)
+{
+    l4conf.height = 32;
+    l4conf.width = 32;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.05;
+    l4conf.colconf.local_activity = 0.2;
+    l4conf.colconf.column_complexity = 0.1;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+}
+
+static void
+random_input (repr_t *rep)
+{
+    uint32_t i, j;
+
+    memset(rep->repr, 0, sizeof(uint32_t)*REPR_WORDS(rep));
+    for (i=0; i<rep->rows; i++)
+        for (j=0; j<rep->cols; j++)
+            if (rand()%4 == 0)
+                SET_REPR_BIT_FAST(rep, i, j);
+}
+
+/* overwrite n bytes of the checkpoint at off */
+static void
+poke_ckpt (uint64_t off, const void *v, size_t n)
+{
+    FILE *f = fopen(CKPT_PATH, "r+b");
+
+    ck_assert(f);
+    ck_assert(fseek(f, off, SEEK_SET) == 0);
+    ck_assert(fwrite(v, n, 1, f) == 1);
+    ck_assert(fclose(f) == 0);
+}
+
+START_TEST(test_l4_ckpt_roundtrip)
+    uint32_t i, j, s, n = 0, step;
+    struct layer *l4 = NULL;
+    struct minicolumn *mc = NULL;
+    float *perms = NULL, *boosts = NULL;
+    unsigned char *masks = NULL, *next = NULL;
+    uint32_t radius;
+
+    srand(31);
+    configure();
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+
+    in.sensory_pattern = new_repr(64, 64);
+    random_input(in.sensory_pattern);
+    ck_assert(init_l4(l4, in.sensory_pattern, l4conf.colconf.rec_field_sz)==0);
+
+    /* learn a little so the state is not the initial one */
+    for (step=0; step<3; step++) {
+        ck_assert(!spatial_pooler(l4));
+        random_input(in.sensory_pattern);
+    }
+
+    for (i=0; i<l4->height; i++)
+        for (j=0; j<l4->width; j++)
+            n += l4->minicolumns[i][j]->num_synapses;
+    perms = malloc(sizeof(float)*n);
+    boosts = malloc(sizeof(float)*l4->height*l4->width);
+    masks = malloc(l4->height*l4->width);
+    next = malloc(l4->height*l4->width);
+    ck_assert(perms && boosts && masks && next);
+
+    n = 0;
+    for (i=0; i<l4->height; i++) {
+        for (j=0; j<l4->width; j++) {
+            mc = l4->minicolumns[i][j];
+            for (s=0; s<mc->num_synapses; s++)
+                perms[n++] = mc->proximal_dendrite_segment[s].perm;
+            boosts[i*l4->width+j] = mc->boost;
+            masks[i*l4->width+j] = mc->active_mask;
+        }
+    }
+    radius = l4->inhibition_radius;
+    ck_assert(save_l4(l4, CKPT_PATH)==0);
+
+    /* the step the restored layer has to repeat */
+    ck_assert(!spatial_pooler(l4));
+    for (i=0; i<l4->height; i++)
+        for (j=0; j<l4->width; j++)
+            next[i*l4->width+j] = l4->minicolumns[i][j]->active_mask;
+
+    free_l4(l4);
+
+    l4 = map_l4(CKPT_PATH, in.sensory_pattern, 0);
+    ck_assert(l4);
+    ck_assert(l4->state->map.addr);
+    ck_assert(l4->height == l4conf.height);
+    ck_assert(l4->width == l4conf.width);
+    ck_assert(l4->inhibition_radius == radius);
+
+    n = 0;
+    for (i=0; i<l4->height; i++) {
+        for (j=0; j<l4->width; j++) {
+            mc = l4->minicolumns[i][j];
+            for (s=0; s<mc->num_synapses; s++)
+                ck_assert(perms[n++] ==
+                    mc->proximal_dendrite_segment[s].perm);
+            ck_assert(boosts[i*l4->width+j] == mc->boost);
+            ck_assert(masks[i*l4->width+j] == mc->active_mask);
+            ck_assert(!MC_ACTIVE_AT(mc, 0) ==
+                !TEST_REPR_BIT_FAST(l4->state->active, i, j));
+        }
+    }
+    /* and lists them, as a step would */
+    for (s=0; s<l4->state->active->num_active; s++)
+        ck_assert(TEST_REPR_BIT_FAST(l4->state->active,
+            l4->state->active->active[s] / l4->width,
+            l4->state->active->active[s] % l4->width));
+    ck_assert(l4->state->active->num_active ==
+        popcount_repr(l4->state->active));
+
+    ck_assert(!spatial_pooler(l4));
+    for (i=0; i<l4->height; i++)
+        for (j=0; j<l4->width; j++)
+            ck_assert(next[i*l4->width+j] ==
+                l4->minicolumns[i][j]->active_mask);
+
+    free_l4(l4);
+    remove(CKPT_PATH);
+    free(perms);
+    free(boosts);
+    free(masks);
+    free(next);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_ckpt_reject)
+    struct layer *l4 = NULL, *mapped = NULL;
+    repr_t *other = NULL;
+    struct ckpt_header hdr;
+    FILE *f = NULL;
+    uintptr_t off;
+    unsigned int bad;
+    long size;
+
+    srand(37);
+    configure();
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+    in.sensory_pattern = new_repr(64, 64);
+    random_input(in.sensory_pattern);
+    ck_assert(init_l4(l4, in.sensory_pattern, l4conf.colconf.rec_field_sz)==0);
+    ck_assert(save_l4(l4, CKPT_PATH)==0);
+
+    /* input of different dimensions */
+    other = new_repr(64, 32);
+    ck_assert(!map_l4(CKPT_PATH, other, 0));
+    free_repr(other);
+
+    /* a synapse off the input, and a minicolumn whose synapses
+       run past the array */
+    f = fopen(CKPT_PATH, "rb");
+    ck_assert(f);
+    ck_assert(fread(&hdr, sizeof(hdr), 1, f) == 1);
+    fclose(f);
+    ck_assert((mapped = map_l4(CKPT_PATH, in.sensory_pattern, 1)) != NULL);
+    free_l4(mapped);
+    bad = 64;
+    poke_ckpt(hdr.syn_off + (hdr.num_synapses-1)*sizeof(struct synapse) +
+        offsetof(struct synapse, srcy), &bad, sizeof(bad));
+    ck_assert(!map_l4(CKPT_PATH, in.sensory_pattern, 1));
+    ck_assert(save_l4(l4, CKPT_PATH)==0);
+    off = hdr.num_synapses - l4->minicolumns[0][0]->num_synapses + 1;
+    poke_ckpt(hdr.mc_off +
+        offsetof(struct minicolumn, proximal_dendrite_segment),
+        &off, sizeof(off));
+    ck_assert(!map_l4(CKPT_PATH, in.sensory_pattern, 1));
+    ck_assert(save_l4(l4, CKPT_PATH)==0);
+
+    /* truncated file */
+    f = fopen(CKPT_PATH, "r+b");
+    ck_assert(f);
+    fseek(f, 0, SEEK_END);
+    size = ftell(f);
+    fclose(f);
+    ck_assert(truncate(CKPT_PATH, size-1)==0);
+    ck_assert(!map_l4(CKPT_PATH, in.sensory_pattern, 0));
+
+    /* not a checkpoint */
+    ck_assert(!map_l4("/dev/null", in.sensory_pattern, 0));
+
+    free_l4(l4);
+    remove(CKPT_PATH);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_ckpt_shared)
+    uint32_t i, j, s, n = 0, step;
+    struct layer *l4 = NULL;
+    struct minicolumn *mc = NULL;
+    float *perms = NULL;
+    unsigned char *masks = NULL;
+
+    srand(41);
+    configure();
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+    in.sensory_pattern = new_repr(64, 64);
+    random_input(in.sensory_pattern);
+    ck_assert(init_l4(l4, in.sensory_pattern, l4conf.colconf.rec_field_sz)==0);
+    for (step=0; step<3; step++) {
+        ck_assert(!spatial_pooler(l4));
+        random_input(in.sensory_pattern);
+    }
+    ck_assert(save_l4(l4, CKPT_PATH)==0);
+    free_l4(l4);
+
+    /* a private mapping with learning off is the reference */
+    l4 = map_l4(CKPT_PATH, in.sensory_pattern, 0);
+    ck_assert(l4);
+    l4->state->learning = 0;
+    ck_assert(!spatial_pooler(l4));
+    masks = malloc(l4->height*l4->width);
+    ck_assert(masks);
+    for (i=0; i<l4->height; i++)
+        for (j=0; j<l4->width; j++)
+            masks[i*l4->width+j] = l4->minicolumns[i][j]->active_mask;
+    free_l4(l4);
+
+    l4 = map_l4(CKPT_PATH, in.sensory_pattern, 1);
+    ck_assert(l4);
+    ck_assert(!l4->state->learning);
+    for (i=0; i<l4->height; i++)
+        for (j=0; j<l4->width; j++)
+            n += l4->minicolumns[i][j]->num_synapses;
+    perms = malloc(sizeof(float)*n);
+    ck_assert(perms);
+    n = 0;
+    for (i=0; i<l4->height; i++) {
+        for (j=0; j<l4->width; j++) {
+            mc = l4->minicolumns[i][j];
+            for (s=0; s<mc->num_synapses; s++)
+                perms[n++] = mc->proximal_dendrite_segment[s].perm;
+        }
+    }
+
+    /* a write to a read-only synapse would fault here */
+    ck_assert(!spatial_pooler(l4));
+    n = 0;
+    for (i=0; i<l4->height; i++) {
+        for (j=0; j<l4->width; j++) {
+            mc = l4->minicolumns[i][j];
+            ck_assert(masks[i*l4->width+j] == mc->active_mask);
+            for (s=0; s<mc->num_synapses; s++)
+                ck_assert(perms[n++] ==
+                    mc->proximal_dendrite_segment[s].perm);
+        }
+    }
+
+    free_l4(l4);
+    remove(CKPT_PATH);
+    free(perms);
+    free(masks);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_ckpt_delta)
+    uint32_t i, j, s, n = 0, step;
+    struct layer *l4 = NULL;
+    struct minicolumn *mc = NULL;
+    float *perms = NULL;
+    unsigned char *next = NULL;
+    struct stat st;
+    FILE *f = NULL;
+
+    srand(43);
+    configure();
+    /* few winners, so few dirty tiles */
+    l4conf.colconf.local_activity = 0.02;
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+    in.sensory_pattern = new_repr(64, 64);
+    random_input(in.sensory_pattern);
+    ck_assert(init_l4(l4, in.sensory_pattern, l4conf.colconf.rec_field_sz)==0);
+
+    /* the first checkpoint is a full one */
+    ck_assert(save_l4_delta(l4, CKPT_PATH)==0);
+    ck_assert(stat(CKPT_PATH ".log", &st) != 0);
+
+    for (step=0; step<3; step++) {
+        ck_assert(!spatial_pooler(l4));
+        random_input(in.sensory_pattern);
+        ck_assert(save_l4_delta(l4, CKPT_PATH)==0);
+    }
+    ck_assert(l4->state->ckpt.seq == 3);
+    /* the appends are the writer's until synced */
+    ck_assert(sync_l4_ckpt(l4) == 0);
+    ck_assert(stat(CKPT_PATH ".log", &st) == 0);
+    ck_assert((uint64_t)st.st_size == l4->state->ckpt.log_size);
+
+    for (i=0; i<l4->height; i++)
+        for (j=0; j<l4->width; j++)
+            n += l4->minicolumns[i][j]->num_synapses;
+    perms = malloc(sizeof(float)*n);
+    next = malloc(l4->height*l4->width);
+    ck_assert(perms && next);
+    n = 0;
+    for (i=0; i<l4->height; i++) {
+        for (j=0; j<l4->width; j++) {
+            mc = l4->minicolumns[i][j];
+            for (s=0; s<mc->num_synapses; s++)
+                perms[n++] = mc->proximal_dendrite_segment[s].perm;
+        }
+    }
+    ck_assert(!spatial_pooler(l4));
+    for (i=0; i<l4->height; i++)
+        for (j=0; j<l4->width; j++)
+            next[i*l4->width+j] = l4->minicolumns[i][j]->active_mask;
+    free_l4(l4);
+
+    /* a torn entry at the end is dropped */
+    f = fopen(CKPT_PATH ".log", "ab");
+    ck_assert(f);
+    fwrite("torn", 4, 1, f);
+    fclose(f);
+
+    l4 = map_l4(CKPT_PATH, in.sensory_pattern, 0);
+    ck_assert(l4);
+    ck_assert(l4->state->ckpt.seq == 3);
+    ck_assert(stat(CKPT_PATH ".log", &st) == 0);
+    ck_assert((uint64_t)st.st_size == l4->state->ckpt.log_size);
+    n = 0;
+    for (i=0; i<l4->height; i++) {
+        for (j=0; j<l4->width; j++) {
+            mc = l4->minicolumns[i][j];
+            for (s=0; s<mc->num_synapses; s++)
+                ck_assert(perms[n++] ==
+                    mc->proximal_dendrite_segment[s].perm);
+        }
+    }
+    ck_assert(!spatial_pooler(l4));
+    for (i=0; i<l4->height; i++)
+        for (j=0; j<l4->width; j++)
+            ck_assert(next[i*l4->width+j] ==
+                l4->minicolumns[i][j]->active_mask);
+
+    /* the log is folded back into the checkpoint once it has
+       outgrown it */
+    for (step=0; step<1000 && l4->state->ckpt.seq; step++)
+        ck_assert(save_l4_delta(l4, CKPT_PATH)==0);
+    ck_assert(!l4->state->ckpt.seq);
+    ck_assert(stat(CKPT_PATH ".log", &st) != 0);
+
+    free_l4(l4);
+    remove(CKPT_PATH);
+    free(perms);
+    free(next);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+/* an append that never reached the disk is reported by the
+   sync, and the next checkpoint starts over from a full one */
+START_TEST(test_l4_ckpt_lost)
+    struct layer *l4 = NULL;
+    struct stat st;
+
+    srand(47);
+    configure();
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+    in.sensory_pattern = new_repr(64, 64);
+    random_input(in.sensory_pattern);
+    ck_assert(init_l4(l4, in.sensory_pattern, l4conf.colconf.rec_field_sz)==0);
+    ck_assert(save_l4_delta(l4, CKPT_PATH)==0);
+
+    /* the log cannot be opened, which the save never sees */
+    ck_assert(mkdir(CKPT_PATH ".log", 0700) == 0);
+    ck_assert(!spatial_pooler(l4));
+    random_input(in.sensory_pattern);
+    ck_assert(save_l4_delta(l4, CKPT_PATH)==0);
+    ck_assert(l4->state->ckpt.seq == 1);
+    ck_assert(sync_l4_ckpt(l4) == 1);
+    ck_assert(!l4->state->ckpt.path);
+    ck_assert(sync_l4_ckpt(l4) == 0);
+    ck_assert(rmdir(CKPT_PATH ".log") == 0);
+
+    ck_assert(!spatial_pooler(l4));
+    ck_assert(save_l4_delta(l4, CKPT_PATH)==0);
+    ck_assert(!l4->state->ckpt.seq);
+    ck_assert(stat(CKPT_PATH ".log", &st) != 0);
+    ck_assert(save_l4_delta(l4, CKPT_PATH)==0);
+    ck_assert(sync_l4_ckpt(l4) == 0);
+    ck_assert(stat(CKPT_PATH ".log", &st) == 0);
+    ck_assert((uint64_t)st.st_size == l4->state->ckpt.log_size);
+
+    free_l4(l4);
+    remove(CKPT_PATH ".log");
+    remove(CKPT_PATH);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+static Suite *
+test_suite(void)
+{
+    Suite *s = suite_create("Layer 4 Checkpoint Tests");
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, test_l4_ckpt_roundtrip);
+    tcase_add_test(tc_core, test_l4_ckpt_reject);
+    tcase_add_test(tc_core, test_l4_ckpt_shared);
+    tcase_add_test(tc_core, test_l4_ckpt_delta);
+    tcase_add_test(tc_core, test_l4_ckpt_lost);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = test_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include <check.h>
 
 #include "conf.h"
@@ -10,10 +11,12 @@
 struct layer4_conf l4conf;
 input_patterns in;
 
-START_TEST(test_l4_init)
-    uint32_t i, j;
-
-    /* configure layer 4 */
+/* every test starts from the same layer 4 conf, since each one
+   runs in a process of its own */
+static void
+setup (void)
+{
+    memset(&l4conf, 0, sizeof(l4conf));
     l4conf.height = 48;
     l4conf.width = 48;
     l4conf.cells_per_col = 4;
@@ -25,13 +28,22 @@ START_TEST(test_l4_init)
     l4conf.colconf.column_complexity = 0.33;
     l4conf.colconf.high_tier = 1;
     l4conf.colconf.activity_cycle_window = 100;
+}
+
+START_TEST(test_l4_init)
+    uint32_t i, j, s;
+    struct layer *l4 = NULL;
+    struct minicolumn *mc = NULL;
+    struct synapse *syn = NULL;
+
     /* allocate layer 4 in memory */
-    alloc_layer4(l4conf);
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
 
     for (i=0;i<l4conf.height; i++) {
         for (j=0; j<l4conf.width; j++) {
             in.sensory_pattern = new_repr(i, j);
-            ck_assert(init_l4(in.sensory_pattern,
+            ck_assert(init_l4(l4, in.sensory_pattern,
                 l4conf.colconf.rec_field_sz)
             );
             free_repr(in.sensory_pattern);
@@ -40,11 +52,91 @@ START_TEST(test_l4_init)
 
     in.sensory_pattern = new_repr(l4conf.height, l4conf.width);
     ck_assert(
-        init_l4(
+        init_l4(l4,
             in.sensory_pattern,
             l4conf.colconf.rec_field_sz
         )==0
     );
+
+    /* every minicolumn's synapses follow the previous one's in
+       the arena, and all start out connected */
+    syn = l4->state->arena.syns;
+    for (i=0;i<l4conf.height; i++) {
+        for (j=0; j<l4conf.width; j++) {
+            mc = l4->minicolumns[i][j];
+            ck_assert(mc->proximal_dendrite_segment == syn);
+            for (s=0; s<mc->num_synapses; s++, syn++)
+                ck_assert(syn->perm == (float)CONNECTED_PERM);
+        }
+    }
+    ck_assert(syn == l4->state->arena.syns + l4->state->arena.num_synapses);
+
+    free_l4(l4);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_init_potential_pool)
+    uint32_t i, j, s, n, field, same = 1;
+    uint32_t minx, maxx, miny, maxy;
+    struct minicolumn *mc = NULL;
+    struct synapse *syn = NULL, *first = NULL;
+    struct layer *l4 = NULL;
+
+    l4conf.colconf.potential_pct = 0.5;
+    l4conf.colconf.seed = 7;
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+    in.sensory_pattern = new_repr(l4conf.height, l4conf.width);
+    ck_assert(init_l4(l4, in.sensory_pattern,
+        l4conf.colconf.rec_field_sz)==0);
+
+    for (i=0;i<l4conf.height; i++) {
+        for (j=0; j<l4conf.width; j++) {
+            mc = l4->minicolumns[i][j];
+            field = receptive_field(in.sensory_pattern,
+                l4->state->td[0].rec_fld_rad, mc->input_xcent, mc->input_ycent,
+                &minx, &maxx, &miny, &maxy);
+            ck_assert(mc->num_synapses == (uint32_t)ceil(field*0.5));
+            syn = mc->proximal_dendrite_segment;
+            for (s=0; s<mc->num_synapses; s++) {
+                /* inside the field, in order, each bit once */
+                ck_assert(syn[s].srcx >= minx && syn[s].srcx < maxx);
+                ck_assert(syn[s].srcy >= miny && syn[s].srcy < maxy);
+                if (s)
+                    ck_assert(syn[s-1].srcy*in.sensory_pattern->cols +
+                        syn[s-1].srcx <
+                        syn[s].srcy*in.sensory_pattern->cols +
+                        syn[s].srcx);
+                ck_assert(syn[s].perm >=
+                    (float)(CONNECTED_PERM-PERM_INIT_RANGE));
+                ck_assert(syn[s].perm <=
+                    (float)(CONNECTED_PERM+PERM_INIT_RANGE));
+            }
+        }
+    }
+
+    /* the same seed gives the same layer, another one does not */
+    n = l4->state->arena.num_synapses;
+    first = malloc(sizeof(struct synapse)*n);
+    ck_assert(first);
+    memcpy(first, l4->state->arena.syns, sizeof(struct synapse)*n);
+    ck_assert(init_l4(l4, in.sensory_pattern,
+        l4conf.colconf.rec_field_sz)==0);
+    ck_assert(!memcmp(first, l4->state->arena.syns, sizeof(struct synapse)*n));
+
+    l4conf.colconf.seed = 8;
+    free_l4(l4);
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+    ck_assert(init_l4(l4, in.sensory_pattern,
+        l4conf.colconf.rec_field_sz)==0);
+    ck_assert(l4->state->arena.num_synapses == n);
+    for (s=0; s<n; s++)
+        same &= first[s].perm == l4->state->arena.syns[s].perm;
+    ck_assert(!same);
+
+    free(first);
+    free_l4(l4);
     free_repr(in.sensory_pattern);
 END_TEST
 
@@ -54,7 +146,9 @@ test_suite(void)
     Suite *s = suite_create("Layer 4 Algorithms Tests");
     /* Core test case */
     TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, NULL);
     tcase_add_test(tc_core, test_l4_init);
+    tcase_add_test(tc_core, test_l4_init_potential_pool);
     suite_add_tcase(s, tc_core);
 
     return s;
@@ -0,0 +1,219 @@
+/* tests of the kernel plugins written by write_l4_kernels. the
+   source is built with the system compiler, loaded into a layer,
+   and the layer must agree with a twin on the reference kernels
+   after every step. skipped when there is no compiler. */
+
+/* mkdtemp needs POSIX */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <check.h>
+
+#include "conf.h"
+#include "repr.h"
+#include "repr.c"
+#include "layer4_mgmt.c"
+#include "layer4_algs.c"
+#include "layer4_replay.c"
+#include "plugin.h"
+#include "l4_helpers.h"
+
+#define STEPS 16
+
+/* a layer geometry and the receptive field, sized so the rows
+   of the squares are fetched in one chunk, in two, and across
+   the 64 bit boundary of the input rows */
+struct plugin_case
+{
+    uint32_t height, width;
+    uint32_t in_rows, in_cols;
+    float rec_field_sz;
+};
+
+static const struct plugin_case cases[] =
+{
+    {8, 8, 32, 32, 0.1},
+    {12, 10, 48, 80, 0.3},
+    {16, 16, 72, 100, 0.5}
+};
+
+static char dir[32], so_path[64], src_path[64];
+
+static struct layer4_conf
+case_conf (const struct plugin_case *pc, char reference)
+{
+    struct layer4_conf conf =
+        base_l4_conf(pc->height, pc->width, pc->rec_field_sz, 7);
+
+    conf.colconf.reference = reference;
+
+    return conf;
+}
+
+/* write and build the kernels of a case. 0 when there is no
+   compiler to build them with. */
+static char
+build_plugin (const struct plugin_case *pc)
+{
+    struct layer4_conf conf = case_conf(pc, 0);
+    const char *srcdir = getenv("srcdir");
+    char cmd[512];
+    FILE *f = NULL;
+
+    if (system("cc --version >/dev/null 2>&1")) {
+        fprintf(stderr, "no cc, kernel plugin test skipped\n");
+        return 0;
+    }
+
+    strcpy(dir, "/tmp/htmc_pluginXXXXXX");
+    ck_assert(mkdtemp(dir) != NULL);
+    snprintf(src_path, sizeof(src_path), "%s/kernels.c", dir);
+    snprintf(so_path, sizeof(so_path), "%s/kernels.so", dir);
+    ck_assert((f = fopen(src_path, "w")) != NULL);
+    ck_assert(write_l4_kernels(f, &conf, pc->in_rows, pc->in_cols) == 0);
+    ck_assert(fclose(f) == 0);
+
+    snprintf(cmd, sizeof(cmd), "cc -O2 -shared -fPIC -I%s/src %s -o %s",
+        srcdir ? srcdir : ".", src_path, so_path);
+    ck_assert_msg(system(cmd) == 0, "%s failed", cmd);
+
+    return 1;
+}
+
+static void
+remove_plugin (void)
+{
+    ck_assert(unlink(so_path) == 0);
+    ck_assert(unlink(src_path) == 0);
+    ck_assert(rmdir(dir) == 0);
+}
+
+static struct layer*
+new_layer (const struct plugin_case *pc, repr_t *input, char reference)
+{
+    struct layer *l4 = alloc_layer4(case_conf(pc, reference));
+
+    ck_assert(l4 != NULL);
+    ck_assert(init_l4(l4, input, pc->rec_field_sz) == 0);
+
+    return l4;
+}
+
+START_TEST(test_l4_plugin_diff)
+    const struct plugin_case *pc = NULL;
+    struct layer *gen = NULL, *ref = NULL;
+    repr_t *input = NULL;
+    uint64_t rng = 0x9e37;
+    uint32_t c, i;
+
+    cpu_dispatch();
+    for (c=0; c<sizeof(cases)/sizeof(cases[0]); c++) {
+        pc = &cases[c];
+        if (!build_plugin(pc))
+            return;
+
+        ck_assert((input = new_repr(pc->in_rows, pc->in_cols)) != NULL);
+        random_input(input, &rng);
+        gen = new_layer(pc, input, 0);
+        ref = new_layer(pc, input, 1);
+        ck_assert(layer4_load_kernels(gen, so_path) == 0);
+        ck_assert(gen->state->plugin != NULL);
+        ck_assert(gen->state->kern == gen->state->plugin_kern);
+        ck_assert(gen->state->kern->overlap != mc_default_kernels.overlap);
+        ck_assert(gen->state->kern->learn != mc_default_kernels.learn);
+        ck_assert(gen->state->kern->inhib_rad !=
+            mc_default_kernels.inhib_rad);
+
+        for (i=0; i<STEPS; i++) {
+            /* a step on the reference kernels and back to the
+               plugin's */
+            layer4_use_reference(gen, i == STEPS/2);
+            random_input(input, &rng);
+            ck_assert(spatial_pooler(gen) == 0);
+            ck_assert(spatial_pooler(ref) == 0);
+            assert_same_layers(gen, ref);
+        }
+        ck_assert(gen->state->kern == gen->state->plugin_kern);
+
+        free_l4(gen);
+        free_l4(ref);
+        free_repr(input);
+        remove_plugin();
+    }
+END_TEST
+
+/* a plugin for another geometry is left out, and the layer
+   keeps its own kernels */
+START_TEST(test_l4_plugin_mismatch)
+    struct layer *l4 = NULL;
+    repr_t *input = NULL;
+    uint64_t rng = 1;
+
+    if (!build_plugin(&cases[0]))
+        return;
+
+    ck_assert((input = new_repr(cases[1].in_rows, cases[1].in_cols)) != NULL);
+    random_input(input, &rng);
+    l4 = new_layer(&cases[1], input, 0);
+    ck_assert(layer4_load_kernels(l4, so_path) == 0);
+    ck_assert(l4->state->plugin == NULL);
+    ck_assert(l4->state->kern == &mc_default_kernels);
+    /* no such file fails */
+    ck_assert(layer4_load_kernels(l4, "/nonexistent.so") == 1);
+    ck_assert(l4->state->kern == &mc_default_kernels);
+
+    free_l4(l4);
+    free_repr(input);
+    remove_plugin();
+END_TEST
+
+START_TEST(test_l4_plugin_unsupported)
+    struct plugin_case pc = cases[0];
+    struct layer4_conf conf = case_conf(&pc, 0);
+    FILE *f = NULL;
+
+    ck_assert((f = tmpfile()) != NULL);
+    /* sampled receptive fields have no fixed layout */
+    conf.colconf.potential_pct = 0.5;
+    ck_assert(write_l4_kernels(f, &conf, 32, 32) == 1);
+    /* nor do one dimensional inputs get kernels */
+    conf.colconf.potential_pct = 0;
+    ck_assert(write_l4_kernels(f, &conf, 1, 1024) == 1);
+    /* or empty receptive fields */
+    conf.colconf.rec_field_sz = 0.0001;
+    ck_assert(write_l4_kernels(f, &conf, 32, 32) == 1);
+    fclose(f);
+END_TEST
+
+static Suite *
+test_suite(void)
+{
+    Suite *s = suite_create("Layer 4 Kernel Plugin Tests");
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, test_l4_plugin_diff);
+    tcase_add_test(tc_core, test_l4_plugin_mismatch);
+    tcase_add_test(tc_core, test_l4_plugin_unsupported);
+    tcase_set_timeout(tc_core, 60);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = test_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,237 @@
+/* differential tests of the layer 4 kernels against the scalar
+   reference ones. two layers are built alike but for their
+   kernels, stepped over the same inputs, and must agree on every
+   overlap, winner and permanence after every step. */
+
+/* the replay code needs POSIX */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+#include "conf.h"
+#include "repr.h"
+#include "repr.c"
+#include "layer4_mgmt.c"
+#include "layer4_algs.c"
+#include "layer4_replay.c"
+#include "cpu.h"
+#include "l4_helpers.h"
+
+#define CASES 24
+#define STEPS 12
+
+/* a randomized layer and its input stream */
+struct diff_case
+{
+    struct layer4_conf conf;
+    uint32_t in_rows, in_cols, num_bits;
+    double drift;
+    /* hand the input over as active indices */
+    char sparse_input;
+    uint64_t rng;
+};
+
+struct diff_layer
+{
+    struct layer *l4;
+    repr_t *input;
+};
+
+static uint32_t bits[1 << 14];
+
+static void
+random_case (struct diff_case *dc, uint32_t c)
+{
+    static const double sparsities[] = {0.02, 0.1, 0.3};
+    double sparsity;
+    uint32_t height, width;
+
+    memset(dc, 0, sizeof(struct diff_case));
+    dc->rng = 0x5eed + c;
+    height = 4 + next_rand(&dc->rng) % 29;
+    width = 4 + next_rand(&dc->rng) % 29;
+    /* the input may not be smaller than the layer */
+    dc->in_rows = height + next_rand(&dc->rng) % 33;
+    dc->in_cols = width + next_rand(&dc->rng) % 33;
+
+    sparsity = sparsities[c % 3];
+    dc->num_bits = sparsity*dc->in_rows*dc->in_cols + 1;
+    dc->drift = c & 1 ? 0.05 : 1;
+    dc->sparse_input = (c / 3) & 1;
+
+    dc->conf = base_l4_conf(height, width,
+        0.05 + 0.25*next_rand_unit(&dc->rng), c + 1);
+    dc->conf.colconf.local_activity =
+        0.02 + 0.2*next_rand_unit(&dc->rng);
+    dc->conf.colconf.column_complexity = sparsity / 2;
+    /* every overlap path of the default kernels gets its turn */
+    dc->conf.colconf.delta_overlap_max = c % 4 ? 0.3 : 0;
+    dc->conf.colconf.input_index = (c / 2) & 1;
+    dc->conf.colconf.potential_pct = c % 5 ? 0.5 : 0;
+}
+
+/* move a drift of the active bits and hand the input to both
+   layers in the form of the case */
+static void
+next_inputs (struct diff_case *dc, struct diff_layer *a,
+    struct diff_layer *b, double drift)
+{
+    uint32_t i, size = dc->in_rows*dc->in_cols;
+    uint32_t moved = drift*dc->num_bits + 0.5;
+    repr_t *in = a->input;
+
+    for (i=0; i<moved; i++)
+        bits[next_rand(&dc->rng) % dc->num_bits] =
+            next_rand(&dc->rng) % size;
+
+    memset(in->repr, 0, sizeof(uint32_t)*REPR_WORDS(in));
+    for (i=0; i<dc->num_bits; i++)
+        SET_REPR_BIT_FAST(in, bits[i] / in->cols, bits[i] % in->cols);
+    in->sparse = 0;
+    if (dc->sparse_input) {
+        ck_assert(unpack_repr(in) == 0);
+        in->sparse = 1;
+    }
+    ck_assert(copy_repr(b->input, in) == 0);
+}
+
+static void
+alloc_diff_layer (struct diff_case *dc, struct diff_layer *dl,
+    char reference)
+{
+    struct layer4_conf conf = dc->conf;
+
+    conf.colconf.reference = reference;
+    dl->input = new_repr(dc->in_rows, dc->in_cols);
+    ck_assert(dl->input != NULL);
+    dl->l4 = alloc_layer4(conf);
+    ck_assert(dl->l4 != NULL);
+}
+
+static void
+init_diff_layers (struct diff_case *dc, struct diff_layer *a,
+    struct diff_layer *b)
+{
+    uint32_t i;
+
+    for (i=0; i<dc->num_bits; i++)
+        bits[i] = next_rand(&dc->rng) % (dc->in_rows*dc->in_cols);
+    next_inputs(dc, a, b, 0);
+    ck_assert(init_l4(a->l4, a->input, dc->conf.colconf.rec_field_sz) == 0);
+    ck_assert(init_l4(b->l4, b->input, dc->conf.colconf.rec_field_sz) == 0);
+}
+
+static void
+free_diff_layer (struct diff_layer *dl)
+{
+    free_l4(dl->l4);
+    free_repr(dl->input);
+}
+
+static uint64_t
+synapses_visited (struct layer *l4)
+{
+    uint64_t n = 0;
+    uint32_t t;
+
+    for (t=0; t<l4->state->num_threads; t++)
+        n += l4->state->td[t].stats.synapses_visited;
+
+    return n;
+}
+
+START_TEST(test_l4_ref_random)
+    struct diff_case dc;
+    struct diff_layer fast, ref;
+    enum cpu_level bound;
+    uint32_t c, i, shortcuts = 0;
+
+    /* so the first layer does not bind over the levels below */
+    cpu_dispatch();
+    bound = cpu_bound();
+
+    /* the default kernels of every level the CPU runs, in turn */
+    for (c=0; c<CASES*(cpu_detect()+1); c++) {
+        if (c % CASES == 0)
+            ck_assert(cpu_bind(c / CASES) == c / CASES);
+        random_case(&dc, c % CASES);
+        alloc_diff_layer(&dc, &fast, 0);
+        alloc_diff_layer(&dc, &ref, 1);
+        ck_assert(fast.l4->state->kern == &mc_default_kernels);
+        ck_assert(ref.l4->state->kern == &mc_reference_kernels);
+        init_diff_layers(&dc, &fast, &ref);
+        assert_same_layers(fast.l4, ref.l4);
+
+        for (i=0; i<STEPS; i++) {
+            next_inputs(&dc, &fast, &ref, dc.drift);
+            ck_assert(spatial_pooler(fast.l4) == 0);
+            ck_assert(spatial_pooler(ref.l4) == 0);
+            assert_same_layers(fast.l4, ref.l4);
+        }
+        /* the default layer took the delta or active bit walk */
+        shortcuts += HTM_STATS &&
+            synapses_visited(fast.l4) < synapses_visited(ref.l4);
+
+        free_diff_layer(&fast);
+        free_diff_layer(&ref);
+    }
+    ck_assert(!HTM_STATS || shortcuts > 0);
+    cpu_bind(bound);
+END_TEST
+
+/* a layer switched to the reference kernels and back keeps
+   agreeing with one that never left them */
+START_TEST(test_l4_ref_switch)
+    struct diff_case dc;
+    struct diff_layer sw, ref;
+    uint32_t i;
+
+    random_case(&dc, 1);
+    alloc_diff_layer(&dc, &sw, 0);
+    alloc_diff_layer(&dc, &ref, 1);
+    init_diff_layers(&dc, &sw, &ref);
+
+    for (i=0; i<3*STEPS; i++) {
+        if (i % STEPS == 0)
+            layer4_use_reference(sw.l4, (i / STEPS) & 1);
+        next_inputs(&dc, &sw, &ref, dc.drift);
+        ck_assert(spatial_pooler(sw.l4) == 0);
+        ck_assert(spatial_pooler(ref.l4) == 0);
+        assert_same_layers(sw.l4, ref.l4);
+    }
+
+    free_diff_layer(&sw);
+    free_diff_layer(&ref);
+END_TEST
+
+static Suite *
+test_suite(void)
+{
+    Suite *s = suite_create("Layer 4 Reference Kernel Tests");
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, test_l4_ref_random);
+    tcase_add_test(tc_core, test_l4_ref_switch);
+    tcase_set_timeout(tc_core, 60);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = test_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -1,4 +1,10 @@
+/* the replay code needs POSIX */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <check.h>
 
 #include "conf.h"
@@ -6,6 +12,8 @@
 #include "repr.c"
 #include "layer4_mgmt.c"
 #include "layer4_algs.c"
+#include "layer4_replay.c"
+#include "trace.h"
 
 struct layer4_conf l4conf;
 input_patterns in;
@@ -27,9 +35,8 @@ START_TEST(test_l4_sp_basic_sparsity_100)
     l4conf.colconf.high_tier = 1;
     l4conf.colconf.activity_cycle_window = 100;
     /* allocate layer 4 in memory */
-    ck_assert(alloc_layer4(l4conf));
-
-    l4 = get_layer4();
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
 
     /* generate input pattern with all bits active */
     in.sensory_pattern = new_repr(l4conf.height, l4conf.width);
@@ -40,7 +47,7 @@ START_TEST(test_l4_sp_basic_sparsity_100)
     }
 
     ck_assert(
-        init_l4(
+        init_l4(l4,
             in.sensory_pattern,
             l4conf.colconf.rec_field_sz
         )==0
@@ -60,7 +67,7 @@ START_TEST(test_l4_sp_basic_sparsity_100)
         }
     }
 
-    free_l4();
+    free_l4(l4);
     free_repr(in.sensory_pattern);
 END_TEST
 
@@ -84,9 +91,8 @@ START_TEST(test_l4_sp_basic_sparsity_2)
     l4conf.colconf.high_tier = 1;
     l4conf.colconf.activity_cycle_window = 100;
     /* allocate layer 4 in memory */
-    ck_assert(alloc_layer4(l4conf));
-
-    l4 = get_layer4();
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
 
     /* generate input pattern with all bits active. Have to
     double input size to get desired sparsity. */
@@ -98,7 +104,7 @@ START_TEST(test_l4_sp_basic_sparsity_2)
     }
 
     ck_assert(
-        init_l4(
+        init_l4(l4,
             in.sensory_pattern,
             l4conf.colconf.rec_field_sz
         )==0
@@ -135,7 +141,675 @@ START_TEST(test_l4_sp_basic_sparsity_2)
         sparsity_level
     );
 
-    free_l4();
+    free_l4(l4);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_sp_incremental_overlap)
+    uint32_t i, j, s, step, raw;
+    struct layer *l4 = NULL;
+    struct minicolumn *mc = NULL;
+    struct synapse *synptr = NULL;
+
+    /* configure layer 4 */
+    l4conf.height = 48;
+    l4conf.width = 48;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.02;
+    l4conf.colconf.local_activity = 0.02;
+    l4conf.colconf.column_complexity = 0.0;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+    /* up to 5% of the input may change between steps */
+    l4conf.colconf.delta_overlap_max = 0.05;
+    /* allocate layer 4 in memory */
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+
+    /* start from a pattern with about a quarter of its
+       bits active */
+    srand(4);
+    in.sensory_pattern = new_repr(l4conf.height*2, l4conf.width*2);
+    for (i=0; i<l4conf.height*2; i++)
+        for (j=0; j<l4conf.width*2; j++)
+            if (rand()%4 == 0)
+                SET_REPR_BIT_FAST(in.sensory_pattern, i, j);
+
+    ck_assert(
+        init_l4(l4,
+            in.sensory_pattern,
+            l4conf.colconf.rec_field_sz
+        )==0
+    );
+
+    /* flip a few bits every step. the raw overlaps updated from
+       the difference must match a full recount, including the
+       synapses that learning connected in the previous step. */
+    for (step=0; step<10; step++) {
+        for (s=0; s<64; s++) {
+            i = rand()%(l4conf.height*2);
+            j = rand()%(l4conf.width*2);
+            if (TEST_REPR_BIT_FAST(in.sensory_pattern, i, j))
+                CLR_REPR_BIT_FAST(in.sensory_pattern, i, j);
+            else
+                SET_REPR_BIT_FAST(in.sensory_pattern, i, j);
+        }
+
+        ck_assert(!spatial_pooler(l4));
+        ck_assert(l4->state->index.valid);
+
+        for (i=0; i<l4->height; i++) {
+            for (j=0; j<l4->width; j++) {
+                mc = l4->minicolumns[i][j];
+                /* learning already moved the permanences of the
+                   winners, so recount over the current ones */
+                raw = 0;
+                synptr = mc->proximal_dendrite_segment;
+                for (s=0; s<mc->num_synapses; s++, synptr++)
+                    if (synptr->perm >= CONNECTED_PERM &&
+                        TEST_REPR_BIT_FAST(in.sensory_pattern,
+                            synptr->srcy, synptr->srcx))
+                        raw++;
+                ck_assert_msg(
+                    mc->raw_overlap == raw,
+                    "(%u,%u) step %u raw overlap %u expected %u\n",
+                    i, j, step, mc->raw_overlap, raw
+                );
+            }
+        }
+    }
+
+    free_l4(l4);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_sp_sparse_input)
+    uint32_t i, j, s, n, raw;
+    uint32_t idx[92];
+    struct layer *l4 = NULL;
+    struct minicolumn *mc = NULL;
+    struct synapse *synptr = NULL;
+    repr_t *rep = NULL;
+
+    /* configure layer 4 */
+    l4conf.height = 48;
+    l4conf.width = 48;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.02;
+    l4conf.colconf.local_activity = 0.02;
+    l4conf.colconf.column_complexity = 0.0;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+    l4conf.colconf.delta_overlap_max = 0;
+    l4conf.colconf.input_index = 1;
+    /* allocate layer 4 in memory */
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+
+    /* hand over about 1% of the input as an index list */
+    in.sensory_pattern = new_repr(l4conf.height*2, l4conf.width*2);
+    for (n=0; n<92; n++)
+        idx[n] = n*101;
+    ck_assert(!set_active_repr(in.sensory_pattern, idx, 92));
+
+    ck_assert(
+        init_l4(l4,
+            in.sensory_pattern,
+            l4conf.colconf.rec_field_sz
+        )==0
+    );
+
+    ck_assert(!spatial_pooler(l4));
+
+    /* the step packed the bits, and they round trip back to the
+       same index list */
+    ck_assert(!in.sensory_pattern->sparse);
+    for (n=0; n<92; n++)
+        ck_assert(TEST_REPR_BIT_FAST(in.sensory_pattern,
+            idx[n]/in.sensory_pattern->cols,
+            idx[n]%in.sensory_pattern->cols));
+    ck_assert(!unpack_repr(in.sensory_pattern));
+    ck_assert(in.sensory_pattern->num_active == 92);
+    for (n=0; n<92; n++)
+        ck_assert(in.sensory_pattern->active[n] == idx[n]);
+
+    /* overlaps counted from the active bits match a full count.
+       every synapse starts connected and learning only strengthens
+       the ones on active bits, so no permanence check is needed. */
+    for (i=0; i<l4->height; i++) {
+        for (j=0; j<l4->width; j++) {
+            mc = l4->minicolumns[i][j];
+            raw = 0;
+            synptr = mc->proximal_dendrite_segment;
+            for (s=0; s<mc->num_synapses; s++, synptr++)
+                if (TEST_REPR_BIT_FAST(in.sensory_pattern,
+                        synptr->srcy, synptr->srcx))
+                    raw++;
+            ck_assert_msg(
+                mc->raw_overlap == raw,
+                "(%u,%u) raw overlap %u expected %u\n",
+                i, j, mc->raw_overlap, raw
+            );
+        }
+    }
+
+    /* a dense input is only listed when the list is walked */
+    rep = in.sensory_pattern;
+    memset(rep->repr, 0, sizeof(uint32_t)*REPR_WORDS(rep));
+    for (n=0; n<rep->rows*rep->cols; n+=2)
+        SET_REPR_BIT_FAST(rep, n/rep->cols, n%rep->cols);
+    rep->num_active = 0;
+    ck_assert(!spatial_pooler(l4));
+    ck_assert(rep->num_active == 0);
+    memset(rep->repr, 0, sizeof(uint32_t)*REPR_WORDS(rep));
+    for (n=0; n<50; n++)
+        SET_REPR_BIT_FAST(rep, idx[n]/rep->cols, idx[n]%rep->cols);
+    ck_assert(!spatial_pooler(l4));
+    ck_assert(rep->num_active == 50);
+
+    free_l4(l4);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_sp_independent_layers)
+    uint32_t i, j, step;
+    struct layer *a = NULL, *b = NULL;
+    repr_t *ina = NULL, *inb = NULL;
+    unsigned char *masks = NULL;
+
+    /* configure layer 4 */
+    l4conf.height = 32;
+    l4conf.width = 32;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.05;
+    l4conf.colconf.local_activity = 0.02;
+    l4conf.colconf.column_complexity = 0.1;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+    l4conf.colconf.delta_overlap_max = 0;
+    l4conf.colconf.input_index = 0;
+
+    srand(5);
+    ina = new_repr(64, 64);
+    inb = new_repr(64, 64);
+    for (i=0; i<64; i++)
+        for (j=0; j<64; j++) {
+            if (rand()%4 == 0)
+                SET_REPR_BIT_FAST(ina, i, j);
+            if (rand()%2 == 0)
+                SET_REPR_BIT_FAST(inb, i, j);
+        }
+    masks = malloc(l4conf.height*l4conf.width);
+    ck_assert(masks);
+
+    /* a layer stepped on its own is the reference */
+    a = alloc_layer4(l4conf);
+    ck_assert(a);
+    ck_assert(init_l4(a, ina, l4conf.colconf.rec_field_sz)==0);
+    for (step=0; step<3; step++)
+        ck_assert(!spatial_pooler(a));
+    for (i=0; i<a->height; i++)
+        for (j=0; j<a->width; j++)
+            masks[i*a->width+j] = a->minicolumns[i][j]->active_mask;
+    free_l4(a);
+
+    /* the same layer, interleaved with one of another shape,
+       config and input, ends up in the same state */
+    a = alloc_layer4(l4conf);
+    ck_assert(a);
+    l4conf.height = 16;
+    l4conf.width = 24;
+    l4conf.colconf.local_activity = 0.2;
+    l4conf.colconf.input_index = 1;
+    b = alloc_layer4(l4conf);
+    ck_assert(b);
+    ck_assert(init_l4(a, ina, a->state->conf.colconf.rec_field_sz)==0);
+    ck_assert(init_l4(b, inb, l4conf.colconf.rec_field_sz)==0);
+    for (step=0; step<3; step++) {
+        ck_assert(!spatial_pooler(b));
+        ck_assert(!spatial_pooler(a));
+    }
+    for (i=0; i<a->height; i++)
+        for (j=0; j<a->width; j++)
+            ck_assert(masks[i*a->width+j] ==
+                a->minicolumns[i][j]->active_mask);
+    ck_assert(!a->state->index.refs);
+    ck_assert(b->state->index.refs);
+
+    free_l4(a);
+    free_l4(b);
+    free(masks);
+    free_repr(ina);
+    free_repr(inb);
+    l4conf.colconf.input_index = 0;
+END_TEST
+
+START_TEST(test_l4_sp_score_batch)
+    uint32_t i, j, k;
+    struct layer *l4 = NULL;
+    repr_t *inputs[11], *outputs[11];
+
+    /* configure layer 4 */
+    l4conf.height = 32;
+    l4conf.width = 32;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.05;
+    l4conf.colconf.local_activity = 0.02;
+    l4conf.colconf.column_complexity = 0.1;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+    l4conf.colconf.delta_overlap_max = 0;
+    l4conf.colconf.input_index = 0;
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+
+    /* more streams than one block, and not a multiple of it */
+    srand(6);
+    in.sensory_pattern = new_repr(64, 64);
+    for (k=0; k<11; k++) {
+        inputs[k] = new_repr(64, 64);
+        outputs[k] = new_repr(l4conf.height, l4conf.width);
+        for (i=0; i<64; i++)
+            for (j=0; j<64; j++)
+                if (rand()%4 == 0)
+                    SET_REPR_BIT_FAST(inputs[k], i, j);
+    }
+    ck_assert(init_l4(l4, in.sensory_pattern,
+        l4conf.colconf.rec_field_sz)==0);
+
+    /* no neighborhoods before the first step */
+    ck_assert(layer4_score_batch(l4, inputs, outputs, 11));
+    l4->state->learning = 0;
+    ck_assert(copy_repr(in.sensory_pattern, inputs[10])==0);
+    ck_assert(!spatial_pooler(l4));
+
+    ck_assert(!layer4_score_batch(l4, inputs, outputs, 11));
+
+    /* each stream wins what a step on it alone does. the
+       radius is reset, so the step finds the same one again. */
+    for (k=0; k<11; k++) {
+        ck_assert(copy_repr(in.sensory_pattern, inputs[k])==0);
+        l4->inhibition_radius = 0;
+        ck_assert(!spatial_pooler(l4));
+        for (i=0; i<l4->height; i++)
+            for (j=0; j<l4->width; j++)
+                ck_assert_msg(
+                    !MC_ACTIVE_AT(l4->minicolumns[i][j], 0) ==
+                    !TEST_REPR_BIT_FAST(outputs[k], i, j),
+                    "stream %u (%u,%u) differs\n", k, i, j);
+        ck_assert(popcount_repr(outputs[k]) > 0);
+    }
+
+    for (k=0; k<11; k++) {
+        free_repr(inputs[k]);
+        free_repr(outputs[k]);
+    }
+    free_l4(l4);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_sp_replay)
+    uint32_t i, j, k, n;
+    uint32_t idx[32*32];
+    struct layer *l4 = NULL;
+    repr_t *inputs[21], *outputs[21];
+    active_columns_t *ac = NULL;
+
+    /* configure layer 4 */
+    l4conf.height = 32;
+    l4conf.width = 32;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.05;
+    l4conf.colconf.local_activity = 0.02;
+    l4conf.colconf.column_complexity = 0.1;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+    l4conf.colconf.delta_overlap_max = 0;
+    l4conf.colconf.input_index = 0;
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+
+    srand(7);
+    in.sensory_pattern = new_repr(64, 64);
+    for (k=0; k<21; k++) {
+        inputs[k] = new_repr(64, 64);
+        outputs[k] = new_repr(l4conf.height, l4conf.width);
+        for (i=0; i<64; i++)
+            for (j=0; j<64; j++)
+                if (rand()%4 == 0)
+                    SET_REPR_BIT_FAST(inputs[k], i, j);
+    }
+    ck_assert(init_l4(l4, in.sensory_pattern,
+        l4conf.colconf.rec_field_sz)==0);
+    ck_assert(!layer4_replay(l4, inputs, 21));
+    ck_assert(!spatial_pooler(l4));
+
+    /* the steps of every worker land in order, and win what the
+       batch scoring does */
+    ck_assert(!layer4_score_batch(l4, inputs, outputs, 21));
+    ac = layer4_replay(l4, inputs, 21);
+    ck_assert(ac);
+    ck_assert(ac->steps == 21);
+    ck_assert(ac->offsets[0] == 0);
+    for (k=0; k<21; k++) {
+        n = active_bits_repr(outputs[k], idx);
+        ck_assert(n > 0);
+        ck_assert(ac->offsets[k+1] - ac->offsets[k] == n);
+        ck_assert(!memcmp(ac->columns + ac->offsets[k], idx,
+            sizeof(uint32_t)*n));
+    }
+    free(ac->offsets);
+    free(ac->columns);
+    free(ac);
+
+    /* nothing to replay is an empty result */
+    ac = layer4_replay(l4, inputs, 0);
+    ck_assert(ac);
+    ck_assert(ac->steps == 0 && ac->offsets[0] == 0);
+    free(ac->offsets);
+    free(ac->columns);
+    free(ac);
+
+    for (k=0; k<21; k++) {
+        free_repr(inputs[k]);
+        free_repr(outputs[k]);
+    }
+    free_l4(l4);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_sp_active_columns)
+    uint32_t i, j, k, n, step;
+    uint32_t idx[32*32], out[32*32];
+    struct layer *l4 = NULL;
+    repr_t *active = NULL;
+
+    /* configure layer 4 */
+    l4conf.height = 32;
+    l4conf.width = 32;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.05;
+    l4conf.colconf.local_activity = 0.02;
+    l4conf.colconf.column_complexity = 0.1;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+    l4conf.colconf.delta_overlap_max = 0;
+    l4conf.colconf.input_index = 0;
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+    active = l4->state->active;
+
+    srand(8);
+    in.sensory_pattern = new_repr(64, 64);
+    ck_assert(init_l4(l4, in.sensory_pattern,
+        l4conf.colconf.rec_field_sz)==0);
+
+    /* every step leaves only its own winners behind */
+    for (step=0; step<3; step++) {
+        memset(in.sensory_pattern->repr, 0,
+            sizeof(uint32_t)*REPR_WORDS(in.sensory_pattern));
+        for (i=0; i<64; i++)
+            for (j=0; j<64; j++)
+                if (rand()%4 == 0)
+                    SET_REPR_BIT_FAST(in.sensory_pattern, i, j);
+        ck_assert(!spatial_pooler(l4));
+
+        n = 0;
+        for (i=0; i<l4->height; i++) {
+            for (j=0; j<l4->width; j++) {
+                if (MC_ACTIVE_AT(l4->minicolumns[i][j], 0))
+                    idx[n++] = i*l4->width+j;
+                ck_assert(!MC_ACTIVE_AT(l4->minicolumns[i][j], 0) ==
+                    !TEST_REPR_BIT_FAST(active, i, j));
+            }
+        }
+        ck_assert(n > 2);
+        ck_assert(layer4_active_columns(l4, out, 32*32) == n);
+        ck_assert(!memcmp(out, idx, sizeof(uint32_t)*n));
+
+        /* a short buffer gets the first ones, and the count */
+        memset(out, 0xff, sizeof(out));
+        ck_assert(layer4_active_columns(l4, out, 2) == n);
+        ck_assert(out[0] == idx[0] && out[1] == idx[1]);
+        ck_assert(out[2] == 0xffffffff);
+        k = layer4_active_columns(l4, NULL, 0);
+        ck_assert(k == n);
+    }
+
+    free_l4(l4);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_sp_stats)
+    uint32_t i, j, step;
+    uint64_t won = 0, syns = 0;
+    struct layer *l4 = NULL;
+    htm_stats_t *st = NULL;
+
+    /* configure layer 4 */
+    l4conf.height = 32;
+    l4conf.width = 32;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.05;
+    l4conf.colconf.local_activity = 0.02;
+    l4conf.colconf.column_complexity = 0.1;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+    l4conf.colconf.delta_overlap_max = 0;
+    l4conf.colconf.input_index = 0;
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+    st = &l4->state->td[0].stats;
+
+    srand(9);
+    in.sensory_pattern = new_repr(64, 64);
+    ck_assert(init_l4(l4, in.sensory_pattern,
+        l4conf.colconf.rec_field_sz)==0);
+    for (i=0; i<l4->height; i++)
+        for (j=0; j<l4->width; j++)
+            syns += l4->minicolumns[i][j]->num_synapses;
+
+    for (step=0; step<3; step++) {
+        memset(in.sensory_pattern->repr, 0,
+            sizeof(uint32_t)*REPR_WORDS(in.sensory_pattern));
+        for (i=0; i<64; i++)
+            for (j=0; j<64; j++)
+                if (rand()%4 == 0)
+                    SET_REPR_BIT_FAST(in.sensory_pattern, i, j);
+        ck_assert(!spatial_pooler(l4));
+        won += layer4_active_columns(l4, NULL, 0);
+    }
+
+#if HTM_STATS
+    /* every minicolumn got its first neighbor list */
+    ck_assert(st->neighbors_rebuilt >= 32*32);
+    ck_assert(st->columns_active == won);
+    ck_assert(st->columns_learned == won);
+    /* the radius alone reads every synapse every step */
+    ck_assert(st->synapses_visited >= 3*syns);
+    ck_assert(st->cycles[HTM_PHASE_INHIB_RADIUS] > 0);
+    ck_assert(st->cycles[HTM_PHASE_OVERLAP] > 0);
+    ck_assert(st->cycles[HTM_PHASE_INHIBITION] > 0);
+    ck_assert(st->cycles[HTM_PHASE_LEARNING] > 0);
+    ck_assert(st->cycles[HTM_PHASE_NEIGHBORS] > 0);
+    ck_assert(st->cycles[HTM_PHASE_TM] == 0);
+#else
+    ck_assert(st->columns_active == 0 && won > 0 && syns > 0);
+#endif
+
+    free_l4(l4);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+/* spans in the trace at path, and how many of them are named
+   name */
+static void
+count_spans (const char *path, const char *name,
+    uint32_t *spans, uint32_t *named)
+{
+    char line[256], tag[64];
+    FILE *f = fopen(path, "r");
+
+    ck_assert(f);
+    snprintf(tag, sizeof(tag), "{\"name\":\"%s\"", name);
+    *spans = *named = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (!strstr(line, "\"ph\":\"X\""))
+            continue;
+        (*spans)++;
+        *named += strstr(line, tag) != NULL;
+    }
+    ck_assert(fclose(f) == 0);
+}
+
+START_TEST(test_l4_sp_trace)
+    uint32_t i, j, step, spans, named;
+    struct layer *l4 = NULL;
+    struct tracer *tr = NULL;
+    char path[] = "/tmp/test_l4_sp_traceXXXXXX";
+    int fd;
+
+    /* configure layer 4 */
+    l4conf.height = 32;
+    l4conf.width = 32;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.05;
+    l4conf.colconf.local_activity = 0.02;
+    l4conf.colconf.column_complexity = 0.1;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+    l4conf.colconf.delta_overlap_max = 0;
+    l4conf.colconf.input_index = 0;
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+
+    srand(10);
+    in.sensory_pattern = new_repr(64, 64);
+    ck_assert(init_l4(l4, in.sensory_pattern,
+        l4conf.colconf.rec_field_sz)==0);
+    fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    close(fd);
+
+    /* three phases a step, on the stepping thread and on every
+       layer thread. the small buffers fill up in the second
+       round. */
+    for (i=0; i<2; i++) {
+        tr = alloc_tracer(l4->state->num_threads, 6);
+        ck_assert(tr);
+        trace_layer4(l4, tr);
+        for (step=0; step<2+i; step++) {
+            memset(in.sensory_pattern->repr, 0,
+                sizeof(uint32_t)*REPR_WORDS(in.sensory_pattern));
+            for (j=0; j<64*64/4; j++)
+                SET_REPR_BIT_FAST(in.sensory_pattern,
+                    rand()%64, rand()%64);
+            ck_assert(!spatial_pooler(l4));
+        }
+        trace_layer4(l4, NULL);
+        ck_assert(write_trace(tr, path) == 0);
+        count_spans(path, "overlap", &spans, &named);
+        ck_assert(spans == (l4->state->num_threads+1)*6);
+        ck_assert(named == (l4->state->num_threads+1)*2);
+        ck_assert(tr->bufs[0].dropped == 3*i);
+        for (j=0; j<tr->num_bufs; j++)
+            ck_assert(tr->bufs[j].events[0].end >=
+                tr->bufs[j].events[0].begin);
+        free_tracer(tr);
+    }
+
+    unlink(path);
+    free_l4(l4);
+    free_repr(in.sensory_pattern);
+END_TEST
+
+START_TEST(test_l4_sp_state_view)
+    uint32_t i, j, m, s;
+    uint64_t k;
+    struct layer *l4 = NULL;
+    struct minicolumn *mc = NULL;
+    state_view_t view;
+
+    /* configure layer 4 */
+    l4conf.height = 24;
+    l4conf.width = 40;
+    l4conf.cells_per_col = 4;
+    l4conf.sensorimotor = 1;
+    l4conf.loc_patt_sz = 1024;
+    l4conf.loc_patt_bits = 8;
+    l4conf.colconf.rec_field_sz = 0.05;
+    l4conf.colconf.local_activity = 0.02;
+    l4conf.colconf.column_complexity = 0.1;
+    l4conf.colconf.high_tier = 1;
+    l4conf.colconf.activity_cycle_window = 100;
+    l4conf.colconf.delta_overlap_max = 0;
+    l4conf.colconf.input_index = 0;
+    l4 = alloc_layer4(l4conf);
+    ck_assert(l4);
+
+    srand(9);
+    in.sensory_pattern = new_repr(48, 80);
+    for (i=0; i<48; i++)
+        for (j=0; j<80; j++)
+            if (rand()%4 == 0)
+                SET_REPR_BIT_FAST(in.sensory_pattern, i, j);
+    ck_assert(layer4_state_view(l4, &view));
+    ck_assert(init_l4(l4, in.sensory_pattern,
+        l4conf.colconf.rec_field_sz)==0);
+    ck_assert(!layer4_state_view(l4, &view));
+    ck_assert(!spatial_pooler(l4));
+
+    /* the views read the live state, learning included */
+    ck_assert(view.overlaps.height == 24 && view.overlaps.width == 40);
+    ck_assert(view.syn_offsets[0] == 0);
+    k = 0;
+    for (i=0; i<l4->height; i++) {
+        for (j=0; j<l4->width; j++) {
+            mc = l4->minicolumns[i][j];
+            m = i*l4->width+j;
+            ck_assert(*(const uint32_t *)((const char *)view.overlaps.base +
+                m*view.overlaps.stride) == mc->overlap);
+            ck_assert(*(const uint32_t *)((const char *)view.raw_overlaps.base +
+                m*view.raw_overlaps.stride) == mc->raw_overlap);
+            ck_assert(*(const float *)((const char *)view.boosts.base +
+                m*view.boosts.stride) == mc->boost);
+            ck_assert(!TEST_REPR_BIT_FAST(view.active, i, j) ==
+                !MC_ACTIVE_AT(mc, 0));
+            ck_assert(view.syn_offsets[m+1] - view.syn_offsets[m] ==
+                mc->num_synapses);
+            for (s=0; s<mc->num_synapses; s++, k++)
+                ck_assert(*(const float *)((const char *)view.perms +
+                    k*view.perm_stride) ==
+                    mc->proximal_dendrite_segment[s].perm);
+        }
+    }
+    ck_assert(k == view.num_synapses);
+
+    free_l4(l4);
     free_repr(in.sensory_pattern);
 END_TEST
 
@@ -148,6 +822,15 @@ test_suite(void)
     tcase_set_timeout(tc_core, 60);
     //tcase_add_test(tc_core, test_l4_sp_basic_sparsity_100);
     tcase_add_test(tc_core, test_l4_sp_basic_sparsity_2);
+    tcase_add_test(tc_core, test_l4_sp_incremental_overlap);
+    tcase_add_test(tc_core, test_l4_sp_sparse_input);
+    tcase_add_test(tc_core, test_l4_sp_independent_layers);
+    tcase_add_test(tc_core, test_l4_sp_score_batch);
+    tcase_add_test(tc_core, test_l4_sp_replay);
+    tcase_add_test(tc_core, test_l4_sp_active_columns);
+    tcase_add_test(tc_core, test_l4_sp_state_view);
+    tcase_add_test(tc_core, test_l4_sp_stats);
+    tcase_add_test(tc_core, test_l4_sp_trace);
     suite_add_tcase(s, tc_core);
 
     return s;
@@ -0,0 +1,265 @@
+/* tests of layer 4 on several threads. a layer split between
+   threads, pinned or not, must agree with one on a single thread
+   on every synapse, overlap and winner after every step, and on
+   the scores of a batch. */
+
+/* the replay code needs POSIX, and the CPU sets GNU */
+#define _GNU_SOURCE 1
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+#include "conf.h"
+#include "repr.h"
+#include "repr.c"
+#include "layer4_mgmt.c"
+#include "layer4_algs.c"
+
+/* the replay workers are started through spy_create, which
+   notes the CPUs each of them may run on */
+#define MAX_SPIED 64
+
+struct spied
+{
+    void *(*fn)(void *);
+    void *arg;
+};
+
+static struct spied spied[MAX_SPIED];
+static int32_t spied_cpus[MAX_SPIED];
+static uint32_t num_spied;
+
+static void*
+spy_start (void *arg)
+{
+    struct spied *sp = arg;
+#ifdef __linux__
+    cpu_set_t set;
+
+    if (!pthread_getaffinity_np(pthread_self(), sizeof(set), &set))
+        spied_cpus[sp - spied] = CPU_COUNT(&set);
+#endif
+
+    return sp->fn(sp->arg);
+}
+
+static int
+spy_create (
+    pthread_t *thread,
+    const pthread_attr_t *attr,
+    void *(*fn)(void *),
+    void *arg
+) {
+    if (num_spied == MAX_SPIED)
+        return pthread_create(thread, attr, fn, arg);
+    spied[num_spied].fn = fn;
+    spied[num_spied].arg = arg;
+    spied_cpus[num_spied] = -1;
+
+    return pthread_create(thread, attr, spy_start, &spied[num_spied++]);
+}
+
+#define pthread_create spy_create
+#include "layer4_replay.c"
+#undef pthread_create
+#include "affinity.h"
+#include "l4_helpers.h"
+
+#define STEPS 12
+#define BATCH 5
+
+/* thread counts that split the rows evenly and not */
+static const uint32_t thread_counts[] = {2, 3, 5, 16};
+static const char *affinities[] = {NULL, "compact", "spread"};
+
+static struct layer*
+new_layer (repr_t *input, uint32_t threads, const char *affinity)
+{
+    struct layer *l4 = alloc_layer4(base_l4_conf(16, 12, 0.1, 11));
+
+    ck_assert(l4 != NULL);
+    ck_assert(layer4_set_threads(l4, threads, affinity) == 0);
+    ck_assert(init_l4(l4, input, 0.1) == 0);
+
+    return l4;
+}
+
+/* the rows of the threads follow each other and cover the layer */
+static void
+assert_partition (struct layer *l4)
+{
+    struct layer_state *st = l4->state;
+    uint32_t t, row = 0;
+
+    for (t=0; t<st->num_threads; t++) {
+        ck_assert(st->td[t].row_start == row);
+        ck_assert(st->td[t].row_num >= l4->height/st->num_threads);
+        row += st->td[t].row_num;
+    }
+    ck_assert(row == l4->height);
+}
+
+START_TEST(test_l4_threads_diff)
+    struct layer *one = NULL, *many = NULL;
+    repr_t *input = NULL, *batch[BATCH], *out_one[BATCH], *out_many[BATCH];
+    uint64_t rng = 0x5eed;
+    uint32_t n, a, i, b, w;
+
+    ck_assert((input = new_repr(40, 40)) != NULL);
+    for (b=0; b<BATCH; b++) {
+        ck_assert((batch[b] = new_repr(40, 40)) != NULL);
+        ck_assert((out_one[b] = new_repr(16, 12)) != NULL);
+        ck_assert((out_many[b] = new_repr(16, 12)) != NULL);
+    }
+
+    for (n=0; n<sizeof(thread_counts)/sizeof(thread_counts[0]); n++) {
+        for (a=0; a<sizeof(affinities)/sizeof(affinities[0]); a++) {
+            random_input(input, &rng);
+            one = new_layer(input, 1, NULL);
+            many = new_layer(input, thread_counts[n], affinities[a]);
+            ck_assert(many->state->num_threads == thread_counts[n]);
+            assert_partition(many);
+            assert_same_layers(one, many);
+
+            for (i=0; i<STEPS; i++) {
+                random_input(input, &rng);
+                ck_assert(spatial_pooler(one) == 0);
+                ck_assert(spatial_pooler(many) == 0);
+                assert_same_layers(one, many);
+            }
+
+            for (b=0; b<BATCH; b++)
+                random_input(batch[b], &rng);
+            ck_assert(layer4_score_batch(one, batch, out_one, BATCH) == 0);
+            ck_assert(layer4_score_batch(many, batch, out_many, BATCH) == 0);
+            for (b=0; b<BATCH; b++)
+                for (w=0; w<REPR_WORDS(out_one[b]); w++)
+                    ck_assert(out_one[b]->repr[w] == out_many[b]->repr[w]);
+
+            free_l4(one);
+            free_l4(many);
+        }
+    }
+
+    for (b=0; b<BATCH; b++) {
+        free_repr(batch[b]);
+        free_repr(out_one[b]);
+        free_repr(out_many[b]);
+    }
+    free_repr(input);
+END_TEST
+
+START_TEST(test_l4_threads_limits)
+    struct layer *l4 = NULL;
+
+    ck_assert((l4 = alloc_layer4(base_l4_conf(16, 12, 0.1, 11))) != NULL);
+    ck_assert(l4->state->num_threads == 1);
+    /* one row a thread at the most */
+    ck_assert(layer4_set_threads(l4, 17, NULL) == 1);
+    ck_assert(layer4_set_threads(l4, MAX_THREADS+1, NULL) == 1);
+    ck_assert(layer4_set_threads(l4, 2, "no such cpus") == 1);
+    ck_assert(l4->state->num_threads == 1);
+    ck_assert(layer4_set_threads(l4, 16, "false") == 0);
+    ck_assert(l4->state->num_threads == 16);
+    assert_partition(l4);
+    /* unset is a single thread */
+    ck_assert(layer4_set_threads(l4, 0, NULL) == 0);
+    ck_assert(l4->state->num_threads == 1);
+    assert_partition(l4);
+    free_l4(l4);
+END_TEST
+
+/* a replay spreads over every core, whatever the layer's own
+   threads are pinned to */
+START_TEST(test_l4_threads_replay)
+    struct layer *l4 = NULL;
+    repr_t *input = NULL, *steps[4*L4_BATCH];
+    active_columns_t *ac = NULL;
+    uint64_t rng = 0x7e91;
+    int32_t cpus = 1;
+    uint32_t k;
+#ifdef __linux__
+    cpu_set_t set;
+
+    ck_assert(sched_getaffinity(0, sizeof(set), &set) == 0);
+    cpus = CPU_COUNT(&set);
+#endif
+
+    ck_assert((input = new_repr(40, 40)) != NULL);
+    random_input(input, &rng);
+    l4 = new_layer(input, 1, "compact");
+    ck_assert(spatial_pooler(l4) == 0);
+    for (k=0; k<4*L4_BATCH; k++) {
+        ck_assert((steps[k] = new_repr(40, 40)) != NULL);
+        random_input(steps[k], &rng);
+    }
+
+    num_spied = 0;
+    ck_assert((ac = layer4_replay(l4, steps, 4*L4_BATCH)) != NULL);
+    ck_assert(num_spied >= 1);
+    for (k=0; k<num_spied; k++)
+        ck_assert_msg(spied_cpus[k] == cpus,
+            "replay worker %u may run on %d of %d CPUs",
+            k, spied_cpus[k], cpus);
+
+    free_active_columns(ac);
+    for (k=0; k<4*L4_BATCH; k++)
+        free_repr(steps[k]);
+    free_l4(l4);
+    free_repr(input);
+END_TEST
+
+START_TEST(test_cpu_list)
+    int32_t cpus[8];
+
+    ck_assert(parse_cpu_list("0", cpus, 8) == 1);
+    ck_assert(cpus[0] == 0);
+    ck_assert(parse_cpu_list("0-3,8,10-11\n", cpus, 8) == 7);
+    ck_assert(cpus[3] == 3);
+    ck_assert(cpus[4] == 8);
+    ck_assert(cpus[6] == 11);
+    ck_assert(parse_cpu_list("", cpus, 8) == 0);
+    /* too many for cpus */
+    ck_assert(parse_cpu_list("0-8", cpus, 8) == -1);
+    /* malformed */
+    ck_assert(parse_cpu_list("3-1", cpus, 8) == -1);
+    ck_assert(parse_cpu_list("1,,2", cpus, 8) == -1);
+    ck_assert(parse_cpu_list("1;2", cpus, 8) == -1);
+    ck_assert(parse_cpu_list("-1", cpus, 8) == -1);
+    /* no affinity is no CPUs */
+    ck_assert(affinity_cpus(NULL, cpus, 8) == 0);
+    ck_assert(affinity_cpus("false", cpus, 8) == 0);
+END_TEST
+
+static Suite *
+test_suite(void)
+{
+    Suite *s = suite_create("Layer 4 Thread Tests");
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_test(tc_core, test_l4_threads_diff);
+    tcase_add_test(tc_core, test_l4_threads_limits);
+    tcase_add_test(tc_core, test_l4_threads_replay);
+    tcase_add_test(tc_core, test_cpu_list);
+    tcase_set_timeout(tc_core, 60);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = test_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
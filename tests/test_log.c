@@ -0,0 +1,131 @@
+/* pthreads are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <check.h>
+
+#include "htm.h"
+#include "utils.h"
+
+#define NUM_LOGGERS 4
+/* short lived threads may all end up on the same ring, which
+   holds every round of them, so nothing is dropped even if the
+   drainer falls behind */
+#define ROUNDS 3
+#define MSGS (LOG_RING_SZ/(4*NUM_LOGGERS))
+
+static FILE *out;
+
+static void*
+log_msgs (void *arg)
+{
+    uint32_t t = *(uint32_t *)arg, m;
+
+    for (m=0; m<MSGS; m++)
+        INFO("logger %u message %u\n", t, m);
+
+    return NULL;
+}
+
+/* every message of every thread made it out once. the rings are
+   drained one after the other, so only the messages of a single
+   round are sure to come out in the order they were logged. */
+static void
+check_output (uint32_t rounds)
+{
+    char line[512], *p = NULL;
+    uint32_t next[NUM_LOGGERS] = {0}, t, m, lines = 0;
+
+    rewind(out);
+    while (fgets(line, sizeof(line), out)) {
+        ck_assert(strstr(line, "[INFO - "));
+        ck_assert((p = strstr(line, "logger ")));
+        ck_assert(sscanf(p, "logger %u message %u", &t, &m) == 2);
+        ck_assert(t < NUM_LOGGERS);
+        if (rounds == 1)
+            ck_assert(m == next[t]);
+        next[t]++;
+        lines++;
+    }
+    for (t=0; t<NUM_LOGGERS; t++)
+        ck_assert(next[t] == rounds*MSGS);
+    ck_assert(lines == rounds*NUM_LOGGERS*MSGS);
+}
+
+static void
+run_loggers (void)
+{
+    pthread_t threads[NUM_LOGGERS];
+    uint32_t ids[NUM_LOGGERS], t;
+
+    for (t=0; t<NUM_LOGGERS; t++) {
+        ids[t] = t;
+        ck_assert(pthread_create(&threads[t], NULL, log_msgs,
+            &ids[t]) == 0);
+    }
+    for (t=0; t<NUM_LOGGERS; t++)
+        pthread_join(threads[t], NULL);
+}
+
+static void
+setup (void)
+{
+    out = tmpfile();
+    ck_assert(out);
+}
+
+static void
+teardown (void)
+{
+    fclose(out);
+}
+
+START_TEST(test_log_async)
+    ck_assert(htm_start_async_log(out) == 0);
+    run_loggers();
+    htm_stop_async_log();
+    check_output(1);
+END_TEST
+
+START_TEST(test_log_ring_reuse)
+    uint32_t r;
+
+    /* threads of later rounds take over the rings of the
+       earlier ones, backlog included */
+    ck_assert(htm_start_async_log(out) == 0);
+    for (r=0; r<ROUNDS; r++)
+        run_loggers();
+    htm_stop_async_log();
+    check_output(ROUNDS);
+END_TEST
+
+static Suite *
+test_suite(void)
+{
+    Suite *s = suite_create("Log Tests");
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_log_async);
+    tcase_add_test(tc_core, test_log_ring_reuse);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = test_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,231 @@
+/* tests of the pipelined codec input. the ring hands the
+   patterns over in the order the codec made them, stops at the
+   first one that failed, and neither side burns a core while it
+   waits on the other. */
+
+/* mkstemp, setenv and nanosleep are POSIX */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <check.h>
+
+#include "htm.h"
+#include "pipeline.h"
+
+#define ROWS 8
+#define COLS 64
+
+/* the codec's own pattern, which it reuses every call */
+static repr_t *made;
+/* calls the codec took, and the call that fails, 0 for none */
+static uint32_t calls, fail_at;
+/* how long every call takes */
+static long delay_ms;
+
+static void
+sleep_ms (long ms)
+{
+    struct timespec ts = {ms/1000, ms%1000*1000000};
+
+    nanosleep(&ts, NULL);
+}
+
+/* pattern k has bit k mod the size set, so the order shows */
+static input_patterns*
+counting_codec (void)
+{
+    input_patterns *out = NULL;
+    uint32_t k = __atomic_fetch_add(&calls, 1, __ATOMIC_SEQ_CST);
+
+    if (delay_ms)
+        sleep_ms(delay_ms);
+    if (fail_at && k+1 == fail_at)
+        return NULL;
+    memset(made->repr, 0, sizeof(uint32_t)*REPR_WORDS(made));
+    SET_REPR_BIT_FAST(made, k % (ROWS*COLS) / COLS, k % COLS);
+    made->sparse = 0;
+    if (!(out = malloc(sizeof(input_patterns))))
+        return NULL;
+    memset(out, 0, sizeof(input_patterns));
+    out->sensory_pattern = made;
+
+    return out;
+}
+
+static void
+setup (void)
+{
+    made = new_repr(ROWS, COLS);
+    ck_assert(made != NULL);
+    calls = 0;
+    fail_at = 0;
+    delay_ms = 0;
+}
+
+static void
+teardown (void)
+{
+    free_repr(made);
+}
+
+/* CPU time of the process, in ms */
+static double
+cpu_ms (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+START_TEST(test_pipeline_order)
+    struct input_ring ring;
+    repr_t *live = new_repr(ROWS, COLS);
+    uint32_t k;
+
+    memset(&ring, 0, sizeof(ring));
+    ck_assert(start_input_pipeline(&ring, counting_codec, live) == 0);
+    for (k=0; k<100; k++) {
+        ck_assert(next_pipelined_input(&ring, live) == 0);
+        ck_assert(popcount_repr(live) == 1);
+        ck_assert(TEST_REPR_BIT_FAST(live, k / COLS, k % COLS));
+    }
+    stop_input_pipeline(&ring);
+    ck_assert(!ring.running);
+    free_repr(live);
+END_TEST
+
+START_TEST(test_pipeline_failure)
+    struct input_ring ring;
+    repr_t *live = new_repr(ROWS, COLS);
+    uint32_t k;
+
+    memset(&ring, 0, sizeof(ring));
+    fail_at = 4;
+    ck_assert(start_input_pipeline(&ring, counting_codec, live) == 0);
+    for (k=0; k<3; k++)
+        ck_assert(next_pipelined_input(&ring, live) == 0);
+    /* the failure sticks, and the producer made nothing after */
+    ck_assert(next_pipelined_input(&ring, live) == 1);
+    ck_assert(next_pipelined_input(&ring, live) == 1);
+    ck_assert(calls == 4);
+    ck_assert(TEST_REPR_BIT_FAST(live, 0, 2));
+    stop_input_pipeline(&ring);
+    free_repr(live);
+
+    /* patterns of other dimensions fail the same way */
+    live = new_repr(ROWS, COLS/2);
+    memset(&ring, 0, sizeof(ring));
+    ck_assert(start_input_pipeline(&ring, counting_codec, live) == 0);
+    ck_assert(next_pipelined_input(&ring, live) == 1);
+    stop_input_pipeline(&ring);
+    free_repr(live);
+END_TEST
+
+/* a full ring and a slow codec both wait asleep */
+START_TEST(test_pipeline_blocked)
+    struct input_ring ring;
+    repr_t *live = new_repr(ROWS, COLS);
+    double t0;
+
+    memset(&ring, 0, sizeof(ring));
+    ck_assert(start_input_pipeline(&ring, counting_codec, live) == 0);
+    sleep_ms(50);
+    ck_assert(calls == INPUT_RING_SZ);
+    t0 = cpu_ms();
+    sleep_ms(200);
+    ck_assert(calls == INPUT_RING_SZ);
+    ck_assert_msg(cpu_ms() - t0 < 50, "producer spun %.1f ms",
+        cpu_ms() - t0);
+    /* stopping wakes it */
+    stop_input_pipeline(&ring);
+
+    memset(&ring, 0, sizeof(ring));
+    delay_ms = 200;
+    ck_assert(start_input_pipeline(&ring, counting_codec, live) == 0);
+    t0 = cpu_ms();
+    ck_assert(next_pipelined_input(&ring, live) == 0);
+    ck_assert_msg(cpu_ms() - t0 < 50, "consumer spun %.1f ms",
+        cpu_ms() - t0);
+    stop_input_pipeline(&ring);
+    free_repr(live);
+END_TEST
+
+/* an htm with pipelined input, freed while its producer waits
+   on a full ring. the htm frees the containers the codec hands
+   out, and keeps a copy of the first pattern. */
+START_TEST(test_pipeline_htm)
+    char path[] = "/tmp/test_pipelineXXXXXX";
+    struct htm_ctx *ctx = NULL;
+    repr_t *in = NULL;
+    FILE *f = NULL;
+    uint32_t k;
+    int fd;
+
+    ck_assert((fd = mkstemp(path)) >= 0);
+    ck_assert((f = fdopen(fd, "w")) != NULL);
+    fprintf(f,
+        "<?xml version=\"1.0\" encoding=\"utf-8\"?>\n"
+        "<Htm target=\"none\" allow_boosting=\"true\" pipelined=\"true\">\n"
+        "    <Layer4 height=\"4\" width=\"4\" cells_per_col=\"4\"\n"
+        "        sensorimotor=\"true\" loc_patt_sz=\"1024\"\n"
+        "        loc_patt_bits=\"8\">\n"
+        "        <Minicolumns rec_field_sz=\"0.1\" local_activity=\"0.2\"\n"
+        "            column_complexity=\"0\" high_tier=\"true\"\n"
+        "            activity_cycle_window=\"100\">\n"
+        "        </Minicolumns>\n"
+        "    </Layer4>\n"
+        "</Htm>\n");
+    ck_assert(fclose(f) == 0);
+    ck_assert(setenv("HTM_CONF_PATH", path, 1) == 0);
+
+    ck_assert((ctx = init_htm(counting_codec)) != NULL);
+    in = get_htm_input_patterns(ctx)->sensory_pattern;
+    ck_assert(TEST_REPR_BIT_FAST(in, 0, 0));
+    for (k=1; k<4; k++) {
+        ck_assert(run_cortical_algorithm(ctx) == 0);
+        ck_assert(TEST_REPR_BIT_FAST(in, k / COLS, k % COLS));
+    }
+    sleep_ms(50);
+    ck_assert(calls == 4 + INPUT_RING_SZ);
+    free_htm(ctx);
+
+    unlink(path);
+END_TEST
+
+static Suite *
+test_suite(void)
+{
+    Suite *s = suite_create("Input Pipeline Tests");
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_pipeline_order);
+    tcase_add_test(tc_core, test_pipeline_failure);
+    tcase_add_test(tc_core, test_pipeline_blocked);
+    tcase_add_test(tc_core, test_pipeline_htm);
+    tcase_set_timeout(tc_core, 30);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = test_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
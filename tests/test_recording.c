@@ -0,0 +1,251 @@
+/* mkstemp and truncate are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <check.h>
+
+#include "htm.h"
+#include "recording.h"
+
+#define ROWS 19
+#define COLS 70
+#define LOC_ROWS 1
+#define LOC_COLS 64
+#define STEPS 6
+
+static char path[] = "/tmp/test_recordingXXXXXX";
+static repr_t *steps[STEPS], *locs[STEPS];
+static input_patterns ip;
+static uint32_t next_step;
+
+/* even steps are sparse enough for indices, odd ones go dense.
+   the location patterns are given as index lists. */
+static void
+setup (void)
+{
+    uint32_t s, i, idx[8];
+    int fd;
+
+    srand(31);
+    for (s=0; s<STEPS; s++) {
+        steps[s] = new_repr(ROWS, COLS);
+        for (i=0; i<ROWS*COLS; i++)
+            if (rand() % (s & 1 ? 2 : 40) == 0)
+                SET_REPR_BIT_FAST(steps[s], i / COLS, i % COLS);
+        locs[s] = new_repr(LOC_ROWS, LOC_COLS);
+        for (i=0; i<8; i++)
+            idx[i] = i*8 + s;
+        ck_assert(set_active_repr(locs[s], idx, 8) == 0);
+    }
+    next_step = 0;
+
+    fd = mkstemp(path);
+    ck_assert(fd >= 0);
+    close(fd);
+}
+
+static void
+teardown (void)
+{
+    uint32_t s;
+
+    for (s=0; s<STEPS; s++) {
+        free_repr(steps[s]);
+        free_repr(locs[s]);
+    }
+    unlink(path);
+    strcpy(path, "/tmp/test_recordingXXXXXX");
+}
+
+static void
+assert_same (repr_t *a, repr_t *b)
+{
+    uint32_t i;
+
+    ck_assert(a->rows == b->rows && a->cols == b->cols);
+    ck_assert(sync_repr(a) == 0 && sync_repr(b) == 0);
+    for (i=0; i<a->rows*a->cols; i++)
+        ck_assert(!TEST_REPR_BIT_FAST(a, i / a->cols, i % a->cols) ==
+            !TEST_REPR_BIT_FAST(b, i / b->cols, i % b->cols));
+}
+
+static void
+record_steps (void)
+{
+    struct input_recorder rec;
+    uint32_t s;
+
+    ck_assert(open_recorder(&rec, path) == 0);
+    for (s=0; s<STEPS; s++) {
+        ip.sensory_pattern = steps[s];
+        ip.location_pattern = locs[s];
+        ck_assert(record_patterns(&rec, &ip) == 0);
+    }
+    ck_assert(close_recorder(&rec) == 0);
+}
+
+/* hands out the steps in turn, like an encoder would */
+static input_patterns*
+step_codec (void)
+{
+    input_patterns *out = NULL;
+
+    if (next_step == STEPS)
+        return NULL;
+    out = malloc(sizeof(input_patterns));
+    out->sensory_pattern = steps[next_step];
+    out->location_pattern = locs[next_step];
+    next_step++;
+
+    return out;
+}
+
+START_TEST(test_recording_roundtrip)
+    struct input_player pl;
+    uint32_t s, pass;
+
+    record_steps();
+    ck_assert(open_player(&pl, path) == 0);
+    ck_assert(pl.hdr.sensory_rows == ROWS && pl.hdr.sensory_cols == COLS);
+    ck_assert(pl.hdr.location_rows == LOC_ROWS);
+    for (pass=0; pass<2; pass++) {
+        for (s=0; s<STEPS; s++) {
+            ck_assert(play_patterns(&pl) == 0);
+            assert_same(pl.ip.sensory_pattern, steps[s]);
+            assert_same(pl.ip.location_pattern, locs[s]);
+        }
+        ck_assert(play_patterns(&pl) == 1);
+        ck_assert(pl.steps == STEPS);
+        rewind_player(&pl);
+    }
+    close_player(&pl);
+END_TEST
+
+START_TEST(test_recording_truncated)
+    struct input_player pl;
+    struct stat sb;
+    uint32_t s;
+
+    record_steps();
+    /* cut into the last record */
+    ck_assert(stat(path, &sb) == 0);
+    ck_assert(truncate(path, sb.st_size - 4) == 0);
+    ck_assert(open_player(&pl, path) == 0);
+    for (s=0; s<STEPS && play_patterns(&pl) == 0; s++)
+        assert_same(pl.ip.sensory_pattern, steps[s]);
+    ck_assert(s == STEPS-1);
+    ck_assert(play_patterns(&pl) == 1);
+    close_player(&pl);
+
+    /* not a recording at all */
+    ck_assert(truncate(path, 4) == 0);
+    ck_assert(open_player(&pl, path) == 1);
+END_TEST
+
+/* overwrite an int of the recording at off */
+static void
+poke_recording (long off, uint32_t v)
+{
+    FILE *f = fopen(path, "r+b");
+
+    ck_assert(f);
+    ck_assert(fseek(f, off, SEEK_SET) == 0);
+    ck_assert(fwrite(&v, sizeof(v), 1, f) == 1);
+    ck_assert(fclose(f) == 0);
+}
+
+START_TEST(test_recording_corrupt)
+    struct input_player pl;
+    uint32_t n;
+    long first = sizeof(struct rec_header), dense;
+
+    /* the first sensory pattern is an index list, the second
+       the bit array */
+    n = popcount_repr(steps[0]);
+    ck_assert(n > 1);
+    dense = first + 4*(1+n) + 4*(1+8) + 4;
+
+    /* an index past the pattern */
+    record_steps();
+    poke_recording(first + 4*n, ROWS*COLS);
+    ck_assert(open_player(&pl, path) == 0);
+    ck_assert(play_patterns(&pl) == 1);
+    close_player(&pl);
+
+    /* indices out of order */
+    record_steps();
+    poke_recording(first + 4*2, 0);
+    ck_assert(open_player(&pl, path) == 0);
+    ck_assert(play_patterns(&pl) == 1);
+    close_player(&pl);
+
+    /* a bit in the padding of a row */
+    record_steps();
+    poke_recording(dense + 4*(ROW_STRIDE(COLS)-1), 1);
+    ck_assert(open_player(&pl, path) == 0);
+    ck_assert(play_patterns(&pl) == 0);
+    ck_assert(play_patterns(&pl) == 1);
+    close_player(&pl);
+END_TEST
+
+START_TEST(test_recording_codecs)
+    input_patterns *got = NULL;
+    uint32_t s;
+
+    ck_assert(htm_start_recording(step_codec, path) == 0);
+    ck_assert(htm_start_recording(step_codec, path) == 1);
+    while ((got = htm_recording_codec()))
+        free(got);
+    ck_assert(htm_stop_recording() == 0);
+
+    ck_assert(htm_start_playback(path, 1) == 0);
+    /* one pass, then around again */
+    for (s=0; s<2*STEPS; s++) {
+        got = htm_playback_codec();
+        ck_assert(got != NULL);
+        assert_same(got->sensory_pattern, steps[s % STEPS]);
+        assert_same(got->location_pattern, locs[s % STEPS]);
+        free(got);
+    }
+    htm_stop_playback();
+
+    ck_assert(htm_start_playback(path, 0) == 0);
+    for (s=0; s<STEPS; s++)
+        free(htm_playback_codec());
+    ck_assert(htm_playback_codec() == NULL);
+    htm_stop_playback();
+END_TEST
+
+static Suite *
+test_suite(void)
+{
+    Suite *s = suite_create("Recording Tests");
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_recording_roundtrip);
+    tcase_add_test(tc_core, test_recording_truncated);
+    tcase_add_test(tc_core, test_recording_corrupt);
+    tcase_add_test(tc_core, test_recording_codecs);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = test_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
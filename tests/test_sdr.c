@@ -0,0 +1,288 @@
+
+/* setenv is POSIX */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <check.h>
+
+#include "repr.h"
+#include "sdr.h"
+#include "cpu.h"
+
+/* odd dimensions, so the vector loops leave a scalar tail */
+#define ROWS 37
+#define COLS 91
+
+static repr_t *a, *b, *dst;
+
+static void
+random_repr (repr_t *rep, uint32_t one_in)
+{
+    uint32_t i, j;
+
+    for (i=0; i<rep->rows; i++)
+        for (j=0; j<rep->cols; j++)
+            if (rand()%one_in == 0)
+                SET_REPR_BIT_FAST(rep, i, j);
+}
+
+static void
+setup (void)
+{
+    srand(29);
+    a = new_repr(ROWS, COLS);
+    b = new_repr(ROWS, COLS);
+    dst = new_repr(ROWS, COLS);
+    random_repr(a, 3);
+    random_repr(b, 5);
+}
+
+static void
+teardown (void)
+{
+    free_repr(a);
+    free_repr(b);
+    free_repr(dst);
+}
+
+START_TEST(test_sdr_counts)
+    uint32_t i, j, pa = 0, ov = 0, hd = 0;
+    char ba, bb;
+
+    for (i=0; i<ROWS; i++) {
+        for (j=0; j<COLS; j++) {
+            ba = TEST_REPR_BIT_FAST(a, i, j) ? 1 : 0;
+            bb = TEST_REPR_BIT_FAST(b, i, j) ? 1 : 0;
+            pa += ba;
+            ov += ba & bb;
+            hd += ba ^ bb;
+        }
+    }
+
+    ck_assert(popcount_repr(a) == pa);
+    ck_assert(overlap_repr(a, b) == ov);
+    ck_assert(hamming_repr(a, b) == hd);
+    ck_assert(hamming_repr(a, a) == 0);
+END_TEST
+
+/* the four operations against the bits one at a time, with
+   whatever kernels are bound */
+static void
+check_bitwise (void)
+{
+    uint32_t i, j;
+    char ba, bb, bd;
+
+    and_repr(dst, a, b);
+    for (i=0; i<ROWS; i++)
+        for (j=0; j<COLS; j++) {
+            ba = TEST_REPR_BIT_FAST(a, i, j) ? 1 : 0;
+            bb = TEST_REPR_BIT_FAST(b, i, j) ? 1 : 0;
+            bd = TEST_REPR_BIT_FAST(dst, i, j) ? 1 : 0;
+            ck_assert(bd == (ba & bb));
+        }
+    or_repr(dst, a, b);
+    for (i=0; i<ROWS; i++)
+        for (j=0; j<COLS; j++) {
+            ba = TEST_REPR_BIT_FAST(a, i, j) ? 1 : 0;
+            bb = TEST_REPR_BIT_FAST(b, i, j) ? 1 : 0;
+            bd = TEST_REPR_BIT_FAST(dst, i, j) ? 1 : 0;
+            ck_assert(bd == (ba | bb));
+        }
+    xor_repr(dst, a, b);
+    for (i=0; i<ROWS; i++)
+        for (j=0; j<COLS; j++) {
+            ba = TEST_REPR_BIT_FAST(a, i, j) ? 1 : 0;
+            bb = TEST_REPR_BIT_FAST(b, i, j) ? 1 : 0;
+            bd = TEST_REPR_BIT_FAST(dst, i, j) ? 1 : 0;
+            ck_assert(bd == (ba ^ bb));
+        }
+    andnot_repr(dst, a, b);
+    for (i=0; i<ROWS; i++)
+        for (j=0; j<COLS; j++) {
+            ba = TEST_REPR_BIT_FAST(a, i, j) ? 1 : 0;
+            bb = TEST_REPR_BIT_FAST(b, i, j) ? 1 : 0;
+            bd = TEST_REPR_BIT_FAST(dst, i, j) ? 1 : 0;
+            ck_assert(bd == (ba & !bb));
+        }
+
+    /* destination may alias an operand */
+    xor_repr(dst, dst, dst);
+    ck_assert(popcount_repr(dst) == 0);
+}
+
+static void
+check_indices (void)
+{
+    uint32_t *idx = NULL;
+    uint32_t n, k;
+
+    /* a sparse pattern, with whole vectors of empty words */
+    memset(b->repr, 0, sizeof(uint32_t)*REPR_WORDS(b));
+    random_repr(b, 200);
+
+    n = popcount_repr(b);
+    idx = malloc(sizeof(uint32_t)*(n+1));
+    ck_assert(active_bits_repr(b, idx) == n);
+    for (k=0; k<n; k++) {
+        ck_assert(TEST_REPR_BIT_FAST(b, idx[k]/COLS, idx[k]%COLS));
+        if (k)
+            ck_assert(idx[k-1] < idx[k]);
+    }
+
+    /* and back again, onto a cleared pattern */
+    memset(dst->repr, 0, sizeof(uint32_t)*REPR_WORDS(dst));
+    set_bits_repr(dst, idx, n);
+    ck_assert(hamming_repr(dst, b) == 0);
+
+    /* handed over as a list, once each and in order */
+    ck_assert(set_active_repr(dst, idx, n) == 0);
+    pack_repr(dst);
+    ck_assert(hamming_repr(dst, b) == 0);
+    idx[0] = ROWS*COLS;
+    ck_assert(set_active_repr(dst, idx, 1) == 1);
+    idx[0] = 5;
+    idx[1] = 5;
+    ck_assert(set_active_repr(dst, idx, 2) == 1);
+    idx[1] = 4;
+    ck_assert(set_active_repr(dst, idx, 2) == 1);
+    ck_assert(!dst->sparse);
+
+    free(idx);
+}
+
+START_TEST(test_sdr_bitwise)
+    cpu_dispatch();
+    check_bitwise();
+END_TEST
+
+START_TEST(test_sdr_indices)
+    cpu_dispatch();
+    check_indices();
+END_TEST
+
+/* capped by the environment, as the first kernels to bind */
+START_TEST(test_sdr_cap)
+    ck_assert(setenv("HTM_CPU", "sse2", 1) == 0);
+    cpu_dispatch();
+    ck_assert(cpu_bound() == CPU_SSE2);
+    check_bitwise();
+    check_indices();
+    ck_assert(unsetenv("HTM_CPU") == 0);
+END_TEST
+
+/* the kernels of every level the CPU runs, the counts over every
+   length, so each vector loop ends on each tail */
+START_TEST(test_sdr_levels)
+    enum cpu_level level, bound = cpu_bound();
+    uint32_t w, k, pa, ov, hd;
+
+    for (level=CPU_SSE2; level<=cpu_detect(); level++) {
+        ck_assert(cpu_bind(level) == level);
+        for (w=0; w<=REPR_WORDS(a); w++) {
+            pa = ov = hd = 0;
+            for (k=0; k<w; k++) {
+                pa += __builtin_popcount(a->repr[k]);
+                ov += __builtin_popcount(a->repr[k] & b->repr[k]);
+                hd += __builtin_popcount(a->repr[k] ^ b->repr[k]);
+            }
+            ck_assert(popcount_words(a->repr, w) == pa);
+            ck_assert(xor_popcount_words(a->repr, b->repr, w) == hd);
+            if (w == REPR_WORDS(a))
+                ck_assert(overlap_repr(a, b) == ov);
+        }
+        check_bitwise();
+    }
+    /* the sparse pattern replaces b, so it goes after the counts */
+    for (level=CPU_SSE2; level<=cpu_detect(); level++) {
+        cpu_bind(level);
+        check_indices();
+    }
+    cpu_bind(bound);
+END_TEST
+
+START_TEST(test_repr_row_bits)
+    uint32_t r, c, n, k, span;
+
+    /* every row starts on a 64 bit boundary */
+    ck_assert(a->stride % 2 == 0);
+    ck_assert(a->stride*SZ >= COLS);
+
+    /* windows at every column of every row, including the ones
+       ending on the last column of the last row */
+    for (r=0; r<ROWS; r++) {
+        for (c=0; c<COLS; c++) {
+            n = COLS-c < SZ ? COLS-c : SZ;
+            span = row_bits_repr(a, r, c, n);
+            for (k=0; k<n; k++)
+                ck_assert(((span >> k) & 1) ==
+                    (TEST_REPR_BIT_FAST(a, r, c+k) ? 1 : 0));
+            if (n < SZ)
+                ck_assert((span >> n) == 0);
+        }
+    }
+END_TEST
+
+/* the flat bitstream of layout 1 converts both ways */
+START_TEST(test_repr_flat)
+    uint32_t *flat = malloc(sizeof(uint32_t)*FLAT_WORDS(a));
+    uint32_t r, c, k;
+
+    ck_assert(flat != NULL);
+    ck_assert(FLAT_WORDS(a) == (ROWS*COLS+31)/32);
+    repr_to_flat(a, flat);
+    for (r=0; r<ROWS; r++) {
+        for (c=0; c<COLS; c++) {
+            k = r*COLS+c;
+            ck_assert(((flat[k/32] >> k%32) & 1) ==
+                (TEST_REPR_BIT_FAST(a, r, c) ? 1 : 0));
+        }
+    }
+    /* nothing past the last bit */
+    ck_assert((flat[FLAT_WORDS(a)-1] >> (ROWS*COLS%32)) == 0);
+
+    /* stale padding in dst is cleared */
+    memset(dst->repr, 0xff, sizeof(uint32_t)*REPR_WORDS(dst));
+    repr_from_flat(dst, flat);
+    ck_assert(!dst->sparse);
+    for (k=0; k<REPR_WORDS(dst); k++)
+        ck_assert(dst->repr[k] == a->repr[k]);
+
+    free(flat);
+END_TEST
+
+static Suite *
+test_suite(void)
+{
+    Suite *s = suite_create("SDR Operations Tests");
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    /* first, so no other test has bound the kernels before it */
+    tcase_add_test(tc_core, test_sdr_cap);
+    tcase_add_test(tc_core, test_sdr_counts);
+    tcase_add_test(tc_core, test_sdr_bitwise);
+    tcase_add_test(tc_core, test_sdr_indices);
+    tcase_add_test(tc_core, test_repr_row_bits);
+    tcase_add_test(tc_core, test_repr_flat);
+    tcase_add_test(tc_core, test_sdr_levels);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = test_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
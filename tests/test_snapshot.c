@@ -0,0 +1,138 @@
+/* pthreads are POSIX, not C99 */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <check.h>
+
+#include "htm.h"
+#include "snapshot.h"
+
+#define ROWS 23
+#define COLS 41
+#define STEPS 200000
+
+static struct snapshot_buf sb;
+
+/* every frame is stamped with its step throughout, so a frame
+   the writer was still filling shows two different steps */
+static void*
+write_frames (void *arg)
+{
+    snapshot_t *frame = NULL;
+    uint64_t step;
+    uint32_t i;
+
+    (void)arg;
+    for (step=1; step<=STEPS; step++) {
+        frame = snapshot_back(&sb);
+        frame->step = step;
+        for (i=0; i<ROWS*COLS; i++)
+            frame->overlaps[i] = (uint32_t)step;
+        memset(frame->active->repr, (int)(step & 0xff),
+            sizeof(uint32_t)*REPR_WORDS(frame->active));
+        publish_snapshot(&sb);
+    }
+
+    return NULL;
+}
+
+static void
+setup (void)
+{
+    struct layer layer;
+
+    memset(&layer, 0, sizeof(struct layer));
+    layer.height = ROWS;
+    layer.width = COLS;
+    ck_assert(alloc_snapshots(&sb, &layer) == 0);
+}
+
+static void
+teardown (void)
+{
+    free_snapshots(&sb);
+}
+
+START_TEST(test_snapshot_empty)
+    ck_assert(read_snapshot(&sb) == NULL);
+    snapshot_back(&sb)->step = 1;
+    publish_snapshot(&sb);
+    ck_assert(read_snapshot(&sb) != NULL);
+    ck_assert(read_snapshot(&sb)->step == 1);
+    ck_assert(read_snapshot(&sb)->height == ROWS);
+    ck_assert(read_snapshot(&sb)->width == COLS);
+END_TEST
+
+START_TEST(test_snapshot_latest)
+    const snapshot_t *frame = NULL;
+    uint64_t step;
+
+    /* unread frames are dropped for newer ones */
+    for (step=1; step<=5; step++) {
+        snapshot_back(&sb)->step = step;
+        publish_snapshot(&sb);
+    }
+    frame = read_snapshot(&sb);
+    ck_assert(frame && frame->step == 5);
+    /* nothing new, the reader keeps its frame */
+    ck_assert(read_snapshot(&sb) == frame);
+    ck_assert(frame->step == 5);
+END_TEST
+
+START_TEST(test_snapshot_concurrent)
+    pthread_t writer;
+    const snapshot_t *frame = NULL;
+    uint64_t last = 0;
+    uint32_t i, w, word;
+    unsigned char byte;
+    int rc;
+
+    rc = pthread_create(&writer, NULL, write_frames, NULL);
+    ck_assert(rc == 0);
+    while (last < STEPS) {
+        if (!(frame = read_snapshot(&sb)))
+            continue;
+        ck_assert(frame->step >= last);
+        last = frame->step;
+        for (i=0; i<ROWS*COLS; i++)
+            ck_assert(frame->overlaps[i] == (uint32_t)last);
+        byte = (unsigned char)(last & 0xff);
+        memset(&word, byte, sizeof(uint32_t));
+        for (w=0; w<REPR_WORDS(frame->active); w++)
+            ck_assert(frame->active->repr[w] == word);
+    }
+    pthread_join(writer, NULL);
+END_TEST
+
+static Suite *
+test_suite(void)
+{
+    Suite *s = suite_create("Snapshot Tests");
+    /* Core test case */
+    TCase *tc_core = tcase_create("Core");
+    tcase_add_checked_fixture(tc_core, setup, teardown);
+    tcase_add_test(tc_core, test_snapshot_empty);
+    tcase_add_test(tc_core, test_snapshot_latest);
+    tcase_add_test(tc_core, test_snapshot_concurrent);
+    tcase_set_timeout(tc_core, 60);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main(void)
+{
+    int number_failed;
+    Suite *s;
+    SRunner *sr;
+
+    s = test_suite();
+    sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}